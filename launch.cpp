@@ -18,6 +18,10 @@
 #include <sys/stat.h>
 
 #include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
 
 // includes, CUDA
 #include <cuda.h>
@@ -63,20 +67,38 @@ inline CUdevice cudaDeviceInit()
     return cuDevice;
 }
 
+// The session keeps one context on the device, and loads the module of each 
+// kernel once.
+static CUcontext hContext = 0;
+static CUdevice  hDevice  = 0;
+static std::map<std::string, CUfunction> LoadedKernels;
+
+static void initContext()
+{
+    if (hContext)
+        return;
+
+    // Initialize 
+    hDevice = cudaDeviceInit();
+
+    // Create context on the device
+    checkCudaErrors(cuCtxCreate(&hContext, CU_CTX_BLOCKING_SYNC, hDevice));
+}
+
 CUresult initCUDA(const char *kernelname, 
-                  CUcontext *phContext,
-                  CUdevice *phDevice,
-                  CUmodule *phModule,
                   CUfunction *phKernel,	
                   const char *ptx)
 {
-    // Initialize 
-    *phDevice = cudaDeviceInit();
+    initContext();
 
-    // Create context on the device
-    checkCudaErrors(cuCtxCreate(phContext, CU_CTX_BLOCKING_SYNC, *phDevice));
+    std::map<std::string, CUfunction>::iterator I = LoadedKernels.find(kernelname);
+    if (I != LoadedKernels.end()) {
+        *phKernel = I->second;
+        return CUDA_SUCCESS;
+    }
 
     // Load the PTX 
+    CUmodule hModule = 0;
     {
         const unsigned int jitNumOptions = 2;
         CUjit_option *jitOptions = new CUjit_option[jitNumOptions];
@@ -93,7 +115,7 @@ CUresult initCUDA(const char *kernelname,
         jitOptVals[1] = jitLogBuffer;
 
         // compile with set parameters
-        CUresult status = cuModuleLoadDataEx(phModule, ptx, jitNumOptions, jitOptions, (void **)jitOptVals);
+        CUresult status = cuModuleLoadDataEx(&hModule, ptx, jitNumOptions, jitOptions, (void **)jitOptVals);
 
         if (CUDA_SUCCESS != status)
           printf("> PTX JIT log:\n%s\n", jitLogBuffer);
@@ -107,59 +129,618 @@ CUresult initCUDA(const char *kernelname,
     
     // Locate the kernel entry point
     
-    checkCudaErrors(cuModuleGetFunction(phKernel, *phModule, kernelname));
+    checkCudaErrors(cuModuleGetFunction(phKernel, hModule, kernelname));
+    LoadedKernels[kernelname] = *phKernel;
 
     return CUDA_SUCCESS;
 }
 
-void LaunchOnGpu(const char *kernel, 
-                 unsigned funcarity, 
-                 unsigned N, 
-                 void **args, 
-                 void *resbuf,
-                 const char *ptxBuff) 
-{ 
-  const unsigned int nThreads = std::min<unsigned>(N, 128);
-  const unsigned int nBlocks = (N + nThreads - 1) / nThreads;
-  CUcontext    hContext = 0;
-  CUdevice     hDevice  = 0;
-  CUmodule     hModule  = 0;
-  CUfunction   hKernel  = 0;
-  CUdeviceptr  d_data   = 0;
-  double       *h_data   = 0;
+// LaunchPlan - Everything launching a kernel over N elements needs besides
+// the data: the kernel, the launch configuration, a stream and device 
+// buffers for the inputs and results.  Launches of one plan are ordered by
+// its stream, so they can share the buffers.  A map call site keeps the 
+// plan of its first run and replays it while the lengths stay the same, 
+// see RunMap.
+struct LaunchPlan {
+    CUfunction kernel;
+    unsigned nargs, nres, N;
+    unsigned nThreads, nBlocks;
+    CUstream stream;
+    std::vector<bool> generated;          // which inputs are generated
+    std::vector<CUdeviceptr> deviceargs;  // inputs, then results; 0 if generated
+};
+
+// PendingLaunch - A kernel launch that may still be running, with the copies
+// in and out of it.  Until it is retired, the host buffers it reads or 
+// writes must not be touched by the host.
+struct PendingLaunch {
+    CUevent  done;
+    std::vector<void *> inputs;     // host buffers it copies in
+    std::vector<void *> outputs;    // host buffers it copies results to
+    LaunchPlan *owned;              // plan to destroy with it, if any
+};
+
+static std::list<PendingLaunch *> PendingLaunches;   // oldest first
+
+void DestroyLaunchPlan(LaunchPlan *P);
+
+// Wait for launch L and free what it used.
+static void retireLaunch(PendingLaunch *L)
+{
+    checkCudaErrors(cuEventSynchronize(L->done));
+    checkCudaErrors(cuEventDestroy(L->done));
+    if (L->owned)
+        DestroyLaunchPlan(L->owned);
+    delete L;
+}
+
+// PendingHostCall - A call of an extern that writes only its vector 
+// arguments, queued by QueueHostCall.  Until it has run, the host buffers 
+// it writes must not be touched, like those of a pending launch.
+struct PendingHostCall {
+    void (*run)(char *env);
+    char *env;                      // its arguments, freed once it ran
+    std::vector<void *> outputs;    // host buffers it writes
+};
+
+static std::vector<PendingHostCall> PendingHostCalls;
+
+// runHostCalls - Run the queued host calls together on the host threads.
+// Each waited for the buffers it writes before it was queued, so no two 
+// write the same one.
+static void runHostCalls()
+{
+    if (PendingHostCalls.empty())
+        return;
+    std::vector<PendingHostCall> calls;
+    calls.swap(PendingHostCalls);
+    int n = (int)calls.size();
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < n; i++)
+        calls[i].run(calls[i].env);
+    for (int i = 0; i < n; i++)
+        free(calls[i].env);
+}
+
+static bool writtenByHostCall(void *buf)
+{
+    for (unsigned i = 0; i < PendingHostCalls.size(); i++)
+        if (std::find(PendingHostCalls[i].outputs.begin(), 
+                      PendingHostCalls[i].outputs.end(), buf) != 
+            PendingHostCalls[i].outputs.end())
+            return true;
+    return false;
+}
+
+// QueueHostCall - Queue run(env), which writes only the host buffers 
+// outputs.  It runs, with the calls queued alongside it, once one of them
+// or all outstanding work is waited for, while the launches queued before
+// keep the device busy.  Takes ownership of env, from malloc.
+void QueueHostCall(void (*run)(char *), char *env, void **outputs, 
+                   unsigned noutputs)
+{
+    PendingHostCall C;
+    C.run = run;
+    C.env = env;
+    C.outputs.assign(outputs, outputs + noutputs);
+    PendingHostCalls.push_back(C);
+}
+
+static bool touches(PendingLaunch *L, void *buf)
+{
+    return std::find(L->inputs.begin(), L->inputs.end(), buf) != L->inputs.end() ||
+           std::find(L->outputs.begin(), L->outputs.end(), buf) != L->outputs.end();
+}
+
+// SyncHostBuffer - Wait for the launches and host calls that read or write
+// the host buffer buf, so the host may read, write or free it.
+void SyncHostBuffer(void *buf)
+{
+    if (writtenByHostCall(buf))
+        runHostCalls();
+
+    std::list<PendingLaunch *>::iterator I = PendingLaunches.begin();
+    while (I != PendingLaunches.end()) {
+        if (touches(*I, buf)) {
+            retireLaunch(*I);
+            I = PendingLaunches.erase(I);
+        }
+        else
+            ++I;
+    }
+}
+
+// SyncAllLaunches - Wait for all outstanding launches and host calls.
+void SyncAllLaunches()
+{
+    runHostCalls();
+    while (!PendingLaunches.empty()) {
+        retireLaunch(PendingLaunches.front());
+        PendingLaunches.pop_front();
+    }
+}
+
+// waitForProducers - Make stream wait for the launches still producing the
+// host buffer buf, after running the host calls queued to write it.
+static void waitForProducers(CUstream stream, void *buf)
+{
+    if (writtenByHostCall(buf))
+        runHostCalls();
+
+    std::list<PendingLaunch *>::iterator I;
+    for (I = PendingLaunches.begin(); I != PendingLaunches.end(); ++I)
+        if (std::find((*I)->outputs.begin(), (*I)->outputs.end(), buf) != 
+            (*I)->outputs.end())
+            checkCudaErrors(cuStreamWaitEvent(stream, (*I)->done, 0));
+}
+
+// AllocPinnedHost/FreePinnedHost - Page-locked host memory, which the copies
+// of an asynchronous launch need to overlap with the host.
+void *AllocPinnedHost(size_t bytes)
+{
+    initContext();
+    void *p = 0;
+    if (cuMemAllocHost(&p, bytes) != CUDA_SUCCESS)
+        return 0;
+    return p;
+}
+
+void FreePinnedHost(void *p)
+{
+    checkCudaErrors(cuMemFreeHost(p));
+}
+
+// Threads per block of a map launch; fewer for shorter vectors.
+static const unsigned BlockSize = 128;
+
+// ExactGrid - Return true if plans over N elements launch exactly one thread
+// per element, see CreateLaunchPlan.
+bool ExactGrid(unsigned N)
+{
+  return N <= BlockSize || N % BlockSize == 0;
+}
+
+// CreateLaunchPlan - Plan launches of kernel over N elements, reading nargs
+// inputs, of which those flagged in generated are generated, and writing 
+// nres results.
+LaunchPlan *CreateLaunchPlan(const char *kernel,
+                             const char *ptxBuff,
+                             unsigned nargs,
+                             const std::vector<bool> &generated,
+                             unsigned nres,
+                             unsigned N)
+{
+  LaunchPlan *P = new LaunchPlan;
+  P->nargs = nargs;
+  P->generated = generated;
+  P->nres = nres;
+  P->N = N;
+  P->nThreads = std::min(N, BlockSize);
+  P->nBlocks = (N + P->nThreads - 1) / P->nThreads;
 
   // Initialize the device and get a handle to the kernel
-  checkCudaErrors(initCUDA(kernel, &hContext, &hDevice, &hModule, &hKernel, ptxBuff));
+  checkCudaErrors(initCUDA(kernel, &P->kernel, ptxBuff));
+  checkCudaErrors(cuStreamCreate(&P->stream, 0));
+
+  // Allocate memory for the inputs and results on the device
+  P->deviceargs.resize(nargs + nres, 0);
+  for (unsigned i = 0; i < nargs + nres; i++) { 
+    if (i < nargs && generated[i])
+      continue;
+    checkCudaErrors(cuMemAlloc(&P->deviceargs[i], N*sizeof(double)));
+  }
+  return P;
+}
+
+// DestroyLaunchPlan - Free a plan once its launches are done.
+void DestroyLaunchPlan(LaunchPlan *P)
+{
+  checkCudaErrors(cuStreamSynchronize(P->stream));
+  for (unsigned i = 0; i < P->deviceargs.size(); i++)
+    if (P->deviceargs[i])
+      checkCudaErrors(cuMemFree(P->deviceargs[i]));
+  checkCudaErrors(cuStreamDestroy(P->stream));
+  delete P;
+}
+
+// LaunchPlanned - Launch the kernel of plan P.  It reads the host vectors in
+// args and writes one result vector into each of the buffers in resbufs.  A
+// generated input takes its start and step, affine[2*i] and affine[2*i+1],
+// instead of a vector, whose entry in args is ignored.  The values of the nconsts global constants the
+// kernel reads are in consts.
+//
+// If async is set, LaunchPlanned returns as soon as the copies and the
+// kernel are queued, and launches of other plans run concurrently; a launch
+// only waits (on the device) for the launches producing its inputs.  Use 
+// SyncHostBuffer before the host accesses a buffer a launch may use.  If 
+// owned is set, the plan is destroyed with the launch.
+void LaunchPlanned(LaunchPlan *P, 
+                   void **args, 
+                   double *affine,
+                   void **resbufs,
+                   unsigned nconsts,
+                   double *consts,
+                   bool async,
+                   bool owned)
+{ 
+  unsigned nargs = P->nargs, nres = P->nres, N = P->N;
+  PendingLaunch *L = new PendingLaunch;
+  L->owned = owned ? P : 0;
+  checkCudaErrors(cuEventCreate(&L->done, CU_EVENT_DISABLE_TIMING));
 
-  // Allocate memory for result vector on the host and device
-  h_data = (double *)resbuf;
+  // Wait for the launches still producing the inputs
   unsigned i; 
-  CUdeviceptr *deviceargs = (CUdeviceptr*) malloc(sizeof(CUdeviceptr)*(funcarity + 1));
-  for (i = 0; i < funcarity; i++) { 
-    double *argi = (double *) args[i];
-    checkCudaErrors(cuMemAlloc(&deviceargs[i], N*sizeof(double)));
-    checkCudaErrors(cuMemcpyHtoD(deviceargs[i], argi, N*sizeof(double)));
+  for (i = 0; i < nargs; i++)
+    if (!P->generated[i])
+      waitForProducers(P->stream, args[i]);
+
+  // Copy the inputs to the device
+  for (i = 0; i < nargs; i++) { 
+    if (P->generated[i])
+      continue;
+    checkCudaErrors(cuMemcpyHtoDAsync(P->deviceargs[i], args[i], N*sizeof(double), P->stream));
+    L->inputs.push_back(args[i]);
   }
-  checkCudaErrors(cuMemAlloc(&deviceargs[funcarity], N*sizeof(double))); // return value
+  for (i = 0; i < nres; i++)
+    L->outputs.push_back(resbufs[i]);
 
   // Set the kernel parameters
-  void** params = new void*[funcarity+2];
-  params[0] = (void*)&N;                // length
-  for (i = 1; i < funcarity + 2; i++) { // input and output pointers
-    params[i] = &deviceargs[i-1];
+  void** params = new void*[2*nargs+nres+nconsts+1];
+  unsigned p = 0;
+  params[p++] = (void*)&N;                   // length
+  for (i = 0; i < nargs; i++) {              // input pointers
+    if (P->generated[i]) {
+      params[p++] = &affine[2*i];
+      params[p++] = &affine[2*i+1];
+    }
+    else
+      params[p++] = &P->deviceargs[i];
   }
+  for (i = nargs; i < nargs + nres; i++)     // output pointers
+    params[p++] = &P->deviceargs[i];
+  for (i = 0; i < nconsts; i++)              // global constants
+    params[p++] = &consts[i];
 
-  // Launch the kernel
-  checkCudaErrors(cuLaunchKernel(hKernel, nBlocks, 1, 1, nThreads, 1, 1, 0, 0, params, 0));
+  // Launch the kernel; the parameters are copied when it is queued
+  checkCudaErrors(cuLaunchKernel(P->kernel, P->nBlocks, 1, 1, P->nThreads, 1, 1, 0, P->stream, params, 0));
   	       
-  // Copy the result back to the host
-  checkCudaErrors(cuMemcpyDtoH(h_data, deviceargs[funcarity], N*sizeof(double)));
+  // Copy the results back to the host
+  for (i = 0; i < nres; i++)
+    checkCudaErrors(cuMemcpyDtoHAsync(resbufs[i], P->deviceargs[nargs+i], N*sizeof(double), P->stream));
+  checkCudaErrors(cuEventRecord(L->done, P->stream));
 
-  // free the allocated memory for the arguments 
-  for (i = 0; i < funcarity+1; i++) { 
-    checkCudaErrors(cuMemFree(deviceargs[i]));
-  }
   delete [] params;
-  checkCudaErrors(cuModuleUnload(hModule));
-  checkCudaErrors(cuCtxDestroy(hContext));
+
+  if (async)
+    PendingLaunches.push_back(L);
+  else
+    retireLaunch(L);
+}
+
+// Launch kernel over N elements once, see LaunchPlanned.
+void LaunchOnGpu(const char *kernel, 
+                 unsigned nargs, 
+                 unsigned N, 
+                 void **args, 
+                 const std::vector<bool> &generated,
+                 double *affine,
+                 unsigned nres,
+                 void **resbufs,
+                 unsigned nconsts,
+                 double *consts,
+                 const char *ptxBuff,
+                 bool async) 
+{ 
+  LaunchPlan *P = CreateLaunchPlan(kernel, ptxBuff, nargs, generated, nres, N);
+  LaunchPlanned(P, args, affine, resbufs, nconsts, consts, async, true);
+}
+
+// ChainTileLength - The number of elements of a chain of maps, keeping
+// nbuffers tile-sized buffers on the device, to push through all stages
+// at a time: as many as fill half of the L2 cache, so the tile a stage
+// writes is still in L2 when the next stage reads it.
+static unsigned ChainTileLength(unsigned nbuffers, unsigned N)
+{
+  int l2 = 0;
+  checkCudaErrors(cuDeviceGetAttribute(&l2, CU_DEVICE_ATTRIBUTE_L2_CACHE_SIZE, hDevice));
+  if (l2 <= 0)
+    return N;
+  unsigned tile = l2 / 2 / (nbuffers * sizeof(double));
+  tile -= tile % BlockSize;
+  return std::min(N, std::max(tile, BlockSize));
+}
+
+// LaunchChainOnGpu - Run a chain of nstages maps over N elements, where 
+// stage s launches kernels[s] (from ptx[s]) on the nstageargs[s] inputs
+// listed, in order, in stageargs starting at stage s.  An entry is the 
+// index of one of the nargs host vectors in args, those flagged in 
+// generated taking their start and step from affine as for LaunchPlanned,
+// or -1 for the 
+// result of the previous stage.  Stage s reads nstageconsts[s] global 
+// constants, whose values follow those of the earlier stages in consts.
+// The result of the last stage is copied into result.
+//
+// The chain runs tile by tile (see ChainTileLength): each tile of the 
+// inputs is copied in and goes through every stage before the next one,
+// with thread i of each stage handling element i of the tile.  The results
+// of the inner stages thus stay in L2 instead of making a round trip
+// through DRAM, and only take tile-sized buffers on the device.
+void LaunchChainOnGpu(unsigned nstages,
+                      const char **kernels,
+                      const char **ptx,
+                      unsigned *nstageargs,
+                      int *stageargs,
+                      unsigned *nstageconsts,
+                      double *consts,
+                      unsigned nargs,
+                      unsigned N,
+                      void **args,
+                      const std::vector<bool> &generated,
+                      double *affine,
+                      void *result,
+                      bool async)
+{
+  std::vector<CUfunction> hKernels(nstages);
+  for (unsigned s = 0; s < nstages; s++)
+    checkCudaErrors(initCUDA(kernels[s], &hKernels[s], ptx[s]));
+
+  // The buffers live in a plan owned by the launch: the tile of each input,
+  // two tiles the stages take turns writing, and the tile of the result.
+  unsigned i, ninputs = 0;
+  for (i = 0; i < nargs; i++)
+    ninputs += !generated[i];
+  unsigned tile = ChainTileLength(ninputs + 3, N);
+
+  LaunchPlan *P = new LaunchPlan;
+  P->nargs = nargs;
+  P->generated = generated;
+  P->nres = 1;
+  P->N = tile;
+  P->nThreads = std::min(tile, BlockSize);
+  P->nBlocks = (tile + P->nThreads - 1) / P->nThreads;
+  checkCudaErrors(cuStreamCreate(&P->stream, 0));
+  P->deviceargs.resize(nargs + 3, 0);
+  for (i = 0; i < nargs + 3; i++) {
+    if (i < nargs && generated[i])
+      continue;
+    checkCudaErrors(cuMemAlloc(&P->deviceargs[i], tile*sizeof(double)));
+  }
+  CUdeviceptr *stagebufs = &P->deviceargs[nargs];
+
+  PendingLaunch *L = new PendingLaunch;
+  L->owned = P;
+  checkCudaErrors(cuEventCreate(&L->done, CU_EVENT_DISABLE_TIMING));
+  for (i = 0; i < nargs; i++)
+    if (!generated[i]) {
+      waitForProducers(P->stream, args[i]);
+      L->inputs.push_back(args[i]);
+    }
+  L->outputs.push_back(result);
+
+  std::vector<double> start(nargs);
+  std::vector<void *> params;
+  for (unsigned t0 = 0; t0 < N; t0 += tile) {
+    unsigned len = std::min(tile, N - t0);
+    unsigned nBlocks = (len + P->nThreads - 1) / P->nThreads;
+
+    for (i = 0; i < nargs; i++) {
+      if (generated[i])
+        start[i] = affine[2*i] + t0 * affine[2*i+1];
+      else
+        checkCudaErrors(cuMemcpyHtoDAsync(P->deviceargs[i], (double *)args[i] + t0, 
+                                          len*sizeof(double), P->stream));
+    }
+
+    int *a = stageargs;
+    double *c = consts;
+    for (unsigned s = 0; s < nstages; s++) {
+      CUdeviceptr *in = &stagebufs[(s + 1) % 2];
+      CUdeviceptr *out = s == nstages - 1 ? &stagebufs[2] : &stagebufs[s % 2];
+
+      params.clear();
+      params.push_back(&len);                  // length
+      for (unsigned k = 0; k < nstageargs[s]; k++, a++) {
+        if (*a < 0)                            // previous stage
+          params.push_back(in);
+        else if (generated[*a]) {              // generated
+          params.push_back(&start[*a]);
+          params.push_back(&affine[2 * *a + 1]);
+        }
+        else
+          params.push_back(&P->deviceargs[*a]);
+      }
+      params.push_back(out);                   // result
+      for (unsigned k = 0; k < nstageconsts[s]; k++, c++)
+        params.push_back(c);                   // global constants
+
+      checkCudaErrors(cuLaunchKernel(hKernels[s], nBlocks, 1, 1, P->nThreads, 1, 1, 0, P->stream, &params[0], 0));
+    }
+
+    checkCudaErrors(cuMemcpyDtoHAsync((double *)result + t0, stagebufs[2], 
+                                      len*sizeof(double), P->stream));
+  }
+  checkCudaErrors(cuEventRecord(L->done, P->stream));
+
+  if (async)
+    PendingLaunches.push_back(L);
+  else
+    retireLaunch(L);
+}
+
+// Blocks per multiprocessor of a reduction launch: enough to hide latency,
+// while leaving few partials for the host to merge.
+static const unsigned ReductionBlocksPerSM = 8;
+
+// LaunchReductionOnGpu - Launch the reduction kernel over N (> 0) elements 
+// of the nargs host vectors in args, taken as for LaunchPlanned, with a grid
+// of at most ReductionBlocksPerSM blocks per multiprocessor, its threads 
+// striding over the vectors.  Each thread writes nvalues partial values, 
+// value k of thread i to partials[k * nthreads + i].  The kernel takes the 
+// size, the inputs, the pointer to the partials and the nconsts global 
+// constants in consts.  Waits for the partials, and returns nthreads.
+//
+// If chunk is not 0, the kernel has each thread visit a chunk of that many
+// elements instead, and the launch has one thread per chunk (rounded up to
+// whole blocks), so the number and contents of the partials do not depend
+// on the device.
+unsigned LaunchReductionOnGpu(const char *kernel,
+                              const char *ptxBuff,
+                              unsigned nargs,
+                              unsigned N,
+                              void **args,
+                              const std::vector<bool> &generated,
+                              double *affine,
+                              unsigned nconsts,
+                              double *consts,
+                              unsigned nvalues,
+                              unsigned chunk,
+                              std::vector<double> &partials)
+{
+  LaunchPlan *P = CreateLaunchPlan(kernel, ptxBuff, nargs, generated, 0, N);
+  if (chunk) {
+    unsigned nchunks = (N + chunk - 1) / chunk;
+    P->nThreads = std::min(nchunks, BlockSize);
+    P->nBlocks = (nchunks + P->nThreads - 1) / P->nThreads;
+  }
+  else {
+    int sms = 1;
+    checkCudaErrors(cuDeviceGetAttribute(&sms, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, hDevice));
+    P->nBlocks = std::min(P->nBlocks, std::max(sms, 1) * ReductionBlocksPerSM);
+  }
+  unsigned nthreads = P->nBlocks * P->nThreads;
+
+  CUdeviceptr devicepartials;
+  checkCudaErrors(cuMemAlloc(&devicepartials, nvalues*nthreads*sizeof(double)));
+
+  unsigned i;
+  for (i = 0; i < nargs; i++) {
+    if (generated[i])
+      continue;
+    waitForProducers(P->stream, args[i]);
+    checkCudaErrors(cuMemcpyHtoDAsync(P->deviceargs[i], args[i], N*sizeof(double), P->stream));
+  }
+
+  std::vector<void *> params;
+  params.push_back(&N);                        // length
+  for (i = 0; i < nargs; i++) {                // inputs
+    if (generated[i]) {
+      params.push_back(&affine[2*i]);
+      params.push_back(&affine[2*i+1]);
+    }
+    else
+      params.push_back(&P->deviceargs[i]);
+  }
+  params.push_back(&devicepartials);           // partials
+  for (i = 0; i < nconsts; i++)                // global constants
+    params.push_back(&consts[i]);
+
+  checkCudaErrors(cuLaunchKernel(P->kernel, P->nBlocks, 1, 1, P->nThreads, 1, 1, 0, P->stream, &params[0], 0));
+
+  partials.resize(nvalues*nthreads);
+  checkCudaErrors(cuMemcpyDtoHAsync(&partials[0], devicepartials, nvalues*nthreads*sizeof(double), P->stream));
+  checkCudaErrors(cuStreamSynchronize(P->stream));
+  checkCudaErrors(cuMemFree(devicepartials));
+  DestroyLaunchPlan(P);
+  return nthreads;
+}
+
+// LaunchMatMulOnGpu - Multiply the row-major m x k matrix a by the k x n
+// matrix b into the m x n matrix c, host arrays all, with the matrix 
+// multiply kernel (see CreateNVVMMatMulKernel) in blocks of tile x tile
+// threads.  Waits for the product.
+void LaunchMatMulOnGpu(const char *kernel,
+                       const char *ptxBuff,
+                       unsigned tile,
+                       unsigned m,
+                       unsigned k,
+                       unsigned n,
+                       double *a,
+                       double *b,
+                       double *c)
+{
+  CUfunction hKernel;
+  checkCudaErrors(initCUDA(kernel, &hKernel, ptxBuff));
+  CUstream stream;
+  checkCudaErrors(cuStreamCreate(&stream, 0));
+
+  CUdeviceptr da, db, dc;
+  checkCudaErrors(cuMemAlloc(&da, std::max(m*k, 1u)*sizeof(double)));
+  checkCudaErrors(cuMemAlloc(&db, std::max(k*n, 1u)*sizeof(double)));
+  checkCudaErrors(cuMemAlloc(&dc, std::max(m*n, 1u)*sizeof(double)));
+  waitForProducers(stream, a);
+  waitForProducers(stream, b);
+  checkCudaErrors(cuMemcpyHtoDAsync(da, a, m*k*sizeof(double), stream));
+  checkCudaErrors(cuMemcpyHtoDAsync(db, b, k*n*sizeof(double), stream));
+
+  void *params[] = { &m, &k, &n, &da, &db, &dc };
+  checkCudaErrors(cuLaunchKernel(hKernel, (n + tile - 1) / tile, (m + tile - 1) / tile, 1,
+                                 tile, tile, 1, 0, stream, params, 0));
+
+  checkCudaErrors(cuMemcpyDtoHAsync(c, dc, m*n*sizeof(double), stream));
+  checkCudaErrors(cuStreamSynchronize(stream));
+  checkCudaErrors(cuMemFree(da));
+  checkCudaErrors(cuMemFree(db));
+  checkCudaErrors(cuMemFree(dc));
+  checkCudaErrors(cuStreamDestroy(stream));
+}
+
+// LaunchSortOnGpu - Sort the n 64-bit keys of the host array keys stably,
+// and the n elements of the host array perm along with them unless it is
+// null, with the radix sort kernels (see CreateNVVMRadixSortKernels) for 
+// tiles of tile keys, named in kernels: for each of the npasses digit 
+// shifts in shifts, least significant first, a count, a scan and a scatter
+// launch.  The keys stay on the device between passes.  Waits for the sort.
+void LaunchSortOnGpu(const char **kernels,
+                     const char *ptxBuff,
+                     unsigned tile,
+                     unsigned npasses,
+                     const unsigned *shifts,
+                     unsigned n,
+                     void *keys,
+                     int *perm)
+{
+  const unsigned Digits = 256;  // threads per block, one per digit
+  CUfunction hCount, hScan, hScatter;
+  checkCudaErrors(initCUDA(kernels[0], &hCount, ptxBuff));
+  checkCudaErrors(initCUDA(kernels[1], &hScan, ptxBuff));
+  checkCudaErrors(initCUDA(kernels[2], &hScatter, ptxBuff));
+  CUstream stream;
+  checkCudaErrors(cuStreamCreate(&stream, 0));
+
+  unsigned nblocks = (n + tile - 1) / tile, ncounts = nblocks * Digits;
+  CUdeviceptr dkeys[2], dperm[2] = { 0, 0 }, dcounts;
+  for (unsigned i = 0; i < 2; i++) {
+    checkCudaErrors(cuMemAlloc(&dkeys[i], n*sizeof(unsigned long long)));
+    if (perm)
+      checkCudaErrors(cuMemAlloc(&dperm[i], n*sizeof(int)));
+  }
+  checkCudaErrors(cuMemAlloc(&dcounts, ncounts*sizeof(int)));
+  checkCudaErrors(cuMemcpyHtoDAsync(dkeys[0], keys, n*sizeof(unsigned long long), stream));
+  if (perm)
+    checkCudaErrors(cuMemcpyHtoDAsync(dperm[0], perm, n*sizeof(int), stream));
+
+  unsigned src = 0;
+  for (unsigned p = 0; p < npasses; p++) {
+    unsigned shift = shifts[p];
+    void *countParams[] = { &n, &shift, &dkeys[src], &dcounts };
+    checkCudaErrors(cuLaunchKernel(hCount, nblocks, 1, 1, Digits, 1, 1, 0, stream, countParams, 0));
+    void *scanParams[] = { &ncounts, &dcounts };
+    checkCudaErrors(cuLaunchKernel(hScan, 1, 1, 1, Digits, 1, 1, 0, stream, scanParams, 0));
+    void *scatterParams[] = { &n, &shift, &dkeys[src], &dkeys[1 - src], 
+                              &dperm[src], &dperm[1 - src], &dcounts };
+    checkCudaErrors(cuLaunchKernel(hScatter, nblocks, 1, 1, Digits, 1, 1, 0, stream, scatterParams, 0));
+    src = 1 - src;
+  }
+
+  checkCudaErrors(cuMemcpyDtoHAsync(keys, dkeys[src], n*sizeof(unsigned long long), stream));
+  if (perm)
+    checkCudaErrors(cuMemcpyDtoHAsync(perm, dperm[src], n*sizeof(int), stream));
+  checkCudaErrors(cuStreamSynchronize(stream));
+  for (unsigned i = 0; i < 2; i++) {
+    checkCudaErrors(cuMemFree(dkeys[i]));
+    if (perm)
+      checkCudaErrors(cuMemFree(dperm[i]));
+  }
+  checkCudaErrors(cuMemFree(dcounts));
+  checkCudaErrors(cuStreamDestroy(stream));
 }
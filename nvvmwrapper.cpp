@@ -29,6 +29,7 @@
 
 #include "llvm/Metadata.h"
 #include <cstdio>
+#include <math.h>
 #include <stdlib.h>
 #include <string>
 #include <map>
@@ -42,11 +43,7 @@ using namespace llvm;
 
 
 extern Module *TheModule; 
-extern std::map<std::string, AllocaInst*> NamedValues;
-
-extern AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-                                          const std::string &VarName,
-                                          bool isVector);
+extern unsigned NumMapResults(Function *F);
 
 static int lRunBitcodeVerifier(llvm::Module *fModule)
 {
@@ -61,11 +58,13 @@ static int lRunBitcodeVerifier(llvm::Module *fModule)
   return error;
 }
 
-void PruneUnrelatedFunctionsAndVariables(Module *M, std::string name)
+void PruneUnrelatedFunctionsAndVariables(Module *M, 
+                                         const std::vector<Function*> &roots)
 { 
   std::set<std::string> visited;
   std::deque<std::string> worklist;
-  worklist.push_back(name);
+  for (unsigned i = 0; i < roots.size(); i++)
+    worklist.push_back(roots[i]->getName().str());
   while (!worklist.empty()) { 
     std::string func = worklist.back(); 
     worklist.pop_back();
@@ -110,181 +109,1076 @@ void PruneUnrelatedFunctionsAndVariables(Module *M, std::string name)
       F->eraseFromParent();
   }
 
-  // now erase unused global variables
+  // now erase unused global variables; the global constants the remaining
+  // functions read are lowered by LowerGlobalConstants.
   for (Module::global_iterator I = M->global_begin(); I != M->global_end(); ) {
     GlobalVariable *V = I++;
-    V->eraseFromParent();
+    if (V->use_empty())
+      V->eraseFromParent();
+  }
+}
+
+// The session global constants (see GlobalScalarsAST in toy.cpp) the mapped
+// functions read are passed to the kernel as uniform parameters.  On entry
+// the kernel stores each in a shared memory variable, where the functions 
+// then read it.  A change of value thus needs no new kernel, and launches
+// queued with different values do not interfere.  constants receives the 
+// names of the globals, in the order of their parameters.  Kernels cannot
+// assign the globals; toy.cpp rejects maps of functions that do.
+static void LowerGlobalConstants(Module *M, 
+                                 std::vector<GlobalVariable*> &shared,
+                                 std::vector<std::string> &constants)
+{
+  Type *doubleTy = Type::getDoubleTy(getGlobalContext());
+  std::vector<GlobalVariable*> globals;
+  for (Module::global_iterator I = M->global_begin(); I != M->global_end(); ++I)
+    if (I->getType()->getElementType() == doubleTy && !I->use_empty())
+      globals.push_back(I);
+
+  for (unsigned i = 0; i < globals.size(); i++) {
+    GlobalVariable *G = globals[i];
+    GlobalVariable *S = new GlobalVariable(*M, doubleTy, false, 
+                                           GlobalValue::InternalLinkage,
+                                           UndefValue::get(doubleTy), 
+                                           G->getName() + ".shared", 
+                                           0, false, 3);
+    while (!G->use_empty()) {
+      LoadInst *L = cast<LoadInst>(G->use_back());
+      L->replaceAllUsesWith(new LoadInst(S, L->getName(), L));
+      L->eraseFromParent();
+    }
+    constants.push_back(G->getName());
+    shared.push_back(S);
+    G->eraseFromParent();
+  }
+}
+
+// GetNVVMIntrinsic - The declaration of the NVVM intrinsic name in M: a 
+// special register read (returning an int) or the barrier.
+static Function *GetNVVMIntrinsic(Module *M, const char *name)
+{
+  Function *F = M->getFunction(name);
+  if (F == NULL) {
+    // create an extern declaration for llvm-intrinsic
+    LLVMContext &Context = getGlobalContext();
+    Type *retTy = std::string(name) == "llvm.nvvm.barrier0" ? 
+      Type::getVoidTy(Context) : Type::getInt32Ty(Context);
+    FunctionType *FunTy = FunctionType::get(retTy, false);
+    F = Function::Create(FunTy, Function::ExternalLinkage, name, M);
+  }
+  return F;
+}
+
+// MarkKernel - Add the nvvm annotation that kerF is a kernel function. 
+static void MarkKernel(Module *M, Function *kerF)
+{
+  LLVMContext &Context = getGlobalContext();
+  Type *int32Type = Type::getInt32Ty(Context); 
+  std::vector<Value *> Vals;
+  NamedMDNode *nvvmannotate = M->getOrInsertNamedMetadata("nvvm.annotations");
+  MDString *str = MDString::get(Context, "kernel");
+  Value *one = ConstantInt::get(int32Type, 1);
+  Vals.push_back(kerF);
+  Vals.push_back(str);
+  Vals.push_back(one);  
+  MDNode *mdNode = MDNode::get(Context, Vals);
+
+  nvvmannotate->addOperand(mdNode); 
+}
+
+// EmitKernelInputs - Append the element idxreg of each input of a kernel, 
+// whose parameters kernelArgs start with the size, to inputs: loaded from 
+// the pointer of the input, or computed as start + idxreg * step if it is 
+// generated.  Return the index of the parameter after the inputs.
+static unsigned EmitKernelInputs(IRBuilder<> &Builder,
+                                 const std::vector<Value *> &kernelArgs,
+                                 const std::vector<bool> &generated,
+                                 Value *idxreg,
+                                 std::vector<Value *> &inputs)
+{
+  Type *doubleTy = Type::getDoubleTy(getGlobalContext());
+  unsigned in = 1;
+  for (unsigned i = 0; i < generated.size(); i++) {
+    if (generated[i]) {
+      Value *start = kernelArgs[in++];
+      Value *step = kernelArgs[in++];
+      Value *idxfp = Builder.CreateUIToFP(idxreg, doubleTy, "idxfp");
+      inputs.push_back(Builder.CreateFAdd(start, 
+                                          Builder.CreateFMul(idxfp, step)));
+      continue;
+    }
+    Value *gep = Builder.CreateGEP(kernelArgs[in++], idxreg); 
+    inputs.push_back(Builder.CreateLoad(gep));
   }
+  return in;
 }
 
-// To be able to map an expression f() onto a vector on a GPU, we create a wrapper 
-// kernel function for F and mark it as a kernel function with nvvm.annotations. 
+// To be able to map functions onto vectors on a GPU, we create a wrapper 
+// kernel for them and mark it as a kernel function with nvvm.annotations. 
 // See the NVVM IR Specification document. The data from host to device need to 
 // copied into device memory, therefore the kernel function takes pointer arguments.  
-// The return value is written into the memory as well. 
+// The return values are written into the memory as well. 
+//
+// The global constants the functions read follow the result pointers, see
+// LowerGlobalConstants.
+//
+// If fixedN is not 0, the kernel is specialized for N == fixedN, which it 
+// then compares the index with instead of its size parameter, and if exact
+// is set as well, the launch has one thread per element, so there is no 
+// bounds check at all.
 //
-// For f(double x, double y)
+// Several functions can be mapped by one kernel, sharing the loads of the 
+// input vectors they have in common (horizontal fusion).  argmap[f] lists 
+// which of the nargs inputs each argument of fs[f] is read from.  A function
+// returning a tuple writes a result vector per element.  An input flagged in
+// generated is not read from memory but computed from the index as 
+// start + tid * step, which are passed instead of its pointer.  For 
+// f(double x, double y) and g(double x) mapped over vectors x and y:
 //
-// kernel_f(int N, double *x, double *y, double *z) { 
+// f_g_kernel_0_1_0(int N, double *x, double *y, double *r0, double *r1) { 
 //    tid = blockDim.x * blockIdx.x + threadIdx.x;
 //    if (tid < N) {
 //      t1 = x[tid];
-//      t2 = x[tid];
-//      t3 = f(t1,t2);
-//      z[tid] = t4;
+//      t2 = y[tid];
+//      r0[tid] = f(t1,t2);
+//      r1[tid] = g(t1);
 //    }
 // } 
 // Mark this with nvvm annotation as a kernel function. 
 
-void CreateNVVMMapKernel(Module *M, Function *F, IRBuilder<> &Builder, std::string &kernelname) { 
+void CreateNVVMMapKernel(Module *M, 
+                         const std::vector<Function*> &fs,
+                         const std::vector<std::vector<unsigned> > &argmap,
+                         const std::vector<bool> &generated,
+                         unsigned fixedN,
+                         bool exact,
+                         IRBuilder<> &Builder, 
+                         std::string &kernelname,
+                         std::vector<std::string> &constants) { 
 
-  PruneUnrelatedFunctionsAndVariables(M, F->getName());
+  unsigned nargs = generated.size();
 
+  PruneUnrelatedFunctionsAndVariables(M, fs);
+  std::vector<GlobalVariable*> shared;
+  LowerGlobalConstants(M, shared, constants);
+
+  // The name encodes the functions, unless each function argument has an
+  // input of its own how the inputs are shared, and the generated inputs.
   std::stringstream ss;
-  ss << F->getName().data() << "_kernel";
+  bool identity = true;
+  unsigned pos = 0;
+  for (unsigned f = 0; f < fs.size(); f++) {
+    ss << fs[f]->getName().data() << "_";
+    for (unsigned a = 0; a < argmap[f].size(); a++, pos++)
+      identity = identity && (argmap[f][a] == pos);
+  }
+  ss << "kernel";
+  if (!identity || pos != nargs) {
+    for (unsigned f = 0; f < fs.size(); f++)
+      for (unsigned a = 0; a < argmap[f].size(); a++)
+        ss << "_" << argmap[f][a];
+  }
+  for (unsigned i = 0; i < nargs; i++)
+    if (generated[i])
+      ss << "_g" << i;
+  if (fixedN)
+    ss << "_n" << fixedN;
   kernelname = ss.str();
   if (M->getFunction(kernelname))
     return;
   
-  Function *tidF = NULL, *ntidF = NULL, *ctaidF = NULL;
-
-  tidF = M->getFunction("llvm.nvvm.read.ptx.sreg.tid.x"); 
-  if (tidF==NULL) {
-    // create an extern declaration for llvm-intrinsic
-    Type *tidTy = Type::getInt32Ty(getGlobalContext()); 
-    FunctionType *tidFunTy = FunctionType::get(tidTy,false);
-    tidF = Function::Create(tidFunTy, Function::ExternalLinkage, "llvm.nvvm.read.ptx.sreg.tid.x", M);
-  }
-
-  ntidF = M->getFunction("llvm.nvvm.read.ptx.sreg.ntid.x"); 
-  if (ntidF==NULL) {
-    // create an extern declaration for llvm-intrinsic
-    Type *ntidTy = Type::getInt32Ty(getGlobalContext()); 
-    FunctionType *ntidFunTy = FunctionType::get(ntidTy,false);
-    ntidF = Function::Create(ntidFunTy, Function::ExternalLinkage, "llvm.nvvm.read.ptx.sreg.ntid.x", M);
-  }
+  Function *tidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.tid.x");
+  Function *ntidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ntid.x");
+  Function *ctaidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ctaid.x");
+  Function *barrierF = GetNVVMIntrinsic(M, "llvm.nvvm.barrier0");
 
-  ctaidF = M->getFunction("llvm.nvvm.read.ptx.sreg.ctaid.x"); 
-  if (ctaidF==NULL) {
-    // create an extern declaration for llvm-intrinsic
-    Type *ctaidTy = Type::getInt32Ty(getGlobalContext()); 
-    FunctionType *ctaidFunTy = FunctionType::get(ctaidTy,false);
-    ctaidF = Function::Create(ctaidFunTy, Function::ExternalLinkage, "llvm.nvvm.read.ptx.sreg.ctaid.x", M);
-  }
+  Type *doubleTy = Type::getDoubleTy(getGlobalContext());
+  PointerType *p_t = PointerType::get(doubleTy, 0); 
 
-  const FunctionType *type = F->getFunctionType(); 
   std::vector<Type*> Params;
   Params.push_back(IntegerType::getInt32Ty(getGlobalContext())); // size parameter first
 
-  // For each parameter in the original function create a pointer to that param.
-  unsigned numParams = type->getNumParams();
-  for (unsigned i = 0; i < numParams; i++) { 
-    Type *param_t = type->getParamType(i); 
-    PointerType *p_t = PointerType::get(param_t, 0); 
+  // A pointer (or start and step) for each input vector, then a pointer for
+  // each result.
+  unsigned nres = 0;
+  for (unsigned f = 0; f < fs.size(); f++)
+    nres += NumMapResults(fs[f]);
+  for (unsigned i = 0; i < nargs; i++) {
+    if (generated[i]) {
+      Params.push_back(doubleTy);
+      Params.push_back(doubleTy);
+    }
+    else
+      Params.push_back(p_t);
+  }
+  for (unsigned i = 0; i < nres; i++)
     Params.push_back(p_t);
-  } 
-  
-  Type *resultTy = F->getReturnType(); 
-  PointerType *p_t = PointerType::get(resultTy, 0); 
-  Params.push_back(p_t); // result is last
+  for (unsigned i = 0; i < shared.size(); i++)
+    Params.push_back(doubleTy);
 
   FunctionType *FT = FunctionType::get(Type::getVoidTy(getGlobalContext()), Params, false);
   Function *kerF = Function::Create(FT, Function::ExternalLinkage, kernelname, M);
 
+  // Set names for all arguments.
+  std::vector<Value *> kernelArgs;
+  unsigned Idx = 0; 
+  for (Function::arg_iterator AI = kerF->arg_begin(); 
+       AI != kerF->arg_end(); 
+       ++AI, ++Idx) {
+    std::stringstream ss;
+    ss << "arg" << Idx;
+    AI->setName(ss.str());
+    kernelArgs.push_back(AI);
+  }
+
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", kerF);
   Builder.SetInsertPoint(BB);
 
-  // Calculate linear index from thread ID, CTA ID, and # threads per CTA
+  // Make the global constants visible to the whole block
   std::vector<Value *> ArgsV;
+  if (!shared.empty()) {
+    unsigned first = kernelArgs.size() - shared.size();
+    for (unsigned i = 0; i < shared.size(); i++)
+      Builder.CreateStore(kernelArgs[first + i], shared[i]);
+    Builder.CreateCall(barrierF, ArgsV);
+  }
+
+  // Calculate linear index from thread ID, CTA ID, and # threads per CTA
   Value *tidreg = Builder.CreateCall(tidF, ArgsV, "calltmp");
   Value *ntidreg = Builder.CreateCall(ntidF, ArgsV, "calltmp");
   Value *ctaidreg = Builder.CreateCall(ctaidF, ArgsV, "calltmp");
   Value *idxreg = Builder.CreateMul(ntidreg, ctaidreg, "ntid_x_ctaid");
   idxreg = Builder.CreateAdd(idxreg, tidreg, "idx");
    
-  // Create code to check if index < size, and if not, return 
-  Value *CondV = Builder.CreateICmpULT(idxreg, &(*kerF->arg_begin()), "ifcond");
-        
   // Create blocks for the then and else cases.  Insert the 'then' block at the
   // end of the function.
   BasicBlock *ThenBB = BasicBlock::Create(getGlobalContext(), "then", kerF);
   BasicBlock *ElseBB = BasicBlock::Create(getGlobalContext(), "else");
 
-  Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  // Create code to check if index < size, and if not, return 
+  if (fixedN && exact)
+    Builder.CreateBr(ThenBB);
+  else {
+    Value *sizereg = kernelArgs[0];
+    if (fixedN)
+      sizereg = ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), fixedN);
+    Value *CondV = Builder.CreateICmpULT(idxreg, sizereg, "ifcond");
+    Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  }
   
-  // Emit then value -- load operands and call F
+  // Emit then value -- load each input once, call the functions and store
+  // their results
   Builder.SetInsertPoint(ThenBB);
 
-  // Set names for all arguments.
+  std::vector<Value *> inputs; 
+  unsigned in = EmitKernelInputs(Builder, kernelArgs, generated, idxreg, inputs);
+
+  unsigned out = in;
+  for (unsigned f = 0; f < fs.size(); f++) {
+    std::vector<Value *> args; 
+    for (unsigned a = 0; a < argmap[f].size(); a++)
+      args.push_back(inputs[argmap[f][a]]);
+    Value *result = Builder.CreateCall(fs[f], args, "calltmp");
+    if (!result->getType()->isArrayTy()) {
+      Builder.CreateStore(result, Builder.CreateGEP(kernelArgs[out++], idxreg));
+      continue;
+    }
+    for (unsigned k = 0; k < NumMapResults(fs[f]); k++) {
+      std::vector<unsigned> idx(1, k);
+      Value *elt = Builder.CreateExtractValue(result, idx);
+      Builder.CreateStore(elt, Builder.CreateGEP(kernelArgs[out++], idxreg));
+    }
+  }
+
+  Builder.CreateBr(ElseBB);
+  
+  // Emit else block.
+  kerF->getBasicBlockList().push_back(ElseBB);
+  Builder.SetInsertPoint(ElseBB);  
+  
+  Builder.CreateRetVoid();
+
+  MarkKernel(M, kerF);
+  // kerF->dump();
+} 
+
+// The statistics kernel reduces the values of a vector, or of a function 
+// mapped over its inputs (taken as by the map kernel, with argmap listing 
+// the input of each argument of f), to the count, mean, sum of squared 
+// deviations from the mean (M2), minimum, maximum and sum of the elements 
+// each thread visits, updating mean and M2 with Welford's method.  The 
+// threads stride over the vector by the size of the grid, so the reads are
+// coalesced, and write their partial statistics to partials, statistic k of
+// thread i at partials[k * #threads + i], for the host to merge (see 
+// vector_stats).  With f NULL, it reduces its only input.  
+//
+// If chunk is not 0, thread i instead visits the chunk of elements 
+// [i * chunk, (i + 1) * chunk) in order, and the launch has a thread per 
+// chunk, so the partials only depend on N and not on the device.  For 
+// f(x, y):
+//
+// f_stats_kernel(int N, double *x, double *y, double *partials) { 
+//    idx = blockDim.x * blockIdx.x + threadIdx.x;
+//    stride = blockDim.x * gridDim.x;
+//    n = 0; mean = 0; m2 = 0; min = inf; max = -inf; sum = 0;
+//    for (i = idx; i < N; i += stride) {
+//      v = f(x[i], y[i]);
+//      n += 1; delta = v - mean; mean += delta / n; m2 += delta * (v - mean);
+//      min = v < min ? v : min; max = v > max ? v : max; sum += v;
+//    }
+//    partials[0 * stride + idx] = n; ... partials[5 * stride + idx] = sum;
+// } 
+
+void CreateNVVMStatsKernel(Module *M, 
+                           Function *f,
+                           const std::vector<unsigned> &argmap,
+                           const std::vector<bool> &generated,
+                           unsigned chunk,
+                           IRBuilder<> &Builder, 
+                           std::string &kernelname,
+                           std::vector<std::string> &constants) { 
+
+  unsigned nargs = generated.size();
+
+  std::vector<Function*> roots;
+  if (f)
+    roots.push_back(f);
+  PruneUnrelatedFunctionsAndVariables(M, roots);
+  std::vector<GlobalVariable*> shared;
+  LowerGlobalConstants(M, shared, constants);
+
+  std::stringstream ss;
+  if (f)
+    ss << f->getName().data() << "_";
+  ss << "stats_kernel";
+  bool identity = argmap.size() == nargs;
+  for (unsigned a = 0; a < argmap.size(); a++)
+    identity = identity && argmap[a] == a;
+  if (!identity)
+    for (unsigned a = 0; a < argmap.size(); a++)
+      ss << "_" << argmap[a];
+  for (unsigned i = 0; i < nargs; i++)
+    if (generated[i])
+      ss << "_g" << i;
+  if (chunk)
+    ss << "_c" << chunk;
+  kernelname = ss.str();
+  if (M->getFunction(kernelname))
+    return;
+  
+  Function *tidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.tid.x");
+  Function *ntidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ntid.x");
+  Function *ctaidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ctaid.x");
+  Function *nctaidF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.nctaid.x");
+  Function *barrierF = GetNVVMIntrinsic(M, "llvm.nvvm.barrier0");
+
+  LLVMContext &Context = getGlobalContext();
+  Type *int32Ty = IntegerType::getInt32Ty(Context);
+  Type *doubleTy = Type::getDoubleTy(Context);
+  PointerType *p_t = PointerType::get(doubleTy, 0); 
+
+  // The size, a pointer (or start and step) for each input, the partials and
+  // the global constants.
+  std::vector<Type*> Params;
+  Params.push_back(int32Ty);
+  for (unsigned i = 0; i < nargs; i++) {
+    if (generated[i]) {
+      Params.push_back(doubleTy);
+      Params.push_back(doubleTy);
+    }
+    else
+      Params.push_back(p_t);
+  }
+  Params.push_back(p_t);
+  for (unsigned i = 0; i < shared.size(); i++)
+    Params.push_back(doubleTy);
+
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Context), Params, false);
+  Function *kerF = Function::Create(FT, Function::ExternalLinkage, kernelname, M);
+
+  std::vector<Value *> kernelArgs;
   unsigned Idx = 0; 
   for (Function::arg_iterator AI = kerF->arg_begin(); 
        AI != kerF->arg_end(); 
        ++AI, ++Idx) {
     std::stringstream ss;
     ss << "arg" << Idx;
-    std::string arg;
-    ss >> arg; 
-    AI->setName(arg);
-    
-    if (Idx > 0) { // no alloca for length parameter
-      // Create an alloca for this variable.
-      AllocaInst *Alloca = CreateEntryBlockAlloca(kerF, arg, false);
-
-      // Add arguments to variable symbol table.
-      NamedValues[arg] = Alloca;
-    }
+    AI->setName(ss.str());
+    kernelArgs.push_back(AI);
+  }
+
+  BasicBlock *EntryBB = BasicBlock::Create(Context, "entry", kerF);
+  Builder.SetInsertPoint(EntryBB);
+
+  std::vector<Value *> ArgsV;
+  if (!shared.empty()) {
+    unsigned first = kernelArgs.size() - shared.size();
+    for (unsigned i = 0; i < shared.size(); i++)
+      Builder.CreateStore(kernelArgs[first + i], shared[i]);
+    Builder.CreateCall(barrierF, ArgsV);
+  }
+
+  Value *tidreg = Builder.CreateCall(tidF, ArgsV, "calltmp");
+  Value *ntidreg = Builder.CreateCall(ntidF, ArgsV, "calltmp");
+  Value *ctaidreg = Builder.CreateCall(ctaidF, ArgsV, "calltmp");
+  Value *nctaidreg = Builder.CreateCall(nctaidF, ArgsV, "calltmp");
+  Value *idxreg = Builder.CreateMul(ntidreg, ctaidreg, "ntid_x_ctaid");
+  idxreg = Builder.CreateAdd(idxreg, tidreg, "idx");
+  Value *stride = Builder.CreateMul(ntidreg, nctaidreg, "stride");
+
+  // The elements the thread visits: [begin, end) by step.
+  Value *begin = idxreg, *end = kernelArgs[0], *step = stride;
+  if (chunk) {
+    Value *chunkreg = ConstantInt::get(int32Ty, chunk);
+    begin = Builder.CreateMul(idxreg, chunkreg, "begin");
+    end = Builder.CreateAdd(begin, chunkreg, "end");
+    end = Builder.CreateSelect(Builder.CreateICmpULT(end, kernelArgs[0]),
+                               end, kernelArgs[0]);
+    step = ConstantInt::get(int32Ty, 1);
+  }
+
+  BasicBlock *LoopBB = BasicBlock::Create(Context, "loop", kerF);
+  BasicBlock *BodyBB = BasicBlock::Create(Context, "body", kerF);
+  BasicBlock *ExitBB = BasicBlock::Create(Context, "exit", kerF);
+  Builder.CreateBr(LoopBB);
+
+  // The running statistics, in the order they are written out.
+  enum { Count, Mean, M2, Min, Max, Sum, NumStats };
+  const double init[NumStats] = { 0.0, 0.0, 0.0, HUGE_VAL, -HUGE_VAL, 0.0 };
+  const char *names[NumStats] = { "n", "mean", "m2", "min", "max", "sum" };
+
+  Builder.SetInsertPoint(LoopBB);
+  PHINode *i = Builder.CreatePHI(int32Ty, 2, "i");
+  i->addIncoming(begin, EntryBB);
+  PHINode *stat[NumStats];
+  for (unsigned k = 0; k < NumStats; k++) {
+    stat[k] = Builder.CreatePHI(doubleTy, 2, names[k]);
+    stat[k]->addIncoming(ConstantFP::get(Context, APFloat(init[k])), EntryBB);
+  }
+  Value *CondV = Builder.CreateICmpULT(i, end, "loopcond");
+  Builder.CreateCondBr(CondV, BodyBB, ExitBB);
+
+  Builder.SetInsertPoint(BodyBB);
+  std::vector<Value *> inputs; 
+  unsigned out = EmitKernelInputs(Builder, kernelArgs, generated, i, inputs);
+  Value *v = inputs[0];
+  if (f) {
+    std::vector<Value *> args; 
+    for (unsigned a = 0; a < argmap.size(); a++)
+      args.push_back(inputs[argmap[a]]);
+    v = Builder.CreateCall(f, args, "calltmp");
   }
 
-  Idx = 1;
-  std::vector<Value *> args; 
+  Value *next[NumStats];
+  next[Count] = Builder.CreateFAdd(stat[Count], 
+                                   ConstantFP::get(Context, APFloat(1.0)), "n");
+  Value *delta = Builder.CreateFSub(v, stat[Mean], "delta");
+  next[Mean] = Builder.CreateFAdd(stat[Mean], 
+                                  Builder.CreateFDiv(delta, next[Count]), "mean");
+  next[M2] = Builder.CreateFAdd(stat[M2], 
+                                Builder.CreateFMul(delta, 
+                                  Builder.CreateFSub(v, next[Mean])), "m2");
+  next[Min] = Builder.CreateSelect(Builder.CreateFCmpOLT(v, stat[Min]), 
+                                   v, stat[Min], "min");
+  next[Max] = Builder.CreateSelect(Builder.CreateFCmpOGT(v, stat[Max]), 
+                                   v, stat[Max], "max");
+  next[Sum] = Builder.CreateFAdd(stat[Sum], v, "sum");
+  i->addIncoming(Builder.CreateAdd(i, step, "inext"), BodyBB);
+  for (unsigned k = 0; k < NumStats; k++)
+    stat[k]->addIncoming(next[k], BodyBB);
+  Builder.CreateBr(LoopBB);
+
+  Builder.SetInsertPoint(ExitBB);
+  for (unsigned k = 0; k < NumStats; k++) {
+    Value *pos = Builder.CreateAdd(Builder.CreateMul(ConstantInt::get(int32Ty, k),
+                                                     stride), idxreg);
+    Builder.CreateStore(stat[k], Builder.CreateGEP(kernelArgs[out], pos));
+  }
+  Builder.CreateRetVoid();
+
+  MarkKernel(M, kerF);
+}
+
+
+// The matrix multiply kernel computes C = A * B for the row-major m x k 
+// matrix A and k x n matrix B, in blocks of tile x tile threads, thread 
+// (x, y) of block (bx, by) computing element (by * tile + y, bx * tile + x)
+// of C.  The blocks step through k a tile at a time: each thread loads an
+// element of the tile of A and of B into shared memory, where the block 
+// then reads each element tile times, so the kernel reads A and B from 
+// device memory n / tile and m / tile times instead of n and m times.  
+// Out-of-range elements of the tiles are zero.  The loop over a tile is 
+// unrolled.
+//
+// matmul_kernel_<tile>(int m, int k, int n, double *A, double *B, double *C) {
+//    __shared__ double As[tile][tile], Bs[tile][tile];
+//    row = blockIdx.y * tile + threadIdx.y; col = blockIdx.x * tile + threadIdx.x;
+//    acc = 0;
+//    for (t = 0; t < k; t += tile) {
+//      As[y][x] = row < m && t + x < k ? A[row * k + t + x] : 0;
+//      Bs[y][x] = t + y < k && col < n ? B[(t + y) * n + col] : 0;
+//      __syncthreads();
+//      for (j = 0; j < tile; j++) acc += As[y][j] * Bs[j][x];
+//      __syncthreads();
+//    }
+//    if (row < m && col < n) C[row * n + col] = acc;
+// }
+
+void CreateNVVMMatMulKernel(Module *M, 
+                            unsigned tile,
+                            IRBuilder<> &Builder, 
+                            std::string &kernelname) { 
+  PruneUnrelatedFunctionsAndVariables(M, std::vector<Function*>());
 
-  for (Function::arg_iterator AI = ++(kerF->arg_begin()); // skip first 
-       AI != kerF->arg_end();
+  std::stringstream ss;
+  ss << "matmul_kernel_" << tile;
+  kernelname = ss.str();
+  if (M->getFunction(kernelname))
+    return;
+
+  Function *tidxF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.tid.x");
+  Function *tidyF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.tid.y");
+  Function *ctaidxF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ctaid.x");
+  Function *ctaidyF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ctaid.y");
+  Function *barrierF = GetNVVMIntrinsic(M, "llvm.nvvm.barrier0");
+
+  LLVMContext &Context = getGlobalContext();
+  Type *int32Ty = IntegerType::getInt32Ty(Context);
+  Type *doubleTy = Type::getDoubleTy(Context);
+  PointerType *p_t = PointerType::get(doubleTy, 0); 
+
+  // The tiles of A and B in shared memory.
+  ArrayType *tileTy = ArrayType::get(doubleTy, tile * tile);
+  GlobalVariable *As = new GlobalVariable(*M, tileTy, false, 
+                                          GlobalValue::InternalLinkage,
+                                          UndefValue::get(tileTy), "As",
+                                          0, false, 3);
+  GlobalVariable *Bs = new GlobalVariable(*M, tileTy, false, 
+                                          GlobalValue::InternalLinkage,
+                                          UndefValue::get(tileTy), "Bs",
+                                          0, false, 3);
+
+  std::vector<Type*> Params(3, int32Ty);
+  Params.insert(Params.end(), 3, p_t);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Context), Params, false);
+  Function *kerF = Function::Create(FT, Function::ExternalLinkage, kernelname, M);
+
+  const char *argnames[] = { "m", "k", "n", "A", "B", "C" };
+  std::vector<Value *> kernelArgs;
+  unsigned Idx = 0; 
+  for (Function::arg_iterator AI = kerF->arg_begin(); 
+       AI != kerF->arg_end(); 
        ++AI, ++Idx) {
-    if (Idx < numParams+1) {
-      std::vector<Value *>index;
-      index.push_back(idxreg);
-      Value *gep = Builder.CreateGEP(AI, index); 
-      Value *loadInst = Builder.CreateLoad(gep);
-      args.push_back(loadInst);
-    } 
-    else { 
-      Value *result = Builder.CreateCall(F, args, "calltmp");
-      std::vector<Value *>index;
-      index.push_back(idxreg);
-      Value *gep = Builder.CreateGEP(AI, index); 
-      Value *storeInst = Builder.CreateStore(result, gep);
-      break;
-    } 
+    AI->setName(argnames[Idx]);
+    kernelArgs.push_back(AI);
   }
+  Value *m = kernelArgs[0], *k = kernelArgs[1], *n = kernelArgs[2];
+  Value *A = kernelArgs[3], *B = kernelArgs[4], *C = kernelArgs[5];
 
-  Builder.CreateBr(ElseBB);
-  // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-  ThenBB = Builder.GetInsertBlock();
-  
-  // Emit else block.
-  kerF->getBasicBlockList().push_back(ElseBB);
-  Builder.SetInsertPoint(ElseBB);  
-  
+  BasicBlock *EntryBB = BasicBlock::Create(Context, "entry", kerF);
+  Builder.SetInsertPoint(EntryBB);
+
+  std::vector<Value *> ArgsV;
+  Value *tilereg = ConstantInt::get(int32Ty, tile);
+  Value *zero = ConstantInt::get(int32Ty, 0);
+  Value *fzero = ConstantFP::get(Context, APFloat(0.0));
+  Value *x = Builder.CreateCall(tidxF, ArgsV, "x");
+  Value *y = Builder.CreateCall(tidyF, ArgsV, "y");
+  Value *row = Builder.CreateAdd(Builder.CreateMul(Builder.CreateCall(ctaidyF, ArgsV), 
+                                                   tilereg), y, "row");
+  Value *col = Builder.CreateAdd(Builder.CreateMul(Builder.CreateCall(ctaidxF, ArgsV), 
+                                                   tilereg), x, "col");
+  Value *rowValid = Builder.CreateICmpULT(row, m);
+  Value *colValid = Builder.CreateICmpULT(col, n);
+
+  // The element of thread (x, y) in a tile, and those of row y and column x.
+  std::vector<Value *> gepIdx(2, zero);
+  gepIdx[1] = Builder.CreateAdd(Builder.CreateMul(y, tilereg), x);
+  Value *AsElt = Builder.CreateGEP(As, gepIdx);
+  Value *BsElt = Builder.CreateGEP(Bs, gepIdx);
+  std::vector<Value *> AsRow, BsCol;
+  for (unsigned j = 0; j < tile; j++) {
+    gepIdx[1] = Builder.CreateAdd(Builder.CreateMul(y, tilereg), 
+                                  ConstantInt::get(int32Ty, j));
+    AsRow.push_back(Builder.CreateGEP(As, gepIdx));
+    gepIdx[1] = Builder.CreateAdd(ConstantInt::get(int32Ty, j * tile), x);
+    BsCol.push_back(Builder.CreateGEP(Bs, gepIdx));
+  }
+
+  BasicBlock *LoopBB = BasicBlock::Create(Context, "loop", kerF);
+  BasicBlock *BodyBB = BasicBlock::Create(Context, "body", kerF);
+  BasicBlock *ExitBB = BasicBlock::Create(Context, "exit", kerF);
+  BasicBlock *StoreBB = BasicBlock::Create(Context, "store", kerF);
+  BasicBlock *DoneBB = BasicBlock::Create(Context, "done", kerF);
+  Builder.CreateBr(LoopBB);
+
+  Builder.SetInsertPoint(LoopBB);
+  PHINode *t = Builder.CreatePHI(int32Ty, 2, "t");
+  t->addIncoming(zero, EntryBB);
+  PHINode *acc = Builder.CreatePHI(doubleTy, 2, "acc");
+  acc->addIncoming(fzero, EntryBB);
+  Builder.CreateCondBr(Builder.CreateICmpULT(t, k, "loopcond"), BodyBB, ExitBB);
+
+  // Load the tiles, reading element 0 instead of out-of-range ones.
+  Builder.SetInsertPoint(BodyBB);
+  Value *ak = Builder.CreateAdd(t, x);
+  Value *aValid = Builder.CreateAnd(rowValid, Builder.CreateICmpULT(ak, k));
+  Value *aIdx = Builder.CreateSelect(aValid, 
+                                     Builder.CreateAdd(Builder.CreateMul(row, k), ak),
+                                     zero);
+  Value *aVal = Builder.CreateLoad(Builder.CreateGEP(A, aIdx));
+  Builder.CreateStore(Builder.CreateSelect(aValid, aVal, fzero), AsElt);
+  Value *bk = Builder.CreateAdd(t, y);
+  Value *bValid = Builder.CreateAnd(colValid, Builder.CreateICmpULT(bk, k));
+  Value *bIdx = Builder.CreateSelect(bValid, 
+                                     Builder.CreateAdd(Builder.CreateMul(bk, n), col),
+                                     zero);
+  Value *bVal = Builder.CreateLoad(Builder.CreateGEP(B, bIdx));
+  Builder.CreateStore(Builder.CreateSelect(bValid, bVal, fzero), BsElt);
+  Builder.CreateCall(barrierF, ArgsV);
+
+  Value *sum = acc;
+  for (unsigned j = 0; j < tile; j++)
+    sum = Builder.CreateFAdd(sum, Builder.CreateFMul(Builder.CreateLoad(AsRow[j]),
+                                                     Builder.CreateLoad(BsCol[j])));
+  Builder.CreateCall(barrierF, ArgsV);
+  t->addIncoming(Builder.CreateAdd(t, tilereg, "tnext"), BodyBB);
+  acc->addIncoming(sum, BodyBB);
+  Builder.CreateBr(LoopBB);
+
+  Builder.SetInsertPoint(ExitBB);
+  Builder.CreateCondBr(Builder.CreateAnd(rowValid, colValid), StoreBB, DoneBB);
+
+  Builder.SetInsertPoint(StoreBB);
+  Value *cIdx = Builder.CreateAdd(Builder.CreateMul(row, n), col);
+  Builder.CreateStore(acc, Builder.CreateGEP(C, cIdx));
+  Builder.CreateBr(DoneBB);
+
+  Builder.SetInsertPoint(DoneBB);
   Builder.CreateRetVoid();
 
-  // Add the nvvm annotation that it is a kernel function. 
+  MarkKernel(M, kerF);
+}
+
+
+// The radix sort kernels sort 64-bit keys (see RadixKey in toy.cpp) stably
+// by one 8-bit digit per pass, from the least significant, so a block has 
+// a thread per digit.  Block b of a pass handles the tile of keys 
+// [b * tile, (b + 1) * tile).  The count kernel counts the digits of its 
+// tile in shared memory:
+//
+// radix_count_<tile>(int N, int shift, i64 *keys, int *counts) {
+//    __shared__ int hist[256];
+//    hist[tid] = 0; __syncthreads();
+//    for (i = b * tile + tid; i < min(N, (b + 1) * tile); i += 256)
+//      atomicAdd(&hist[(keys[i] >> shift) & 255], 1);
+//    __syncthreads();
+//    counts[tid * nblocks + b] = hist[tid];
+// }
+//
+// so counts lists the count of each block digit by digit, and its exclusive
+// prefix sum, which the scan kernel computes in place in one block, is 
+// where each block puts its first key of each digit:
+//
+// radix_scan(int M, int *counts) {
+//    __shared__ int sums[256];
+//    chunk = (M + 255) / 256; lo = min(M, tid * chunk); hi = min(M, lo + chunk);
+//    s = 0; for (i = lo; i < hi; i++) s += counts[i];
+//    sums[tid] = s; __syncthreads();
+//    if (tid == 0) 
+//      for (j = 0, s = 0; j < 256; j++) { c = sums[j]; sums[j] = s; s += c; }
+//    __syncthreads();
+//    s = sums[tid]; for (i = lo; i < hi; i++) { c = counts[i]; counts[i] = s; s += c; }
+// }
+//
+// The scatter kernel moves the keys of its tile 256 at a time, and the 
+// permutation along with them unless perm is null.  A key goes after the
+// keys of its digit in earlier blocks and rounds, and after those of the 
+// threads before it in its round, which it counts in shared memory, so the
+// order of equal digits is kept:
+//
+// radix_scatter_<tile>(int N, int shift, i64 *keys, i64 *out, int *perm, 
+//                      int *permout, int *offsets) {
+//    __shared__ int base[256], digits[256];
+//    base[tid] = offsets[tid * nblocks + b];
+//    for (r = b * tile; r < min(N, (b + 1) * tile); r += 256) {
+//      i = r + tid; valid = i < min(N, (b + 1) * tile);
+//      d = valid ? (keys[i] >> shift) & 255 : 256;
+//      digits[tid] = d; __syncthreads();
+//      if (valid) {
+//        rank = 0; for (j = 0; j < tid; j++) rank += digits[j] == d;
+//        pos = base[d] + rank; out[pos] = keys[i];
+//        if (perm) permout[pos] = perm[i];
+//      }
+//      __syncthreads();
+//      if (valid) atomicAdd(&base[d], 1);
+//      __syncthreads();
+//    }
+// }
+//
+// kernelnames receives the names of the count, scan and scatter kernels.
+
+// CreateRadixKernel - Create kernel name in M with the parameters of types
+// Params named argnames, and its entry block, appending the parameters to
+// kernelArgs.
+static Function *CreateRadixKernel(Module *M, const std::string &name,
+                                   const std::vector<Type*> &Params,
+                                   const char **argnames,
+                                   std::vector<Value *> &kernelArgs)
+{
   LLVMContext &Context = getGlobalContext();
-  Type *int32Type = Type::getInt32Ty(Context); 
-  std::vector<Value *> Vals;
-  NamedMDNode *nvvmannotate = M->getOrInsertNamedMetadata("nvvm.annotations");
-  MDString *str = MDString::get(Context, "kernel");
-  Value *one = ConstantInt::get(int32Type, 1);
-  Vals.push_back(kerF);
-  Vals.push_back(str);
-  Vals.push_back(one);  
-  MDNode *mdNode = MDNode::get(Context, Vals);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Context), Params, false);
+  Function *kerF = Function::Create(FT, Function::ExternalLinkage, name, M);
+  unsigned Idx = 0; 
+  for (Function::arg_iterator AI = kerF->arg_begin(); 
+       AI != kerF->arg_end(); 
+       ++AI, ++Idx) {
+    AI->setName(argnames[Idx]);
+    kernelArgs.push_back(AI);
+  }
+  BasicBlock::Create(Context, "entry", kerF);
+  return kerF;
+}
 
-  nvvmannotate->addOperand(mdNode); 
-  // kerF->dump();
-} 
+// EmitRadixDigit - The digit of key at shift, as an int.
+static Value *EmitRadixDigit(IRBuilder<> &Builder, Value *key, Value *shift)
+{
+  LLVMContext &Context = getGlobalContext();
+  Type *int64Ty = IntegerType::getInt64Ty(Context);
+  Value *d = Builder.CreateLShr(key, Builder.CreateZExt(shift, int64Ty));
+  d = Builder.CreateAnd(d, ConstantInt::get(int64Ty, 255));
+  return Builder.CreateTrunc(d, IntegerType::getInt32Ty(Context), "digit");
+}
+
+void CreateNVVMRadixSortKernels(Module *M, 
+                                unsigned tile,
+                                IRBuilder<> &Builder, 
+                                std::vector<std::string> &kernelnames) { 
+  PruneUnrelatedFunctionsAndVariables(M, std::vector<Function*>());
+
+  const unsigned Digits = 256;
+  std::stringstream cs, ss;
+  cs << "radix_count_" << tile;
+  ss << "radix_scatter_" << tile;
+  kernelnames.clear();
+  kernelnames.push_back(cs.str());
+  kernelnames.push_back("radix_scan");
+  kernelnames.push_back(ss.str());
+  if (M->getFunction(kernelnames[0]))
+    return;
+
+  Function *tidxF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.tid.x");
+  Function *ctaidxF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.ctaid.x");
+  Function *nctaidxF = GetNVVMIntrinsic(M, "llvm.nvvm.read.ptx.sreg.nctaid.x");
+  Function *barrierF = GetNVVMIntrinsic(M, "llvm.nvvm.barrier0");
+
+  LLVMContext &Context = getGlobalContext();
+  Type *int32Ty = IntegerType::getInt32Ty(Context);
+  Type *int64Ty = IntegerType::getInt64Ty(Context);
+  PointerType *p_i32 = PointerType::get(int32Ty, 0); 
+  PointerType *p_i64 = PointerType::get(int64Ty, 0); 
+
+  // The per-digit arrays in shared memory.
+  ArrayType *digitsTy = ArrayType::get(int32Ty, Digits);
+  GlobalVariable *Hist = new GlobalVariable(*M, digitsTy, false, 
+                                            GlobalValue::InternalLinkage,
+                                            UndefValue::get(digitsTy), "hist",
+                                            0, false, 3);
+  GlobalVariable *Sums = new GlobalVariable(*M, digitsTy, false, 
+                                            GlobalValue::InternalLinkage,
+                                            UndefValue::get(digitsTy), "sums",
+                                            0, false, 3);
+  GlobalVariable *Base = new GlobalVariable(*M, digitsTy, false, 
+                                            GlobalValue::InternalLinkage,
+                                            UndefValue::get(digitsTy), "base",
+                                            0, false, 3);
+  GlobalVariable *DigitsS = new GlobalVariable(*M, digitsTy, false, 
+                                               GlobalValue::InternalLinkage,
+                                               UndefValue::get(digitsTy), 
+                                               "digits", 0, false, 3);
+
+  std::vector<Value *> ArgsV;
+  Value *zero = ConstantInt::get(int32Ty, 0);
+  Value *one = ConstantInt::get(int32Ty, 1);
+  Value *digitsreg = ConstantInt::get(int32Ty, Digits);
+  Value *tilereg = ConstantInt::get(int32Ty, tile);
+  std::vector<Value *> gepIdx(2, zero);
+
+  // The count kernel.
+  {
+    std::vector<Type*> Params(2, int32Ty);
+    Params.push_back(p_i64);
+    Params.push_back(p_i32);
+    const char *argnames[] = { "N", "shift", "keys", "counts" };
+    std::vector<Value *> kernelArgs;
+    Function *kerF = CreateRadixKernel(M, kernelnames[0], Params, argnames,
+                                       kernelArgs);
+    Value *N = kernelArgs[0], *shift = kernelArgs[1];
+    Value *keys = kernelArgs[2], *counts = kernelArgs[3];
+
+    BasicBlock *EntryBB = &kerF->getEntryBlock();
+    Builder.SetInsertPoint(EntryBB);
+    Value *tid = Builder.CreateCall(tidxF, ArgsV, "tid");
+    Value *b = Builder.CreateCall(ctaidxF, ArgsV, "b");
+    Value *nb = Builder.CreateCall(nctaidxF, ArgsV, "nblocks");
+    gepIdx[1] = tid;
+    Value *histElt = Builder.CreateGEP(Hist, gepIdx);
+    Builder.CreateStore(zero, histElt);
+    Builder.CreateCall(barrierF, ArgsV);
+    Value *first = Builder.CreateMul(b, tilereg);
+    Value *last = Builder.CreateAdd(first, tilereg);
+    Value *end = Builder.CreateSelect(Builder.CreateICmpULT(last, N), last, N,
+                                      "end");
+    Value *start = Builder.CreateAdd(first, tid);
+
+    BasicBlock *LoopBB = BasicBlock::Create(Context, "loop", kerF);
+    BasicBlock *BodyBB = BasicBlock::Create(Context, "body", kerF);
+    BasicBlock *ExitBB = BasicBlock::Create(Context, "exit", kerF);
+    Builder.CreateBr(LoopBB);
+
+    Builder.SetInsertPoint(LoopBB);
+    PHINode *i = Builder.CreatePHI(int32Ty, 2, "i");
+    i->addIncoming(start, EntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpULT(i, end, "loopcond"), BodyBB, 
+                         ExitBB);
+
+    Builder.SetInsertPoint(BodyBB);
+    Value *key = Builder.CreateLoad(Builder.CreateGEP(keys, i));
+    gepIdx[1] = EmitRadixDigit(Builder, key, shift);
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Builder.CreateGEP(Hist, gepIdx),
+                            one, Monotonic);
+    i->addIncoming(Builder.CreateAdd(i, digitsreg, "inext"), BodyBB);
+    Builder.CreateBr(LoopBB);
+
+    Builder.SetInsertPoint(ExitBB);
+    Builder.CreateCall(barrierF, ArgsV);
+    Value *pos = Builder.CreateAdd(Builder.CreateMul(tid, nb), b);
+    Builder.CreateStore(Builder.CreateLoad(histElt), 
+                        Builder.CreateGEP(counts, pos));
+    Builder.CreateRetVoid();
 
+    MarkKernel(M, kerF);
+  }
+
+  // The scan kernel.
+  {
+    std::vector<Type*> Params(1, int32Ty);
+    Params.push_back(p_i32);
+    const char *argnames[] = { "M", "counts" };
+    std::vector<Value *> kernelArgs;
+    Function *kerF = CreateRadixKernel(M, kernelnames[1], Params, argnames,
+                                       kernelArgs);
+    Value *Mlen = kernelArgs[0], *counts = kernelArgs[1];
+
+    BasicBlock *EntryBB = &kerF->getEntryBlock();
+    Builder.SetInsertPoint(EntryBB);
+    Value *tid = Builder.CreateCall(tidxF, ArgsV, "tid");
+    Value *chunk = Builder.CreateUDiv(Builder.CreateAdd(Mlen, 
+                                                        ConstantInt::get(int32Ty, Digits - 1)),
+                                      digitsreg, "chunk");
+    Value *lo = Builder.CreateMul(tid, chunk);
+    lo = Builder.CreateSelect(Builder.CreateICmpULT(lo, Mlen), lo, Mlen, "lo");
+    Value *hi = Builder.CreateAdd(lo, chunk);
+    hi = Builder.CreateSelect(Builder.CreateICmpULT(hi, Mlen), hi, Mlen, "hi");
+    gepIdx[1] = tid;
+    Value *sumsElt = Builder.CreateGEP(Sums, gepIdx);
+
+    BasicBlock *SumBB = BasicBlock::Create(Context, "sum", kerF);
+    BasicBlock *SumBodyBB = BasicBlock::Create(Context, "sumbody", kerF);
+    BasicBlock *SummedBB = BasicBlock::Create(Context, "summed", kerF);
+    BasicBlock *SerialBB = BasicBlock::Create(Context, "serial", kerF);
+    BasicBlock *SerialBodyBB = BasicBlock::Create(Context, "serialbody", kerF);
+    BasicBlock *ScannedBB = BasicBlock::Create(Context, "scanned", kerF);
+    BasicBlock *ScanBB = BasicBlock::Create(Context, "scan", kerF);
+    BasicBlock *ScanBodyBB = BasicBlock::Create(Context, "scanbody", kerF);
+    BasicBlock *DoneBB = BasicBlock::Create(Context, "done", kerF);
+    Builder.CreateBr(SumBB);
+
+    // Sum the chunk of the thread.
+    Builder.SetInsertPoint(SumBB);
+    PHINode *i = Builder.CreatePHI(int32Ty, 2, "i");
+    i->addIncoming(lo, EntryBB);
+    PHINode *s = Builder.CreatePHI(int32Ty, 2, "s");
+    s->addIncoming(zero, EntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpULT(i, hi), SumBodyBB, SummedBB);
+
+    Builder.SetInsertPoint(SumBodyBB);
+    Value *c = Builder.CreateLoad(Builder.CreateGEP(counts, i));
+    i->addIncoming(Builder.CreateAdd(i, one), SumBodyBB);
+    s->addIncoming(Builder.CreateAdd(s, c), SumBodyBB);
+    Builder.CreateBr(SumBB);
+
+    // Scan the sums of the chunks in thread 0.
+    Builder.SetInsertPoint(SummedBB);
+    Builder.CreateStore(s, sumsElt);
+    Builder.CreateCall(barrierF, ArgsV);
+    BasicBlock *SerialEntryBB = BasicBlock::Create(Context, "serialentry", kerF);
+    Builder.CreateCondBr(Builder.CreateICmpEQ(tid, zero), SerialEntryBB, 
+                         ScannedBB);
+
+    Builder.SetInsertPoint(SerialEntryBB);
+    Builder.CreateBr(SerialBB);
+    Builder.SetInsertPoint(SerialBB);
+    PHINode *j = Builder.CreatePHI(int32Ty, 2, "j");
+    j->addIncoming(zero, SerialEntryBB);
+    PHINode *t = Builder.CreatePHI(int32Ty, 2, "t");
+    t->addIncoming(zero, SerialEntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpULT(j, digitsreg), SerialBodyBB, 
+                         ScannedBB);
+
+    Builder.SetInsertPoint(SerialBodyBB);
+    gepIdx[1] = j;
+    Value *sumsJ = Builder.CreateGEP(Sums, gepIdx);
+    Value *v = Builder.CreateLoad(sumsJ);
+    Builder.CreateStore(t, sumsJ);
+    j->addIncoming(Builder.CreateAdd(j, one), SerialBodyBB);
+    t->addIncoming(Builder.CreateAdd(t, v), SerialBodyBB);
+    Builder.CreateBr(SerialBB);
+
+    // Rewrite the chunk with the prefix sums.
+    Builder.SetInsertPoint(ScannedBB);
+    Builder.CreateCall(barrierF, ArgsV);
+    Value *sbase = Builder.CreateLoad(sumsElt);
+    Builder.CreateBr(ScanBB);
+
+    Builder.SetInsertPoint(ScanBB);
+    PHINode *i2 = Builder.CreatePHI(int32Ty, 2, "i");
+    i2->addIncoming(lo, ScannedBB);
+    PHINode *s2 = Builder.CreatePHI(int32Ty, 2, "s");
+    s2->addIncoming(sbase, ScannedBB);
+    Builder.CreateCondBr(Builder.CreateICmpULT(i2, hi), ScanBodyBB, DoneBB);
+
+    Builder.SetInsertPoint(ScanBodyBB);
+    Value *elt = Builder.CreateGEP(counts, i2);
+    Value *c2 = Builder.CreateLoad(elt);
+    Builder.CreateStore(s2, elt);
+    i2->addIncoming(Builder.CreateAdd(i2, one), ScanBodyBB);
+    s2->addIncoming(Builder.CreateAdd(s2, c2), ScanBodyBB);
+    Builder.CreateBr(ScanBB);
+
+    Builder.SetInsertPoint(DoneBB);
+    Builder.CreateRetVoid();
+
+    MarkKernel(M, kerF);
+  }
+
+  // The scatter kernel.
+  {
+    std::vector<Type*> Params(2, int32Ty);
+    Params.push_back(p_i64);
+    Params.push_back(p_i64);
+    Params.insert(Params.end(), 3, p_i32);
+    const char *argnames[] = { "N", "shift", "keys", "out", "perm", "permout",
+                               "offsets" };
+    std::vector<Value *> kernelArgs;
+    Function *kerF = CreateRadixKernel(M, kernelnames[2], Params, argnames,
+                                       kernelArgs);
+    Value *N = kernelArgs[0], *shift = kernelArgs[1];
+    Value *keys = kernelArgs[2], *out = kernelArgs[3];
+    Value *perm = kernelArgs[4], *permout = kernelArgs[5];
+    Value *offsets = kernelArgs[6];
+
+    BasicBlock *EntryBB = &kerF->getEntryBlock();
+    Builder.SetInsertPoint(EntryBB);
+    Value *tid = Builder.CreateCall(tidxF, ArgsV, "tid");
+    Value *b = Builder.CreateCall(ctaidxF, ArgsV, "b");
+    Value *nb = Builder.CreateCall(nctaidxF, ArgsV, "nblocks");
+    Value *pos = Builder.CreateAdd(Builder.CreateMul(tid, nb), b);
+    gepIdx[1] = tid;
+    Builder.CreateStore(Builder.CreateLoad(Builder.CreateGEP(offsets, pos)),
+                        Builder.CreateGEP(Base, gepIdx));
+    Value *digitsElt = Builder.CreateGEP(DigitsS, gepIdx);
+    Value *first = Builder.CreateMul(b, tilereg);
+    Value *last = Builder.CreateAdd(first, tilereg);
+    Value *end = Builder.CreateSelect(Builder.CreateICmpULT(last, N), last, N,
+                                      "end");
+    Value *hasPerm = Builder.CreateICmpNE(perm, ConstantPointerNull::get(p_i32));
+
+    BasicBlock *RoundBB = BasicBlock::Create(Context, "round", kerF);
+    BasicBlock *RoundBodyBB = BasicBlock::Create(Context, "roundbody", kerF);
+    BasicBlock *RankEntryBB = BasicBlock::Create(Context, "rankentry", kerF);
+    BasicBlock *RankBB = BasicBlock::Create(Context, "rank", kerF);
+    BasicBlock *RankBodyBB = BasicBlock::Create(Context, "rankbody", kerF);
+    BasicBlock *PlaceBB = BasicBlock::Create(Context, "place", kerF);
+    BasicBlock *MovePermBB = BasicBlock::Create(Context, "moveperm", kerF);
+    BasicBlock *SyncedBB = BasicBlock::Create(Context, "synced", kerF);
+    BasicBlock *BumpBB = BasicBlock::Create(Context, "bump", kerF);
+    BasicBlock *NextBB = BasicBlock::Create(Context, "next", kerF);
+    BasicBlock *DoneBB = BasicBlock::Create(Context, "done", kerF);
+    Builder.CreateBr(RoundBB);
+
+    Builder.SetInsertPoint(RoundBB);
+    PHINode *r = Builder.CreatePHI(int32Ty, 2, "r");
+    r->addIncoming(first, EntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpULT(r, end, "roundcond"), 
+                         RoundBodyBB, DoneBB);
+
+    // Publish the digit of the key of the thread, 256 for none.
+    Builder.SetInsertPoint(RoundBodyBB);
+    Value *i = Builder.CreateAdd(r, tid, "i");
+    Value *valid = Builder.CreateICmpULT(i, end, "valid");
+    Value *key = Builder.CreateLoad(Builder.CreateGEP(keys, 
+                                                      Builder.CreateSelect(valid, i, zero)),
+                                    "key");
+    Value *d = Builder.CreateSelect(valid, EmitRadixDigit(Builder, key, shift),
+                                    digitsreg, "d");
+    Builder.CreateStore(d, digitsElt);
+    Builder.CreateCall(barrierF, ArgsV);
+    Builder.CreateCondBr(valid, RankEntryBB, SyncedBB);
+
+    // Count the keys of the same digit before it in the round.
+    Builder.SetInsertPoint(RankEntryBB);
+    Builder.CreateBr(RankBB);
+    Builder.SetInsertPoint(RankBB);
+    PHINode *j = Builder.CreatePHI(int32Ty, 2, "j");
+    j->addIncoming(zero, RankEntryBB);
+    PHINode *rank = Builder.CreatePHI(int32Ty, 2, "rank");
+    rank->addIncoming(zero, RankEntryBB);
+    Builder.CreateCondBr(Builder.CreateICmpULT(j, tid), RankBodyBB, PlaceBB);
+
+    Builder.SetInsertPoint(RankBodyBB);
+    gepIdx[1] = j;
+    Value *dj = Builder.CreateLoad(Builder.CreateGEP(DigitsS, gepIdx));
+    Value *same = Builder.CreateZExt(Builder.CreateICmpEQ(dj, d), int32Ty);
+    j->addIncoming(Builder.CreateAdd(j, one), RankBodyBB);
+    rank->addIncoming(Builder.CreateAdd(rank, same), RankBodyBB);
+    Builder.CreateBr(RankBB);
+
+    Builder.SetInsertPoint(PlaceBB);
+    gepIdx[1] = d;
+    Value *baseD = Builder.CreateGEP(Base, gepIdx);
+    Value *dst = Builder.CreateAdd(Builder.CreateLoad(baseD), rank, "dst");
+    Builder.CreateStore(key, Builder.CreateGEP(out, dst));
+    Builder.CreateCondBr(hasPerm, MovePermBB, SyncedBB);
+
+    Builder.SetInsertPoint(MovePermBB);
+    Builder.CreateStore(Builder.CreateLoad(Builder.CreateGEP(perm, i)),
+                        Builder.CreateGEP(permout, dst));
+    Builder.CreateBr(SyncedBB);
+
+    // Once all have read the bases, advance them past the round.
+    Builder.SetInsertPoint(SyncedBB);
+    Builder.CreateCall(barrierF, ArgsV);
+    Builder.CreateCondBr(valid, BumpBB, NextBB);
+
+    Builder.SetInsertPoint(BumpBB);
+    gepIdx[1] = d;
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Builder.CreateGEP(Base, gepIdx),
+                            one, Monotonic);
+    Builder.CreateBr(NextBB);
+
+    Builder.SetInsertPoint(NextBB);
+    Builder.CreateCall(barrierF, ArgsV);
+    r->addIncoming(Builder.CreateAdd(r, digitsreg, "rnext"), NextBB);
+    Builder.CreateBr(RoundBB);
+
+    Builder.SetInsertPoint(DoneBB);
+    Builder.CreateRetVoid();
+
+    MarkKernel(M, kerF);
+  }
+}
 
 
 char *BitCodeToPtx(Module *M)
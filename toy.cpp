@@ -8,13 +8,24 @@
 #include "llvm/Analysis/Passes.h"
 #include "llvm/Target/TargetData.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/IRBuilder.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/ADT/DenseMap.h"
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <limits>
+#include <list>
 #include <map>
+#include <set>
 #include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "nvvm.h"
 
 using namespace llvm;
@@ -45,7 +56,13 @@ enum Token {
   tok_var = -13,
 
   // vector type
-  tok_vector = -14
+  tok_vector = -14,
+
+  // tuple type and literal
+  tok_tuple = -15,
+
+  // session global
+  tok_global = -16
 };
 
 // Types
@@ -54,15 +71,202 @@ struct DVector {
   int     length;
 };
 
+/// MapArg - An input of a map: a vector or, if generated is set, a 
+/// generated vector whose element i is start + i * step, see 
+/// GeneratorExprAST.  The ptr of a generated vector is null, but so may be 
+/// that of an empty one.
+struct MapArg {
+  double  *ptr;
+  int     length;
+  int     generated;
+  double  start;
+  double  step;
+};
+
+/// VectorHeader - Bookkeeping the runtime keeps immediately in front of the
+/// elements of every vector it allocates.  Keeping it out of DVector leaves
+/// the "dvec" IR type, and the ABI of externs like printVector, unchanged.
+struct VectorHeader {
+  int     refcount;  // references held by variables and live temporaries
+  int     capacity;  // number of elements allocated
+  unsigned version;  // changes whenever the contents are written
+  int     pinned;    // allocated page-locked, see AsyncMaps
+};
+
+// The elements follow the header, which GetVectorHeader finds one header 
+// before them, so it must keep them aligned: this fails to compile if its
+// size is not a whole number of elements.
+typedef char VectorHeaderAligned[sizeof(VectorHeader) % sizeof(double) == 0 
+                                 ? 1 : -1];
+
+/// VectorHeaderDoubles - Space taken by the header, in elements.
+static const unsigned VectorHeaderDoubles = 
+  (sizeof(VectorHeader) + sizeof(double) - 1) / sizeof(double);
+
+static VectorHeader *GetVectorHeader(double *ptr) {
+  return ((VectorHeader *)ptr) - 1;
+}
+
+/// NewVectorVersion - Return a version no vector contents have had before.
+/// A vector is identified by its storage and version, see MapCache.
+static unsigned NewVectorVersion() {
+  static unsigned LastVersion = 0;
+  return ++LastVersion;
+}
+
+// GPU runtime functions, see launch.cpp
+extern void *AllocPinnedHost(size_t bytes);
+extern void FreePinnedHost(void *p);
+extern void SyncHostBuffer(void *buf);
+extern void SyncAllLaunches();
+extern void QueueHostCall(void (*run)(char *), char *env, void **outputs, 
+                          unsigned noutputs);
+
+/// AsyncMaps - Set by -async: maps are queued on the GPU and only waited for
+/// when the host needs their results, see LaunchOnGpu, and the externs in
+/// QueuedExterns are queued as host calls, see EmitQueuedCall.  Vectors are
+/// then allocated page-locked, so their copies can overlap with the host.
+static bool AsyncMaps = false;
+
+/// AllocVectorStorage - Allocate room for length elements, returning a
+/// pointer to the first element with a single reference held by the caller.
+static double *AllocVectorStorage(int length) {
+  size_t Bytes = sizeof(VectorHeader) + length * sizeof(double);
+  VectorHeader *H = (VectorHeader *)(AsyncMaps ? AllocPinnedHost(Bytes) 
+                                               : malloc(Bytes));
+  if (H == NULL)
+    return NULL;
+  H->pinned = AsyncMaps;
+  H->refcount = 1;
+  H->capacity = length;
+  H->version = NewVectorVersion();
+  return (double *)(H + 1);
+}
+
+/// ReleaseVectorStorage - Drop a reference, freeing the storage with the last.
+/// Storage that is not reference counted (see vector_init_inline) is ignored.
+static void ReleaseVectorStorage(double *ptr) {
+  if (ptr == NULL || GetVectorHeader(ptr)->refcount < 0)
+    return;
+  if (--GetVectorHeader(ptr)->refcount == 0) {
+    // A map may still be copying from or into it.
+    SyncHostBuffer(ptr);
+    if (GetVectorHeader(ptr)->pinned)
+      FreePinnedHost(GetVectorHeader(ptr));
+    else
+      free(GetVectorHeader(ptr));
+  }
+}
+
+/// AcquireVectorStorage - Like AllocVectorStorage, but recycles the buffer
+/// held by slot (see TempSlotPlanner) when nothing but the slot references it
+/// any more and it is large enough.  The slot keeps a reference of its own to
+/// whichever buffer it ends up holding.
+static double *AcquireVectorStorage(DVector *slot, int length) {
+  if (slot == NULL)
+    return AllocVectorStorage(length);
+
+  if (slot->ptr) {
+    VectorHeader *H = GetVectorHeader(slot->ptr);
+    if (H->refcount == 1 && H->capacity >= length) {
+      SyncHostBuffer(slot->ptr);
+      H->refcount++;
+      H->version = NewVectorVersion();
+      slot->length = length;
+      return slot->ptr;
+    }
+    // Still referenced elsewhere (or too small); leave it to its owners.
+    ReleaseVectorStorage(slot->ptr);
+  }
+
+  slot->ptr = AllocVectorStorage(length);
+  slot->length = length;
+  if (slot->ptr)
+    GetVectorHeader(slot->ptr)->refcount++;
+  return slot->ptr;
+}
+
 static StructType* DVecType = NULL;
 static PointerType* DVecPtrType = NULL;
+static StructType* MapArgType = NULL;
 static Type* DoubleType = NULL;
 
+/// HoldsVectors - Return true if values of type T reference vector storage:
+/// vectors and the tuples of vectors a map over a tuple function returns.
+static bool HoldsVectors(Type *T) {
+  if (ArrayType *AT = dyn_cast<ArrayType>(T))
+    return AT->getElementType() == DVecType;
+  return T == DVecType;
+}
+
 Module *TheModule;
+static ExecutionEngine *TheExecutionEngine;
 IRBuilder<> Builder(getGlobalContext());
 std::map<std::string, AllocaInst*> NamedValues;
 FunctionPassManager *TheFPM;
 
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+
+static cl::opt<std::string>
+InputFilename(cl::Positional, cl::desc("<input file>"), cl::init("-"));
+
+enum IfConversionMode { IfConvertNever, IfConvertCheap, IfConvertAlways };
+
+static cl::opt<IfConversionMode>
+IfConversion("if-convert", 
+             cl::desc("Emit if/then/else as a select instead of a branch:"),
+             cl::values(clEnumValN(IfConvertNever, "never", "always branch"),
+                        clEnumValN(IfConvertCheap, "cheap", 
+                                   "when both arms are cheap (default)"),
+                        clEnumValN(IfConvertAlways, "always", 
+                                   "whenever both arms are free of side effects"),
+                        clEnumValEnd),
+             cl::init(IfConvertCheap));
+
+static cl::opt<unsigned>
+IfConversionThreshold("if-convert-threshold", 
+                      cl::desc("Largest combined cost of the arms of an if "
+                               "that is emitted as a select"), 
+                      cl::init(8));
+
+static cl::opt<bool, true>
+Async("async", 
+      cl::desc("Run maps asynchronously, waiting for a result only when "
+               "the host uses it"),
+      cl::location(AsyncMaps));
+
+static cl::opt<unsigned>
+MemoBudget("memo-budget", 
+           cl::desc("Megabytes of map results kept to be reused when the "
+                    "same map is run on unchanged inputs (0 = off)"), 
+           cl::init(0));
+
+static cl::opt<bool>
+TileMapChains("tile-map-chains", 
+              cl::desc("Run a map of a map tile by tile, each tile going "
+                       "through all the maps while it is in cache (default)"), 
+              cl::init(true));
+
+static cl::opt<unsigned>
+SpecializeLengths("specialize-lengths", 
+                  cl::desc("Number of vector lengths a map call site gets "
+                           "kernels specialized for, without bounds checks "
+                           "where possible (0 = off)"), 
+                  cl::init(0));
+
+static cl::opt<bool>
+Reproducible("reproducible", 
+             cl::desc("Make reductions give bitwise identical results on "
+                      "any device, summing fixed chunks of elements in a "
+                      "fixed order"), 
+             cl::init(false));
+
+/// Elements a reduction sums in order in reproducible mode, see 
+/// MergeStatsTree.
+static const unsigned ReproducibleChunk = 256;
+
 static FILE *Infile = stdin;       // where to read input
 
 static std::string IdentifierStr;  // Filled in if tok_identifier
@@ -73,11 +277,71 @@ class PrototypeAST;
 class FunctionAST;
 
 // GPU JIT functions
-extern void CreateNVVMMapKernel(Module *M, Function *F, IRBuilder<> &Builder, 
-                                std::string &kernelname) ; 
+extern void CreateNVVMMapKernel(Module *M, const std::vector<Function*> &Fs,
+                                const std::vector<std::vector<unsigned> > &ArgMap,
+                                const std::vector<bool> &Generated,
+                                unsigned FixedN, bool Exact,
+                                IRBuilder<> &Builder, std::string &kernelname,
+                                std::vector<std::string> &Constants) ; 
+extern void CreateNVVMStatsKernel(Module *M, Function *F,
+                                  const std::vector<unsigned> &ArgMap,
+                                  const std::vector<bool> &Generated,
+                                  unsigned Chunk, IRBuilder<> &Builder, 
+                                  std::string &kernelname,
+                                  std::vector<std::string> &Constants);
+extern void CreateNVVMMatMulKernel(Module *M, unsigned Tile, 
+                                   IRBuilder<> &Builder, 
+                                   std::string &kernelname);
+extern void CreateNVVMRadixSortKernels(Module *M, unsigned Tile, 
+                                       IRBuilder<> &Builder, 
+                                       std::vector<std::string> &kernelnames);
 extern char *BitCodeToPtx(llvm::Module *M);
-void LaunchOnGpu(const char *kernel, unsigned funcarity, unsigned N, void **args, 
-                 void *resbuf, const char *filename);
+void LaunchOnGpu(const char *kernel, unsigned nargs, unsigned N, void **args, 
+                 const std::vector<bool> &generated, double *affine, 
+                 unsigned nres, void **resbufs, unsigned nconsts, 
+                 double *consts, const char *filename, bool async);
+bool ExactGrid(unsigned N);
+struct LaunchPlan;
+LaunchPlan *CreateLaunchPlan(const char *kernel, const char *ptxBuff, 
+                             unsigned nargs, 
+                             const std::vector<bool> &generated, 
+                             unsigned nres, unsigned N);
+void DestroyLaunchPlan(LaunchPlan *P);
+void LaunchPlanned(LaunchPlan *P, void **args, double *affine, void **resbufs,
+                   unsigned nconsts, double *consts, bool async, bool owned);
+void LaunchChainOnGpu(unsigned nstages, const char **kernels, const char **ptx,
+                      unsigned *nstageargs, int *stageargs, 
+                      unsigned *nstageconsts, double *consts, unsigned nargs,
+                      unsigned N, void **args, 
+                      const std::vector<bool> &generated, double *affine, 
+                      void *result, bool async);
+unsigned LaunchReductionOnGpu(const char *kernel, const char *ptxBuff, 
+                              unsigned nargs, unsigned N, void **args, 
+                              const std::vector<bool> &generated,
+                              double *affine, unsigned nconsts, double *consts,
+                              unsigned nvalues, unsigned chunk, 
+                              std::vector<double> &partials);
+void LaunchMatMulOnGpu(const char *kernel, const char *ptxBuff, unsigned tile,
+                       unsigned m, unsigned k, unsigned n, double *a, 
+                       double *b, double *c);
+void LaunchSortOnGpu(const char **kernels, const char *ptxBuff, unsigned tile,
+                     unsigned npasses, const unsigned *shifts, unsigned n, 
+                     void *keys, int *perm);
+struct MapPlan;
+static MapPlan *PrepareMapPlan(const std::vector<std::string> &Names,
+                               const std::vector<int> &ArgMap,
+                               const std::vector<bool> &Generated,
+                               bool Memoizable = true);
+struct MapChainPlan;
+static MapChainPlan *PrepareMapChainPlan(const std::vector<std::string> &Names,
+                                         const std::vector<int> &ArgMap,
+                                         const std::vector<bool> &Generated);
+struct BuiltinInfo;
+static const BuiltinInfo *FindBuiltin(const std::string &Name);
+struct StatsPlan;
+static StatsPlan *PrepareStatsPlan(const std::string &Name,
+                                   const std::vector<int> &ArgMap,
+                                   const std::vector<bool> &Generated);
 
 /// Error* - These are little helper functions for error handling.
 ExprAST *Error(const char *Str) { fprintf(stderr, "Error: %s\n", Str); return 0;}
@@ -109,6 +373,8 @@ static int gettok() {
     if (IdentifierStr == "unary") return tok_unary;
     if (IdentifierStr == "var") return tok_var;
     if (IdentifierStr == "vector") return tok_vector;
+    if (IdentifierStr == "tuple") return tok_tuple;
+    if (IdentifierStr == "global") return tok_global;
     return tok_identifier;
   }
 
@@ -152,6 +418,12 @@ public:
   virtual ~ExprAST() {}
   virtual Value *Codegen() = 0;
   virtual Type *getType() const { return DoubleType; }
+  /// isTemporary - Return true if V, the value Codegen produced for this node,
+  /// is a vector whose reference now belongs to the consumer, which must
+  /// either keep it or release it.  Other vectors are only borrowed.
+  virtual bool isTemporary(Value *V) const { return false; }
+  /// getChildren - Append the direct subexpressions of this node to Kids.
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const {}
 };
 
 /// NumberExprAST - Expression class for numeric literals like "1.0".
@@ -159,6 +431,7 @@ class NumberExprAST : public ExprAST {
   double Val;
 public:
   NumberExprAST(double val) : Val(val) {}
+  double getVal() const { return Val; }
   virtual Value *Codegen();
 };
 
@@ -173,7 +446,7 @@ public:
   ExprAST *getLength() const { return Length; }
   virtual Value *Codegen();
   virtual bool isVector() const { return (Length != 0); }
-  virtual Type *getType() const { return isVector() ? DVecType : DoubleType; }
+  virtual Type *getType() const;
 };
 
 /// UnaryExprAST - Expression class for a unary operator.
@@ -183,8 +456,13 @@ class UnaryExprAST : public ExprAST {
 public:
   UnaryExprAST(char opcode, ExprAST *operand) 
     : Opcode(opcode), Operand(operand) {}
+  char getOpcode() const { return Opcode; }
   virtual Value *Codegen();
   virtual Type *getType() const { return Operand->getType(); }
+  virtual bool isTemporary(Value *V) const { return HoldsVectors(V->getType()); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(Operand); 
+  }
 };
 
 /// BinaryExprAST - Expression class for a binary operator.
@@ -194,11 +472,23 @@ class BinaryExprAST : public ExprAST {
 public:
   BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs) 
     : Op(op), LHS(lhs), RHS(rhs) {}
+  char getOp() const { return Op; }
+  ExprAST *getLHS() const { return LHS; }
+  ExprAST *getRHS() const { return RHS; }
+  /// isUserDefined - Return true if this operator is a call to a 'def binary'.
+  bool isUserDefined() const { return !strchr("=<>+-*/", Op); }
   virtual Value *Codegen();
   virtual Type *getType() const { 
     assert(LHS->getType() == RHS->getType());
     return LHS->getType(); 
   }
+  virtual bool isTemporary(Value *V) const { 
+    return Op != '=' && HoldsVectors(V->getType()); 
+  }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(LHS);
+    Kids.push_back(RHS);
+  }
 };
 
 /// CallExprAST - Expression class for function calls.
@@ -208,18 +498,231 @@ class CallExprAST : public ExprAST {
 public:
   CallExprAST(const std::string &callee, std::vector<ExprAST*> &args)
     : Callee(callee), Args(args) {}
+  const std::string &getCallee() const { return Callee; }
+  virtual Value *Codegen();
+  virtual bool isTemporary(Value *V) const { return HoldsVectors(V->getType()); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.insert(Kids.end(), Args.begin(), Args.end());
+  }
+};
+
+/// GlobalVectorAST - The declaration of a session global vector, like 
+/// "global vector prices[N]".  The vector lives in a global variable of the
+/// module, so later top-level expressions and functions can use it.
+/// Declaring it again allocates a new vector.
+class GlobalVectorAST : public ExprAST {
+  std::string Name;
+  ExprAST *Length;
+public:
+  GlobalVectorAST(const std::string &name, ExprAST *length) 
+    : Name(name), Length(length) {}
+  const std::string &getName() const { return Name; }
+  virtual Value *Codegen();
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(Length);
+  }
+};
+
+/// GlobalScalarsAST - The declaration of session global constants, like
+/// "global R = 0.02, V = 0.3".  Each lives in a global variable of the 
+/// module, which functions can read as an ordinary variable.  Maps pass the
+/// values to their kernels on every launch (see LowerGlobalConstants in 
+/// nvvmwrapper.cpp), so declaring or assigning a global again changes what
+/// later maps see without generating a new kernel.
+class GlobalScalarsAST : public ExprAST {
+  std::vector<std::pair<std::string, ExprAST*> > Globals;
+public:
+  GlobalScalarsAST(const std::vector<std::pair<std::string, ExprAST*> > &globals)
+    : Globals(globals) {}
+  virtual Value *Codegen();
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    for (unsigned i = 0, e = Globals.size(); i != e; ++i)
+      Kids.push_back(Globals[i].second);
+  }
+};
+
+/// GeneratorExprAST - Expression class for the generated vectors iota(N),
+/// linspace(a, b, N) and fill(c, N), whose element i is start + i * step.
+/// A map computes their elements from the index in the kernel, so they are
+/// only materialized when used anywhere else.
+class GeneratorExprAST : public ExprAST {
+  std::string Kind;
+  std::vector<ExprAST*> Args;
+public:
+  GeneratorExprAST(const std::string &kind, std::vector<ExprAST*> &args)
+    : Kind(kind), Args(args) {}
+  /// getArity - The number of arguments of generator Name, or 0 if Name is
+  /// not a generator.
+  static unsigned getArity(const std::string &Name) {
+    if (Name == "iota") return 1;
+    if (Name == "fill") return 2;
+    if (Name == "linspace") return 3;
+    return 0;
+  }
+  const std::vector<ExprAST*> &getArgs() const { return Args; }
+  bool codegenAffine(Value *&Start, Value *&Step, Value *&Length);
+  virtual Value *Codegen();
+  virtual Type *getType() const { 
+    if (ArrayType *AT = dyn_cast<ArrayType>(Args[0]->getType()))
+      return ArrayType::get(DVecType, AT->getNumElements());
+    return DVecType;
+  }
+  virtual bool isTemporary(Value *V) const { return true; }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.insert(Kids.end(), Args.begin(), Args.end());
+  }
+};
+
+/// TupleExprAST - Expression class for tuple literals, like "tuple(a, b)",
+/// of numbers or of vectors.
+class TupleExprAST : public ExprAST {
+  std::vector<ExprAST*> Elts;
+public:
+  TupleExprAST(std::vector<ExprAST*> &elts) : Elts(elts) {}
+  virtual Value *Codegen();
+  virtual Type *getType() const { 
+    return ArrayType::get(Elts[0]->getType(), Elts.size()); 
+  }
+  virtual bool isTemporary(Value *V) const { return HoldsVectors(V->getType()); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.insert(Kids.end(), Elts.begin(), Elts.end());
+  }
+};
+
+/// ElementExprAST - Expression class for an element of a tuple, like "t[0]".
+class ElementExprAST : public ExprAST {
+  ExprAST *Tuple;
+  unsigned Index;
+  bool Owned;  // taken over from a temporary tuple of vectors
+public:
+  ElementExprAST(ExprAST *tuple, unsigned index) 
+    : Tuple(tuple), Index(index), Owned(false) {}
   virtual Value *Codegen();
+  virtual Type *getType() const { 
+    Type *T = Tuple->getType();
+    if (ArrayType *AT = dyn_cast<ArrayType>(T))
+      return AT->getElementType();
+    return T == DVecType ? DVecType : DoubleType; 
+  }
+  virtual bool isTemporary(Value *V) const { 
+    return Owned && HoldsVectors(V->getType()); 
+  }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(Tuple);
+  }
 };
 
 /// MapExprAST - Expression class for map.
 class MapExprAST : public ExprAST {
   std::string Callee;
   std::vector<ExprAST*> Args;
+  Value *Hoisted;  // result computed ahead of an enclosing loop, if any
+  Value *Fused;    // result computed by a fused sibling map, if any
 public:
   MapExprAST(const std::string &callee, std::vector<ExprAST*> &args)
+    : Callee(callee), Args(args), Hoisted(0), Fused(0) {}
+  const std::string &getCallee() const { return Callee; }
+  const std::vector<ExprAST*> &getArgs() const { return Args; }
+  Value *getHoisted() const { return Hoisted; }
+  void setHoisted(Value *V) { Hoisted = V; }
+  void setFused(Value *V) { Fused = V; }
+  bool isFusable() const;
+  int getChainLink() const;
+  virtual Value *Codegen();
+  virtual Type *getType() const;
+  // A hoisted result belongs to the loop and is only borrowed by each
+  // iteration.
+  virtual bool isTemporary(Value *V) const { return Hoisted == 0; }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.insert(Kids.end(), Args.begin(), Args.end());
+  }
+};
+
+/// MapBatchExprAST - Expression class for mapbatch, like 
+/// "mapbatch(f, tuple(a, b), tuple(c, d))", which maps f over each batch of
+/// vectors, here a with c and b with d, and returns the tuple of results.
+/// All batches go to the device in one launch.
+class MapBatchExprAST : public ExprAST {
+  std::string Callee;
+  std::vector<ExprAST*> Args;
+public:
+  MapBatchExprAST(const std::string &callee, std::vector<ExprAST*> &args)
     : Callee(callee), Args(args) {}
   virtual Value *Codegen();
-  virtual Type *getType() const { return DVecType; }
+  virtual Type *getType() const { 
+    if (ArrayType *AT = dyn_cast<ArrayType>(Args[0]->getType()))
+      return ArrayType::get(DVecType, AT->getNumElements());
+    return DVecType;
+  }
+  virtual bool isTemporary(Value *V) const { return true; }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.insert(Kids.end(), Args.begin(), Args.end());
+  }
+};
+
+/// StatsExprAST - Expression class for stats(v), the tuple of the sum, mean,
+/// variance, minimum, maximum and count of the elements of v, computed in 
+/// one pass over them.  For stats(map(f, ...)) the kernel reduces the values
+/// of f as it computes them, without storing the mapped vector.
+class StatsExprAST : public ExprAST {
+  ExprAST *Arg;
+public:
+  StatsExprAST(ExprAST *arg) : Arg(arg) {}
+  enum { Sum, Mean, Variance, Min, Max, Count, NumStats };
+  virtual Value *Codegen();
+  virtual Type *getType() const { return ArrayType::get(DoubleType, NumStats); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(Arg);
+  }
+};
+
+/// BuiltinInfo - A built-in of the vector library, like sort, which takes 
+/// numbers and vectors and returns numbers or vectors, computed on the host
+/// by its runtime function.  Params and Results have a character for each
+/// argument and result: 'v' for a vector, 'd' for a number, and for 
+/// arguments 'o' for the name of an aggregate operation (see AggOp), 
+/// passed as its number, and 'm' for a sparse matrix in CSR format, the 
+/// tuple of the vectors of its row offsets, column indices and values, 
+/// passed as those three vectors.  Several results make a tuple, so they are of one
+/// kind.  The runtime function receives the vector arguments in vecs and 
+/// the numbers in nums, in order,
+/// and returns its results in vres or dres, the vectors stored in the 
+/// buffers of their slots if those can be recycled.
+typedef void (*BuiltinFn)(DVector *vecs, double *nums, DVector *vres, 
+                          double *dres, DVector **slots);
+struct BuiltinInfo {
+  const char *Name;
+  const char *Params;
+  const char *Results;
+  const char *Runtime;
+  BuiltinFn Fn;
+};
+
+/// AggOp - The aggregate operations of groupAgg.
+enum AggOp { AggSum, AggCount, AggMean, AggMin, AggMax, NumAggOps };
+static const char *AggOpNames[NumAggOps] = { "sum", "count", "mean", "min", 
+                                             "max" };
+
+/// BuiltinExprAST - Expression class for calls of the vector library 
+/// built-ins, see BuiltinInfo.
+class BuiltinExprAST : public ExprAST {
+  const BuiltinInfo *Info;
+  std::vector<ExprAST*> Args;
+public:
+  BuiltinExprAST(const BuiltinInfo *info, std::vector<ExprAST*> &args)
+    : Info(info), Args(args) {}
+  virtual Value *Codegen();
+  virtual Type *getType() const { 
+    Type *T = Info->Results[0] == 'v' ? DVecType : DoubleType;
+    unsigned K = strlen(Info->Results);
+    return K == 1 ? T : ArrayType::get(T, K);
+  }
+  virtual bool isTemporary(Value *V) const { return HoldsVectors(V->getType()); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+      if (Info->Params[i] != 'o')
+        Kids.push_back(Args[i]);
+  }
 };
 
 /// IfExprAST - Expression class for if/then/else.
@@ -228,11 +731,19 @@ class IfExprAST : public ExprAST {
 public:
   IfExprAST(ExprAST *cond, ExprAST *then, ExprAST *_else)
   : Cond(cond), Then(then), Else(_else) {}
+  ExprAST *getCond() const { return Cond; }
+  bool shouldSelect() const;
   virtual Value *Codegen();
   virtual Type *getType() const { 
     assert(Then->getType() == Else->getType());
     return Then->getType();
   }
+  virtual bool isTemporary(Value *V) const { return HoldsVectors(V->getType()); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(Cond);
+    Kids.push_back(Then);
+    Kids.push_back(Else);
+  }
 };
 
 /// ForExprAST - Expression class for for/in.
@@ -243,7 +754,16 @@ public:
   ForExprAST(const std::string &varname, ExprAST *start, ExprAST *end,
              ExprAST *step, ExprAST *body)
     : VarName(varname), Start(start), End(end), Step(step), Body(body) {}
+  const std::string &getVarName() const { return VarName; }
+  ExprAST *getStart() const { return Start; }
+  ExprAST *getEnd() const { return End; }
   virtual Value *Codegen();
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    Kids.push_back(Start);
+    Kids.push_back(End);
+    if (Step) Kids.push_back(Step);
+    Kids.push_back(Body);
+  }
 };
 
 /// VarExprAST - Expression class for var/in
@@ -251,12 +771,33 @@ class VarExprAST : public ExprAST {
   typedef std::vector<std::pair<VariableExprAST*, ExprAST*> > VarList;
   VarList Variables;
   ExprAST *Body;
+  std::vector<AllocaInst*> HoistedStorage; // allocated ahead of a loop, by index
 public:
   VarExprAST(VarList &variables, ExprAST *body)
-  : Variables(variables), Body(body) {}
+  : Variables(variables), Body(body), HoistedStorage(variables.size()) {}
   
+  unsigned getNumVars() const { return Variables.size(); }
+  const std::string &getVarName(unsigned i) const { 
+    return Variables[i].first->getName(); 
+  }
+  bool isVectorVar(unsigned i) const { return Variables[i].first->isVector(); }
+  bool mayEscape(unsigned i) const;
+  bool isInlineVector(unsigned i) const;
+  AllocaInst *hoistStorage(unsigned i, const std::set<std::string> &Clobbered);
+  AllocaInst *getHoistedStorage(unsigned i) const { return HoistedStorage[i]; }
+  void clearHoistedStorage(unsigned i) { HoistedStorage[i] = 0; }
   virtual Value *Codegen();
   virtual Type *getType() const { return Body->getType(); }
+  virtual bool isTemporary(Value *V) const { return HoldsVectors(V->getType()); }
+  virtual void getChildren(std::vector<ExprAST*> &Kids) const { 
+    for (unsigned i = 0, e = Variables.size(); i != e; ++i) {
+      if (Variables[i].first->isVector())
+        Kids.push_back(Variables[i].first->getLength());
+      if (Variables[i].second)
+        Kids.push_back(Variables[i].second);
+    }
+    Kids.push_back(Body);
+  }
 };
 
 /// PrototypeAST - This class represents the "prototype" for a function,
@@ -284,25 +825,41 @@ public:
   }
   
   unsigned getBinaryPrecedence() const { return Precedence; }
+
+  /// isScalar - Return true if all arguments are doubles and the result is
+  /// a double or a tuple of them.
+  bool isScalar() const {
+    for (unsigned i = 0, e = FormalTypes.size(); i != e; ++i)
+      if (FormalTypes[i] != DoubleType)
+        return false;
+    return ReturnType == DoubleType || 
+      (ReturnType->isArrayTy() && !HoldsVectors(ReturnType));
+  }
   
   Function *Codegen();
   
   void CreateArgumentAllocas(Function *F);
+  void ReleaseVectorArguments();
 
   virtual Type *getType() const { return ReturnType; }
 };
 
-/// FunctionAST - This class represents a function definition itself.
+/// FunctionAST - This class represents a function definition itself.  The
+/// anonymous function of a top-level expression returns its value if it is
+/// a number and otherwise prints it, see vector_print.
 class FunctionAST {
   PrototypeAST *Proto;
   ExprAST *Body;
+  bool TopLevel;
+  Type *ResultType;  // of the value of Body, once generated
 public:
-  FunctionAST(PrototypeAST *proto, ExprAST *body)
-    : Proto(proto), Body(body) {}
+  FunctionAST(PrototypeAST *proto, ExprAST *body, bool toplevel = false)
+    : Proto(proto), Body(body), TopLevel(toplevel), ResultType(0) {}
   
   Function *Codegen();
   
   virtual Type *getType() const { return Proto->getType(); }
+  Type *getResultType() const { return ResultType; }
 };
 
 //===----------------------------------------------------------------------===//
@@ -349,7 +906,7 @@ static ExprAST *ParseIdentifierExpr() {
   // Call.
   getNextToken();  // eat (
 
-  if (IdName == "map") { 
+  if (IdName == "map" || IdName == "mapbatch") { 
     if (CurTok != tok_identifier) { 
       ErrorP("Expected identifier for first map argument");
     } 
@@ -378,14 +935,81 @@ static ExprAST *ParseIdentifierExpr() {
   // Eat the ')'.
   getNextToken();
   
+  if (unsigned Arity = GeneratorExprAST::getArity(IdName)) {
+    if (Args.size() != Arity)
+      return Error("Incorrect # arguments passed to generator");
+    return new GeneratorExprAST(IdName, Args);
+  }
+
+  if (const BuiltinInfo *B = FindBuiltin(IdName)) {
+    if (Args.size() != strlen(B->Params))
+      return Error("Incorrect # arguments passed to built-in");
+    return new BuiltinExprAST(B, Args);
+  }
+
+  if (IdName == "stats") {
+    if (Args.size() != 1)
+      return Error("stats takes one vector");
+    return new StatsExprAST(Args[0]);
+  }
+
   if (IdName == "map") { 
     return new MapExprAST(MapFunction, Args);
   } 
+  else if (IdName == "mapbatch") { 
+    return new MapBatchExprAST(MapFunction, Args);
+  } 
   else { 
     return new CallExprAST(IdName, Args);
   }
 }
 
+/// elementexpr
+///   ::= identifierexpr ('[' number ']')*
+static ExprAST *ParseElementExpr() {
+  ExprAST *E = ParseIdentifierExpr();
+
+  while (E && CurTok == '[') {
+    getNextToken();  // eat [
+    if (CurTok != tok_number)
+      return Error("expected constant tuple index");
+    unsigned Index = (unsigned)NumVal;
+    getNextToken();  // eat the index
+    if (CurTok != ']')
+      return Error("expected ']' after tuple index");
+    getNextToken();  // eat ]
+    E = new ElementExprAST(E, Index);
+  }
+  return E;
+}
+
+/// tupleexpr ::= 'tuple' '(' expression (',' expression)* ')'
+static ExprAST *ParseTupleExpr() {
+  getNextToken();  // eat tuple.
+  
+  if (CurTok != '(')
+    return Error("expected '(' after tuple");
+  getNextToken();  // eat (
+
+  std::vector<ExprAST*> Elts;
+  while (1) {
+    ExprAST *Elt = ParseExpression();
+    if (!Elt) return 0;
+    Elts.push_back(Elt);
+
+    if (CurTok == ')') break;
+
+    if (CurTok != ',')
+      return Error("Expected ')' or ',' in tuple");
+    getNextToken();
+  }
+
+  // Eat the ')'.
+  getNextToken();
+
+  return new TupleExprAST(Elts);
+}
+
 /// numberexpr ::= number
 static ExprAST *ParseNumberExpr() {
   ExprAST *Result = new NumberExprAST(NumVal);
@@ -540,16 +1164,18 @@ static ExprAST *ParseVarExpr() {
 }
 
 /// primary
-///   ::= identifierexpr
+///   ::= elementexpr
 ///   ::= numberexpr
 ///   ::= parenexpr
 ///   ::= ifexpr
 ///   ::= forexpr
 ///   ::= varexpr
+///   ::= tupleexpr
 static ExprAST *ParsePrimary() {
   switch (CurTok) {
   default: return Error("unknown token when expecting an expression");
-  case tok_identifier: return ParseIdentifierExpr();
+  case tok_identifier: return ParseElementExpr();
+  case tok_tuple:      return ParseTupleExpr();
   case tok_number:     return ParseNumberExpr();
   case '(':            return ParseParenExpr();
   case tok_if:         return ParseIfExpr();
@@ -618,23 +1244,45 @@ static ExprAST *ParseExpression() {
 }
 
 static Type *ParseType() {
-  // Default to double unless 'vector' specified.
+  // Default to double unless 'vector' or 'tuple[N]' specified.
   Type *t = Type::getDoubleTy(getGlobalContext());
 
   if (CurTok == tok_vector) {
     t = DVecType;
     getNextToken(); // eat 'vector'
   }
+  else if (CurTok == tok_tuple) {
+    getNextToken(); // eat 'tuple'
+    if (CurTok != '[')
+      return ErrorT("expected '[' after tuple");
+    getNextToken(); // eat the '['
+    if (CurTok != tok_number || NumVal < 1)
+      return ErrorT("expected tuple size");
+    t = ArrayType::get(t, (unsigned)NumVal);
+    getNextToken(); // eat the size
+    if (CurTok != ']')
+      return ErrorT("expected ']' after tuple size");
+    getNextToken(); // eat the ']'
+  }
 
   return t;
 }
 
+/// IsBuiltinName - Whether calls to Name parse as a built-in or generator
+/// rather than a call (see ParseIdentifierExpr), so a function of that name
+/// could never be called.
+static bool IsBuiltinName(const std::string &Name) {
+  return FindBuiltin(Name) != 0 || Name == "stats" || 
+         GeneratorExprAST::getArity(Name) != 0;
+}
+
 /// prototype
-///   ::= [vector] id '(' ([vector] id)* ')'
+///   ::= [vector|tuple[N]] id '(' ([vector] id)* ')'
 ///   ::= binary LETTER number? (id, id)
 ///   ::= unary LETTER (id)
 static PrototypeAST *ParsePrototype() {
   Type *returnType = ParseType();
+  if (returnType == 0) return 0;
 
   std::string FnName;
   
@@ -646,6 +1294,8 @@ static PrototypeAST *ParsePrototype() {
     return ErrorP("Expected function name in prototype");
   case tok_identifier:
     FnName = IdentifierStr;
+    if (IsBuiltinName(FnName))
+      return ErrorP("Function name is taken by a built-in");
     Kind = 0;
     getNextToken();
     break;
@@ -686,6 +1336,7 @@ static PrototypeAST *ParsePrototype() {
   std::vector<Type*> FormalTypes;
   while (CurTok != ')') { 
      Type *type = ParseType(); 
+     if (type == 0) return 0;
      if (CurTok != tok_identifier) { 
         return ErrorP("Expected identifier name");
      } 
@@ -720,13 +1371,11 @@ static FunctionAST *ParseDefinition() {
 /// toplevelexpr ::= expression
 static FunctionAST *ParseTopLevelExpr() {
   if (ExprAST *E = ParseExpression()) {
-    // Make an anonymous proto.
-    PrototypeAST *Proto;
-    if (E->getType() == DVecType)
-      Proto = new PrototypeAST("", std::vector<std::string>(), std::vector<Type*>(), DVecType);
-    else
-      Proto = new PrototypeAST("", std::vector<std::string>(), std::vector<Type*>(), DoubleType);
-    return new FunctionAST(Proto, E);
+    // Make an anonymous proto.  The type of E is only known once it is 
+    // generated, so the function returns a number whatever E is.
+    PrototypeAST *Proto = new PrototypeAST("", std::vector<std::string>(), 
+                                           std::vector<Type*>(), DoubleType);
+    return new FunctionAST(Proto, E, true);
   }
   return 0;
 }
@@ -737,6 +1386,61 @@ static PrototypeAST *ParseExtern() {
   return ParsePrototype();
 }
 
+/// global ::= 'global' 'vector' identifier '[' expression ']'
+///        ::= 'global' identifier '=' expression (',' identifier '=' expression)*
+static FunctionAST *ParseGlobal() {
+  getNextToken();  // eat global.
+
+  // Set up by running an anonymous function, like a top-level expression.
+  PrototypeAST *Proto = new PrototypeAST("", std::vector<std::string>(), 
+                                         std::vector<Type*>(), DoubleType);
+
+  if (CurTok == tok_identifier) {
+    std::vector<std::pair<std::string, ExprAST*> > Globals;
+    while (1) {
+      std::string Name = IdentifierStr;
+      getNextToken();  // eat identifier.
+
+      if (CurTok != '=')
+        return ErrorF("expected '=' after global constant name");
+      getNextToken();  // eat the '='.
+
+      ExprAST *Init = ParseExpression();
+      if (Init == 0) return 0;
+      Globals.push_back(std::make_pair(Name, Init));
+
+      if (CurTok != ',') break;
+      getNextToken();  // eat the ','.
+
+      if (CurTok != tok_identifier)
+        return ErrorF("expected identifier list after global");
+    }
+    return new FunctionAST(Proto, new GlobalScalarsAST(Globals));
+  }
+
+  if (CurTok != tok_vector)
+    return ErrorF("expected 'vector' or a name after global");
+  getNextToken();  // eat vector.
+
+  if (CurTok != tok_identifier)
+    return ErrorF("expected identifier in global definition");
+  std::string Name = IdentifierStr;
+  getNextToken();  // eat identifier.
+
+  if (CurTok != '[') 
+    return ErrorF("expected opening '[' in vector definition");
+  getNextToken();  // eat the '['.
+
+  ExprAST *Length = ParseExpression();
+  if (Length == 0) return 0;
+      
+  if (CurTok != ']')
+    return ErrorF("expected closing ']' in vector definition");
+  getNextToken();  // eat the ']'.
+
+  return new FunctionAST(Proto, new GlobalVectorAST(Name, Length));
+}
+
 //===----------------------------------------------------------------------===//
 // Code Generation
 //===----------------------------------------------------------------------===//
@@ -745,21 +1449,306 @@ Value *ErrorV(const char *Str) { Error(Str); return 0; }
 
 /// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
 /// the function.  This is used for mutable variables etc.
+AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+                                   const std::string &VarName,
+                                   Type *Ty) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                 TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Ty, 0, VarName.c_str());
+}
+
 AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
                                    const std::string &VarName,
                                    bool isVector) {
+  return CreateEntryBlockAlloca(TheFunction, VarName, 
+                                isVector ? DVecType : DoubleType);
+}
+
+/// CreateEntryBlockArray - Create an alloca of an array of N values of type
+/// Ty in the entry block of the function, so the stack does not grow each
+/// time a loop runs the code using it.  This is used for the arguments and
+/// results passed to the vector library.
+AllocaInst *CreateEntryBlockArray(Function *TheFunction, Type *Ty, 
+                                  unsigned N, const std::string &Name = "") {
   IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                  TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(isVector ? DVecType : DoubleType, 0, VarName.c_str());
+  return TmpB.CreateAlloca(Ty, 
+                           ConstantInt::get(Type::getInt32Ty(getGlobalContext()), N), 
+                           Name.c_str());
+}
+
+/// TempSlotPlanner - Plans the buffers of the vector temporaries of the
+/// function being generated.  Each map result is assigned a slot when it is
+/// created and gives it back when its consumer releases it, so temporaries
+/// whose lifetimes do not overlap share a slot.  At run time RunMap
+/// recycles the buffer a slot holds whenever nobody else references it, so a
+/// pipeline (or a loop around one) reuses a few buffers instead of allocating
+/// one per stage.  Lengths are only known at run time, so buffers are sized
+/// lazily on first use and grown as needed; they are freed on function exit.
+class TempSlotPlanner {
+  std::vector<AllocaInst*> Slots;
+  std::vector<bool> Busy;
+  std::map<Value*, std::vector<unsigned> > SlotsOf;
+public:
+  /// acquire - Return a free slot of F, creating a new one if all are busy.
+  unsigned acquire(Function *F) {
+    for (unsigned i = 0, e = Busy.size(); i != e; ++i)
+      if (!Busy[i]) {
+        Busy[i] = true;
+        return i;
+      }
+
+    // Slots start out empty; the store goes right after the alloca at the
+    // top of the entry block.
+    AllocaInst *Slot = CreateEntryBlockAlloca(F, "tmpslot", true);
+    IRBuilder<> TmpB(Slot->getParent(), ++BasicBlock::iterator(Slot));
+    TmpB.CreateStore(Constant::getNullValue(DVecType), Slot);
+    Slots.push_back(Slot);
+    Busy.push_back(true);
+    return Slots.size() - 1;
+  }
+
+  AllocaInst *getSlot(unsigned i) const { return Slots[i]; }
+
+  /// assign - Record that the temporary V, or the next element of it if V
+  /// is a tuple of vectors, lives in slot i.
+  void assign(Value *V, unsigned i) { SlotsOf[V].push_back(i); }
+
+  /// release - V has died, so its slots can be planned for other temporaries.
+  void release(Value *V) {
+    std::map<Value*, std::vector<unsigned> >::iterator I = SlotsOf.find(V);
+    if (I == SlotsOf.end())
+      return;
+    for (unsigned i = 0, e = I->second.size(); i != e; ++i)
+      Busy[I->second[i]] = false;
+    SlotsOf.erase(I);
+  }
+
+  /// extract - Elt, element i of the temporary tuple V, outlives the rest of
+  /// V, so it keeps its slot.
+  void extract(Value *V, unsigned i, Value *Elt) {
+    std::map<Value*, std::vector<unsigned> >::iterator I = SlotsOf.find(V);
+    if (I == SlotsOf.end())
+      return;
+    unsigned Slot = I->second[i];
+    release(V);
+    Busy[Slot] = true;
+    assign(Elt, Slot);
+  }
+
+  /// emitFree - Drop the references the slots hold, at function exit.
+  void emitFree() {
+    Function *DVecFree = TheModule->getFunction("vector_free");
+    for (unsigned i = 0, e = Slots.size(); i != e; ++i)
+      Builder.CreateCall(DVecFree, Slots[i]);
+  }
+
+  void reset() {
+    Slots.clear();
+    Busy.clear();
+    SlotsOf.clear();
+  }
+};
+
+static TempSlotPlanner TempSlots;
+
+/// EmitVectorRetain/EmitVectorRelease - Emit calls that add or drop a
+/// reference to the storage of the vector value V, or of each vector in the
+/// tuple V.
+static void EmitVectorRetain(Value *V) {
+  if (ArrayType *AT = dyn_cast<ArrayType>(V->getType())) {
+    for (unsigned i = 0, e = AT->getNumElements(); i != e; ++i)
+      EmitVectorRetain(Builder.CreateExtractValue(V, std::vector<unsigned>(1, i)));
+    return;
+  }
+  std::vector<unsigned> a0; a0.push_back(0);
+  Value *ptr = Builder.CreateExtractValue(V, a0, "extr_ptr");
+  Builder.CreateCall(TheModule->getFunction("vector_retain"), ptr);
+}
+
+static void EmitVectorRelease(Value *V) {
+  TempSlots.release(V);
+  if (ArrayType *AT = dyn_cast<ArrayType>(V->getType())) {
+    for (unsigned i = 0, e = AT->getNumElements(); i != e; ++i)
+      EmitVectorRelease(Builder.CreateExtractValue(V, std::vector<unsigned>(1, i)));
+    return;
+  }
+  std::vector<unsigned> a0; a0.push_back(0);
+  Value *ptr = Builder.CreateExtractValue(V, a0, "extr_ptr");
+  Builder.CreateCall(TheModule->getFunction("vector_release"), ptr);
+}
+
+/// VectorReadingFunctions - Externs that only read the vectors they are
+/// passed.
+static const char *VectorReadingFunctions[] = { "printVector", 0 };
+
+/// QueuedExterns - Externs that write only the vectors they are passed and
+/// return nothing of use, so with -async their calls can be queued.
+static const char *QueuedExterns[] = { "randVector", 0 };
+
+static bool IsQueuedExtern(Function *F) {
+  if (!F->empty())
+    return false;
+  for (const char **Name = QueuedExterns; *Name; ++Name)
+    if (F->getName() == *Name)
+      return true;
+  return false;
+}
+
+/// MayWriteVectorArgs - Return true if calling F may write to the contents
+/// of its vector arguments.  Functions defined in the language cannot, but
+/// externs like randVector do.
+static bool MayWriteVectorArgs(Function *F) {
+  if (!F->empty())
+    return false;
+  for (const char **Name = VectorReadingFunctions; *Name; ++Name)
+    if (F->getName() == *Name)
+      return false;
+  return true;
+}
+
+/// CollectGlobalAccesses - Add the names of the session globals that F, or
+/// a function it calls, loads to Read and stores to Written.  Visited holds
+/// the functions already looked at.
+static void CollectGlobalAccesses(Function *F, std::set<std::string> &Read,
+                                  std::set<std::string> &Written,
+                                  std::set<Function*> &Visited) {
+  if (!Visited.insert(F).second)
+    return;
+  for (Function::iterator BB = F->begin(), BE = F->end(); BB != BE; ++BB) {
+    for (BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE; 
+         ++II) {
+      Instruction *I = &*II;
+      if (LoadInst *L = dyn_cast<LoadInst>(I)) {
+        if (isa<GlobalVariable>(L->getPointerOperand()))
+          Read.insert(L->getPointerOperand()->getName().str());
+      } else if (StoreInst *S = dyn_cast<StoreInst>(I)) {
+        if (isa<GlobalVariable>(S->getPointerOperand()))
+          Written.insert(S->getPointerOperand()->getName().str());
+      } else if (CallInst *C = dyn_cast<CallInst>(I)) {
+        if (Function *Callee = C->getCalledFunction())
+          CollectGlobalAccesses(Callee, Read, Written, Visited);
+      }
+    }
+  }
+}
+
+/// WritesSessionGlobals - Return true if F, or a function it calls, assigns
+/// a session global.  Map kernels cannot: they read the values the globals
+/// have at launch, see LowerGlobalConstants in nvvmwrapper.cpp.
+static bool WritesSessionGlobals(Function *F) {
+  std::set<std::string> Read, Written;
+  std::set<Function*> Visited;
+  CollectGlobalAccesses(F, Read, Written, Visited);
+  return !Written.empty();
+}
+
+/// GetMapCallee - Return the function called Name to map over vectors, or
+/// report an error and return null if there is none or it cannot run in a
+/// kernel.
+static Function *GetMapCallee(const std::string &Name) {
+  Function *CalleeF = TheModule->getFunction(Name);
+  if (CalleeF == 0) {
+    ErrorV("Unknown function referenced");
+    return 0;
+  }
+  if (WritesSessionGlobals(CalleeF)) {
+    ErrorV("Mapped functions cannot assign session globals");
+    return 0;
+  }
+  return CalleeF;
+}
+
+/// EmitVectorTouch - Emit a call recording that the contents of the vector
+/// value V have been written.
+static void EmitVectorTouch(Value *V) {
+  std::vector<unsigned> a0; a0.push_back(0);
+  Value *ptr = Builder.CreateExtractValue(V, a0, "extr_ptr");
+  Builder.CreateCall(TheModule->getFunction("vector_touch"), ptr);
+}
+
+/// CodegenOwned - Emit E and make sure the caller ends up holding a reference
+/// to the resulting vector, retaining it if E only produced a borrowed one.
+static Value *CodegenOwned(ExprAST *E) {
+  Value *V = E->Codegen();
+  if (V && HoldsVectors(V->getType()) && !E->isTemporary(V))
+    EmitVectorRetain(V);
+  return V;
 }
 
+static void FuseSiblingMaps(const std::vector<ExprAST*> &Args, unsigned i);
+
 Value *NumberExprAST::Codegen() {
   return ConstantFP::get(getGlobalContext(), APFloat(Val));
 }
 
+/// LookupVariable - Return the storage of variable Name: the local variable
+/// or argument in scope, else the session global (see GlobalVectorAST), or
+/// null if there is none.
+static Value *LookupVariable(const std::string &Name) {
+  if (AllocaInst *A = NamedValues[Name])
+    return A;
+  return TheModule->getNamedGlobal(Name);
+}
+
+/// GetSessionGlobal - Return the session global called Name of type Ty,
+/// creating it if there is none yet, or null if the name is taken.
+static GlobalVariable *GetSessionGlobal(const std::string &Name, Type *Ty) {
+  GlobalVariable *GV = TheModule->getNamedGlobal(Name);
+  if (GV == 0) {
+    if (TheModule->getNamedValue(Name)) {
+      Error("global name is already used by a function");
+      return 0;
+    }
+    return new GlobalVariable(*TheModule, Ty, false, 
+                              GlobalValue::ExternalLinkage, 
+                              Constant::getNullValue(Ty), Name);
+  }
+  if (GV->getType()->getElementType() != Ty) {
+    Error("global name is already used by a global of another kind");
+    return 0;
+  }
+  return GV;
+}
+
+Value *GlobalScalarsAST::Codegen() {
+  for (unsigned i = 0, e = Globals.size(); i != e; ++i) {
+    GlobalVariable *GV = GetSessionGlobal(Globals[i].first, DoubleType);
+    if (GV == 0) return 0;
+
+    Value *InitVal = Globals[i].second->Codegen();
+    if (InitVal == 0) return 0;
+    if (InitVal->getType() != DoubleType)
+      return ErrorV("global constants must be numbers");
+    Builder.CreateStore(InitVal, GV);
+  }
+  return ConstantFP::get(getGlobalContext(), APFloat(0.0));
+}
+
+Value *GlobalVectorAST::Codegen() {
+  GlobalVariable *GV = GetSessionGlobal(Name, DVecType);
+  if (GV == 0) return 0;
+
+  Value *LengthValFP = Length->Codegen();
+  if (LengthValFP == 0) return 0;
+
+  // Drop the vector of an earlier declaration, if any.
+  Builder.CreateCall(TheModule->getFunction("vector_free"), GV);
+  Builder.CreateCall2(TheModule->getFunction("vector_malloc"), GV, LengthValFP);
+  return ConstantFP::get(getGlobalContext(), APFloat(0.0));
+}
+
+/// getType - The type of the variable in scope, or if there is none yet, 
+/// as when parsing a top-level expression, what its declaration says.
+Type *VariableExprAST::getType() const {
+  if (Value *V = LookupVariable(Name))
+    return cast<PointerType>(V->getType())->getElementType();
+  return isVector() ? DVecType : DoubleType;
+}
+
 Value *VariableExprAST::Codegen() {
-  // Look this variable up in the function.
-  Value *V = NamedValues[Name];
+  // Look this variable up in the function, then in the session.
+  Value *V = LookupVariable(Name);
   if (V == 0) return ErrorV("Unknown variable name");
 
   // Load the value.
@@ -774,7 +1763,10 @@ Value *UnaryExprAST::Codegen() {
   if (F == 0)
     return ErrorV("Unknown unary operator");
   
-  return Builder.CreateCall(F, OperandV, "unop");
+  Value *Result = Builder.CreateCall(F, OperandV, "unop");
+  if (Operand->isTemporary(OperandV))
+    EmitVectorRelease(OperandV);
+  return Result;
 }
 
 Value *BinaryExprAST::Codegen() {
@@ -784,18 +1776,31 @@ Value *BinaryExprAST::Codegen() {
     VariableExprAST *LHSE = dynamic_cast<VariableExprAST*>(LHS);
     if (!LHSE)
       return ErrorV("destination of '=' must be a variable");
-    // Codegen the RHS.
-    Value *Val = RHS->Codegen();
+    // Codegen the RHS.  A vector variable keeps its own reference to the
+    // value it is assigned.
+    Value *Val = CodegenOwned(RHS);
     if (Val == 0) return 0;
 
     // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
+    Value *Variable = LookupVariable(LHSE->getName());
     if (Variable == 0) return ErrorV("Unknown variable name");
 
+    if (HoldsVectors(Val->getType())) {
+      Value *OldVal = Builder.CreateLoad(Variable, LHSE->getName().c_str());
+      Builder.CreateStore(Val, Variable);
+      EmitVectorRelease(OldVal);
+      return Val;
+    }
+
     Builder.CreateStore(Val, Variable);
     return Val;
   }
   
+  std::vector<ExprAST*> Operands;
+  Operands.push_back(LHS);
+  Operands.push_back(RHS);
+  FuseSiblingMaps(Operands, 0);
+
   Value *L = LHS->Codegen();
   Value *R = RHS->Codegen();
   if (L == 0 || R == 0) return 0;
@@ -824,128 +1829,2836 @@ Value *BinaryExprAST::Codegen() {
   assert(F && "binary operator not found!");
   
   Value *Ops[] = { L, R };
-  return Builder.CreateCall(F, Ops, "binop");
-}
+  Value *Result = Builder.CreateCall(F, Ops, "binop");
 
-Value *CallExprAST::Codegen() {
-  // Look up the name in the global module table.
-  Function *CalleeF = TheModule->getFunction(Callee);
-  
-  if (CalleeF == 0)
-    return ErrorV("Unknown function referenced");
-  
-  // If argument mismatch error.
-  if (CalleeF->arg_size() != Args.size())
-    return ErrorV("Incorrect # arguments passed");
+  // The operator only borrowed its operands.
+  if (LHS->isTemporary(L))
+    EmitVectorRelease(L);
+  if (RHS->isTemporary(R))
+    EmitVectorRelease(R);
+  return Result;
+}
 
+/// codegenAffine - Emit the first element, the difference between
+/// consecutive elements and the (integer) length of the generated vector.
+bool GeneratorExprAST::codegenAffine(Value *&Start, Value *&Step, 
+                                     Value *&Length) {
   std::vector<Value*> ArgsV;
   for (unsigned i = 0, e = Args.size(); i != e; ++i) {
     ArgsV.push_back(Args[i]->Codegen());
-    if (ArgsV.back() == 0) return 0;
+    if (ArgsV.back() == 0) return false;
+    if (ArgsV.back()->getType() != DoubleType) {
+      ErrorV("generator arguments must be numbers");
+      return false;
+    }
+  }
+
+  Value *Zero = ConstantFP::get(getGlobalContext(), APFloat(0.0));
+  Value *One = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+  Value *N = ArgsV.back();
+  if (Kind == "iota") {
+    Start = Zero;
+    Step = One;
+  }
+  else if (Kind == "fill") {
+    Start = ArgsV[0];
+    Step = Zero;
+  }
+  else { // linspace, from a to b inclusive
+    Start = ArgsV[0];
+    Value *Span = Builder.CreateFSub(ArgsV[1], ArgsV[0], "span");
+    Step = Builder.CreateFDiv(Span, Builder.CreateFSub(N, One), "step");
+    Value *Many = Builder.CreateFCmpUGT(N, One, "many");
+    Step = Builder.CreateSelect(Many, Step, Zero);
+  }
+  Length = Builder.CreateFPToSI(N, Type::getInt32Ty(getGlobalContext()), 
+                                "length");
+  return true;
+}
+
+Value *GeneratorExprAST::Codegen() {
+  Value *Start, *Step, *Length;
+  if (!codegenAffine(Start, Step, Length))
+    return 0;
+
+  // Stored in a planned slot buffer like a map result.
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  unsigned Slot = TempSlots.acquire(TheFunction);
+  AllocaInst *RetVal = CreateEntryBlockAlloca(TheFunction, "generated", true);
+
+  Value *ArgsV[] = { RetVal, TempSlots.getSlot(Slot), Start, Step, Length };
+  Builder.CreateCall(TheModule->getFunction("vector_generate"), ArgsV);
+
+  Value *DVec = Builder.CreateLoad(RetVal, "generated");
+  TempSlots.assign(DVec, Slot);
+  return DVec;
+}
+
+Value *TupleExprAST::Codegen() {
+  std::vector<Value*> Vals;
+  for (unsigned i = 0, e = Elts.size(); i != e; ++i) {
+    Value *V = Elts[i]->Codegen();
+    if (V == 0) return 0;
+    if (V->getType() != DoubleType && V->getType() != DVecType)
+      return ErrorV("tuple elements must be numbers or vectors");
+    if (!Vals.empty() && V->getType() != Vals[0]->getType())
+      return ErrorV("tuple elements must all be numbers or all vectors");
+    Vals.push_back(V);
+  }
+
+  Value *Tuple = UndefValue::get(ArrayType::get(Vals[0]->getType(), 
+                                                Vals.size()));
+  for (unsigned i = 0, e = Vals.size(); i != e; ++i) {
+    // A tuple of vectors holds a reference to each, taking over those of
+    // temporaries.  Their slots are not planned any more; the runtime only
+    // recycles a buffer nobody else references.
+    if (Vals[i]->getType() == DVecType) {
+      if (Elts[i]->isTemporary(Vals[i]))
+        TempSlots.release(Vals[i]);
+      else
+        EmitVectorRetain(Vals[i]);
+    }
+    Tuple = Builder.CreateInsertValue(Tuple, Vals[i], std::vector<unsigned>(1, i), 
+                                      "tuple");
+  }
+  return Tuple;
+}
+
+Value *ElementExprAST::Codegen() {
+  Value *TupleV = Tuple->Codegen();
+  if (TupleV == 0) return 0;
+
+  ArrayType *AT = dyn_cast<ArrayType>(TupleV->getType());
+  if (AT == 0)
+    return ErrorV("indexed value is not a tuple");
+  if (Index >= AT->getNumElements())
+    return ErrorV("tuple index out of range");
+
+  Value *V = Builder.CreateExtractValue(TupleV, std::vector<unsigned>(1, Index),
+                                        "elt");
+
+  // The element of a temporary tuple of vectors takes over its reference,
+  // the other elements die here.
+  Owned = Tuple->isTemporary(TupleV);
+  if (Owned) {
+    for (unsigned i = 0, e = AT->getNumElements(); i != e; ++i)
+      if (i != Index)
+        EmitVectorRelease(Builder.CreateExtractValue(TupleV, 
+                                                     std::vector<unsigned>(1, i)));
+    TempSlots.extract(TupleV, Index, V);
+  }
+  return V;
+}
+
+/// EmitQueuedCall - Emit the call of F, one of QueuedExterns, with ArgsV as
+/// a host call queued until its vectors are needed, see QueueHostCall.  A
+/// function made for the call site takes a copy of the arguments and makes
+/// the call; it is compiled here, so the host threads running it never 
+/// compile lazily.  The value of the call is 0.
+static Value *EmitQueuedCall(Function *F, const std::vector<Value*> &ArgsV) {
+  LLVMContext &Context = getGlobalContext();
+  Type *Int32Ty = IntegerType::getInt32Ty(Context);
+  Type *CharPtrTy = PointerType::getUnqual(Type::getInt8Ty(Context));
+  Type *IntPtrTy = Type::getIntNTy(Context, sizeof(void*)*8);
+
+  std::vector<Type*> Fields;
+  for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+    Fields.push_back(ArgsV[i]->getType());
+  StructType *EnvTy = StructType::get(Context, Fields);
+
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Context), 
+                                       std::vector<Type*>(1, CharPtrTy), false);
+  Function *T = Function::Create(FT, Function::InternalLinkage, "hostcall", 
+                                 TheModule);
+  IRBuilderBase::InsertPoint IP = Builder.saveIP();
+  Builder.SetInsertPoint(BasicBlock::Create(Context, "entry", T));
+  Value *Env = Builder.CreateBitCast(T->arg_begin(), 
+                                     PointerType::getUnqual(EnvTy));
+  std::vector<Value*> CallArgs;
+  for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+    CallArgs.push_back(Builder.CreateLoad(Builder.CreateConstGEP2_32(Env, 0, i,
+                                                                     "arg")));
+  Builder.CreateCall(F, CallArgs);
+  Builder.CreateRetVoid();
+  verifyFunction(*T);
+  Builder.restoreIP(IP);
+  void *Run = TheExecutionEngine->getPointerToFunction(T);
+
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  AllocaInst *EnvV = CreateEntryBlockAlloca(TheFunction, "env", EnvTy);
+  std::vector<Value*> Outputs;
+  for (unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+    Builder.CreateStore(ArgsV[i], Builder.CreateConstGEP2_32(EnvV, 0, i, "arg"));
+    if (ArgsV[i]->getType() == DVecType)
+      Outputs.push_back(Builder.CreateExtractValue(ArgsV[i], 
+                                                   std::vector<unsigned>(1, 0),
+                                                   "extr_ptr"));
+  }
+  AllocaInst *OutputsV = CreateEntryBlockArray(TheFunction, 
+                                               PointerType::getUnqual(DoubleType),
+                                               Outputs.size());
+  for (unsigned i = 0, e = Outputs.size(); i != e; ++i)
+    Builder.CreateStore(Outputs[i], Builder.CreateConstGEP1_32(OutputsV, i));
+
+  Value *QueueArgs[] = { 
+    ConstantExpr::getIntToPtr(ConstantInt::get(IntPtrTy, 
+                                               (uint64_t)(intptr_t)Run),
+                              CharPtrTy),
+    Builder.CreateBitCast(EnvV, CharPtrTy),
+    ConstantExpr::getTruncOrBitCast(ConstantExpr::getSizeOf(EnvTy), Int32Ty),
+    OutputsV, 
+    ConstantInt::get(Int32Ty, Outputs.size()) 
+  };
+  Builder.CreateCall(TheModule->getFunction("vector_queue_call"), QueueArgs);
+  return ConstantFP::get(Context, APFloat(0.0));
+}
+
+Value *CallExprAST::Codegen() {
+  // Look up the name in the global module table.
+  Function *CalleeF = TheModule->getFunction(Callee);
+  
+  if (CalleeF == 0)
+    return ErrorV("Unknown function referenced");
+  
+  // If argument mismatch error.
+  if (CalleeF->arg_size() != Args.size())
+    return ErrorV("Incorrect # arguments passed");
+
+  std::vector<Value*> ArgsV;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    FuseSiblingMaps(Args, i);
+    ArgsV.push_back(Args[i]->Codegen());
+    if (ArgsV.back() == 0) return 0;
+  }
+
+  // Externs access the elements of their vector arguments, which pending
+  // maps may still be reading or writing.
+  if (AsyncMaps && CalleeF->empty())
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+      if (ArgsV[i]->getType() == DVecType) {
+        std::vector<unsigned> a0; a0.push_back(0);
+        Value *ptr = Builder.CreateExtractValue(ArgsV[i], a0, "extr_ptr");
+        Builder.CreateCall(TheModule->getFunction("vector_sync"), ptr);
+      }
+  
+  // Independent calls of the externs in QueuedExterns run together on the
+  // host threads, unless -reproducible keeps them in program order.
+  Value *Result;
+  if (AsyncMaps && !Reproducible && IsQueuedExtern(CalleeF))
+    Result = EmitQueuedCall(CalleeF, ArgsV);
+  else
+    Result = Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+
+  if (MayWriteVectorArgs(CalleeF))
+    for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+      if (ArgsV[i]->getType() == DVecType)
+        EmitVectorTouch(ArgsV[i]);
+
+  // Arguments are only borrowed by the callee, so temporaries die here.
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (Args[i]->isTemporary(ArgsV[i]))
+      EmitVectorRelease(ArgsV[i]);
+  return Result;
+}
+
+/// NumMapResults - The number of result vectors mapping F produces: one per
+/// element if it returns a tuple.
+unsigned NumMapResults(Function *F) {
+  if (ArrayType *AT = dyn_cast<ArrayType>(F->getReturnType()))
+    return AT->getNumElements();
+  return 1;
+}
+
+/// EmitMapInputs - Emit Inputs, the distinct inputs of a map, and append
+/// what is passed for each to Values: a vector, or the start, step and
+/// length of a generated one.  Generated records which inputs are 
+/// generated, and the inputs that are temporary vectors are added to 
+/// Temporaries, to be released once the map has run.
+static bool EmitMapInputs(const std::vector<ExprAST*> &Inputs,
+                          std::vector<Value*> &Values,
+                          std::vector<bool> &Generated,
+                          std::vector<Value*> &Temporaries) {
+  for (unsigned i = 0, e = Inputs.size(); i != e; ++i) {
+    // Generated inputs are passed by their description.
+    if (GeneratorExprAST *G = dynamic_cast<GeneratorExprAST*>(Inputs[i])) {
+      Value *Start, *Step, *Length;
+      if (!G->codegenAffine(Start, Step, Length)) return false;
+      Values.push_back(Start);
+      Values.push_back(Step);
+      Values.push_back(Length);
+      Generated.push_back(true);
+      continue;
+    }
+
+    FuseSiblingMaps(Inputs, i);
+    Value *argi = Inputs[i]->Codegen();
+    if (argi == 0) return false;
+    if (Inputs[i]->isTemporary(argi))
+      Temporaries.push_back(argi);
+    Values.push_back(argi);
+    Generated.push_back(false);
+  }
+  return true;
+}
+
+/// GetPlanConstant - The address of Plan, a plan prepared when a call site
+/// was compiled, as a constant of the generated code.
+static Constant *GetPlanConstant(void *Plan) {
+  LLVMContext &Context = getGlobalContext();
+  Type *CharPtrTy = PointerType::getUnqual(Type::getInt8Ty(Context));
+  Type *IntPtrTy = Type::getIntNTy(Context, sizeof(void*)*8);
+  return ConstantExpr::getIntToPtr(ConstantInt::get(IntPtrTy, 
+                                                    (uint64_t)(intptr_t)Plan),
+                                   CharPtrTy);
+}
+
+/// EmitMapDispatch - Emit the call of a map call site, whose plan (see 
+/// MapPlan) was prepared when it was compiled.  The call goes to a 
+/// trampoline made for the call site, which takes the Values of the inputs
+/// (see EmitMapInputs) in registers, the array to return the results in 
+/// (RetVals, of any pointer type Runtime takes) and the slot of each result,
+/// and passes them to the runtime function Runtime with the plan as a 
+/// constant.
+static void EmitMapDispatch(const char *Runtime, void *Plan, 
+                            const std::vector<bool> &Generated,
+                            const std::vector<Value*> &Values,
+                            Value *RetVals, 
+                            const std::vector<Value*> &SlotPtrs) {
+  LLVMContext &Context = getGlobalContext();
+  Type *Int32Ty = IntegerType::getInt32Ty(Context);
+  Type *CharPtrTy = PointerType::getUnqual(Type::getInt8Ty(Context));
+
+  std::vector<Type*> Params;
+  for (unsigned i = 0, e = Generated.size(); i != e; ++i) {
+    if (Generated[i]) {
+      Params.push_back(DoubleType);
+      Params.push_back(DoubleType);
+      Params.push_back(Int32Ty);
+    } else
+      Params.push_back(DVecType);
+  }
+  Params.push_back(RetVals->getType());
+  Params.insert(Params.end(), SlotPtrs.size(), DVecPtrType);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(Context), Params, false);
+  Function *T = Function::Create(FT, Function::InternalLinkage, "mapsite", 
+                                 TheModule);
+
+  IRBuilderBase::InsertPoint IP = Builder.saveIP();
+  Builder.SetInsertPoint(BasicBlock::Create(Context, "entry", T));
+
+  // Allocate an array to hold the inputs.
+  Value *NumInputs = ConstantInt::get(Int32Ty, Generated.size());
+  AllocaInst *argsvect = Builder.CreateAlloca(MapArgType, NumInputs);
+
+  std::vector<unsigned> a0; a0.push_back(0);
+  std::vector<unsigned> a1; a1.push_back(1);
+  std::vector<unsigned> a2; a2.push_back(2);
+  std::vector<unsigned> a3; a3.push_back(3);
+  std::vector<unsigned> a4; a4.push_back(4);
+
+  Function::arg_iterator AI = T->arg_begin();
+  Value *Zero = ConstantFP::get(Context, APFloat(0.0));
+  for (unsigned i = 0, e = Generated.size(); i != e; ++i) {
+    Value *Arg = UndefValue::get(MapArgType);
+    Arg = Builder.CreateInsertValue(Arg, ConstantInt::get(Int32Ty, Generated[i]),
+                                    a2);
+    if (Generated[i]) {
+      Value *Start = AI++;
+      Value *Step = AI++;
+      Arg = Builder.CreateInsertValue(Arg, 
+              Constant::getNullValue(PointerType::get(DoubleType, 0)), a0);
+      Arg = Builder.CreateInsertValue(Arg, AI++, a1);
+      Arg = Builder.CreateInsertValue(Arg, Start, a3);
+      Arg = Builder.CreateInsertValue(Arg, Step, a4);
+    } else {
+      Value *argi = AI++;
+      Arg = Builder.CreateInsertValue(Arg, 
+              Builder.CreateExtractValue(argi, a0, "extr_ptr"), a0);
+      Arg = Builder.CreateInsertValue(Arg, 
+              Builder.CreateExtractValue(argi, a1, "extr_len"), a1);
+      Arg = Builder.CreateInsertValue(Arg, Zero, a3);
+      Arg = Builder.CreateInsertValue(Arg, Zero, a4);
+    }
+    Builder.CreateStore(Arg, Builder.CreateConstGEP1_32(argsvect, i));
+  }
+  Value *Results = AI++;
+  AllocaInst *Slots = 
+    Builder.CreateAlloca(DVecPtrType, ConstantInt::get(Int32Ty, SlotPtrs.size()));
+  for (unsigned r = 0, e = SlotPtrs.size(); r != e; ++r)
+    Builder.CreateStore(AI++, Builder.CreateConstGEP1_32(Slots, r));
+
+  Value *ArgsV[] = { GetPlanConstant(Plan), NumInputs, argsvect, Results, 
+                     Slots };
+  Builder.CreateCall(TheModule->getFunction(Runtime), ArgsV);
+  Builder.CreateRetVoid();
+  verifyFunction(*T);
+  Builder.restoreIP(IP);
+
+  std::vector<Value*> CallArgs(Values);
+  CallArgs.push_back(RetVals);
+  CallArgs.insert(CallArgs.end(), SlotPtrs.begin(), SlotPtrs.end());
+  Builder.CreateCall(T, CallArgs);
+}
+
+/// EmitMapGroup - Emit one map call site that maps each function of Group
+/// over its arguments, and return the result of each in Results, a tuple of
+/// vectors for functions that return tuples.  Arguments that name the same
+/// variable are passed (and copied to the device) once.
+static bool EmitMapGroup(const std::vector<MapExprAST*> &Group,
+                         std::vector<Value*> &Results) {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+  // Number the distinct inputs and record which one each argument reads.
+  std::vector<ExprAST*> Inputs;
+  std::map<std::string, unsigned> InputOf;
+  std::vector<int> ArgMap;
+  std::vector<Function*> Callees;
+  std::vector<std::string> Names;
+  unsigned NumResults = 0;
+  for (unsigned f = 0, e = Group.size(); f != e; ++f) {
+    Function *CalleeF = GetMapCallee(Group[f]->getCallee());
+    if (CalleeF == 0)
+      return false;
+    Callees.push_back(CalleeF);
+    Names.push_back(Group[f]->getCallee());
+    NumResults += NumMapResults(CalleeF);
+    const std::vector<ExprAST*> &Args = Group[f]->getArgs();
+    if (CalleeF->arg_size() != Args.size()) {
+      ErrorV("Incorrect # arguments passed");
+      return false;
+    }
+    for (unsigned i = 0, ie = Args.size(); i != ie; ++i) {
+      VariableExprAST *V = dynamic_cast<VariableExprAST*>(Args[i]);
+      if (V && InputOf.count(V->getName())) {
+        ArgMap.push_back(InputOf[V->getName()]);
+        continue;
+      }
+      if (V)
+        InputOf[V->getName()] = Inputs.size();
+      ArgMap.push_back(Inputs.size());
+      Inputs.push_back(Args[i]);
+    }
+  }
+
+  std::vector<Value*> Values, Temporaries;
+  std::vector<bool> Generated;
+  if (!EmitMapInputs(Inputs, Values, Generated, Temporaries))
+    return false;
+
+  // For each result an element to return it in and the slot buffer to 
+  // store it in, see TempSlotPlanner.
+  AllocaInst *RetVals = CreateEntryBlockArray(TheFunction, DVecType, NumResults);
+  std::vector<unsigned> Slots;
+  std::vector<Value*> SlotPtrs;
+  for (unsigned r = 0; r != NumResults; ++r) {
+    Slots.push_back(TempSlots.acquire(TheFunction));
+    SlotPtrs.push_back(TempSlots.getSlot(Slots.back()));
+  }
+
+  EmitMapDispatch("vector_map_planned", 
+                  PrepareMapPlan(Names, ArgMap, Generated),
+                  Generated, Values, RetVals, SlotPtrs);
+
+  // The inputs are dead once the map has consumed them.
+  for (unsigned i = 0, e = Temporaries.size(); i != e; ++i)
+    EmitVectorRelease(Temporaries[i]);
+
+  // return values are available in RetVals.
+  unsigned r = 0;
+  for (unsigned f = 0, e = Group.size(); f != e; ++f) {
+    if (!Callees[f]->getReturnType()->isArrayTy()) {
+      Value *DVec = Builder.CreateLoad(Builder.CreateConstGEP1_32(RetVals, r),
+                                       "result");
+      TempSlots.assign(DVec, Slots[r++]);
+      Results.push_back(DVec);
+      continue;
+    }
+
+    unsigned K = NumMapResults(Callees[f]);
+    Value *Tuple = UndefValue::get(ArrayType::get(DVecType, K));
+    for (unsigned k = 0; k != K; ++k) {
+      Value *DVec = Builder.CreateLoad(Builder.CreateConstGEP1_32(RetVals, r + k),
+                                       "result");
+      Tuple = Builder.CreateInsertValue(Tuple, DVec, std::vector<unsigned>(1, k),
+                                        "results");
+    }
+    for (unsigned k = 0; k != K; ++k)
+      TempSlots.assign(Tuple, Slots[r++]);
+    Results.push_back(Tuple);
+  }
+  return true;
+}
+
+/// isFusable - A map can be fused with its siblings if it has not been
+/// computed yet and only reads variables and generated vectors with
+/// constant or variable arguments, so evaluating its arguments early changes
+/// nothing.
+bool MapExprAST::isFusable() const {
+  if (Hoisted || Fused)
+    return false;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    if (dynamic_cast<VariableExprAST*>(Args[i]))
+      continue;
+    GeneratorExprAST *G = dynamic_cast<GeneratorExprAST*>(Args[i]);
+    if (!G)
+      return false;
+    const std::vector<ExprAST*> &GArgs = G->getArgs();
+    for (unsigned j = 0, je = GArgs.size(); j != je; ++j)
+      if (!dynamic_cast<NumberExprAST*>(GArgs[j]) && 
+          !dynamic_cast<VariableExprAST*>(GArgs[j]))
+        return false;
+  }
+  return true;
+}
+
+/// FuseSiblingMaps - Called before Args[i] of a call, operator or map is
+/// emitted.  If Args[i] starts a run of fusable maps that each read a
+/// variable an earlier one in the run reads, the run is emitted as one map
+/// with several results, so the shared inputs are copied to the device once
+/// and a single kernel is launched.  Each map then just hands out its result.
+static void FuseSiblingMaps(const std::vector<ExprAST*> &Args, unsigned i) {
+  std::vector<MapExprAST*> Group;
+  std::set<std::string> Read;
+  for (unsigned j = i, e = Args.size(); j != e; ++j) {
+    MapExprAST *M = dynamic_cast<MapExprAST*>(Args[j]);
+    if (!M || !M->isFusable())
+      break;
+
+    // Only vectors in memory are worth sharing.
+    const std::vector<ExprAST*> &MArgs = M->getArgs();
+    std::vector<std::string> MRead;
+    for (unsigned k = 0, ke = MArgs.size(); k != ke; ++k)
+      if (VariableExprAST *V = dynamic_cast<VariableExprAST*>(MArgs[k]))
+        MRead.push_back(V->getName());
+
+    bool Shares = false;
+    for (unsigned k = 0, ke = MRead.size(); k != ke; ++k)
+      Shares |= Read.count(MRead[k]) != 0;
+    if (!Group.empty() && !Shares)
+      break;
+
+    Group.push_back(M);
+    Read.insert(MRead.begin(), MRead.end());
+  }
+  if (Group.size() < 2)
+    return;
+
+  std::vector<Value*> Results;
+  if (!EmitMapGroup(Group, Results))
+    return;
+  for (unsigned f = 0, e = Group.size(); f != e; ++f)
+    Group[f]->setFused(Results[f]);
+}
+
+/// getChainLink - If this map maps a function returning a double over the
+/// result of another such map, which has not been computed yet, return the
+/// argument holding that map, otherwise -1.  The other arguments have to be
+/// variables or generated vectors, so running the inner map after them 
+/// changes nothing.  The two maps then form a chain, see EmitMapChain.
+int MapExprAST::getChainLink() const {
+  Function *CalleeF = TheModule->getFunction(Callee);
+  if (Hoisted || Fused || !CalleeF || !CalleeF->getReturnType()->isDoubleTy())
+    return -1;
+  int Link = -1;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    MapExprAST *M = dynamic_cast<MapExprAST*>(Args[i]);
+    if (M && Link < 0 && !M->Hoisted && !M->Fused) {
+      Function *F = TheModule->getFunction(M->Callee);
+      if (F && F->getReturnType()->isDoubleTy()) {
+        Link = i;
+        continue;
+      }
+    }
+    if (!dynamic_cast<VariableExprAST*>(Args[i]) &&
+        !dynamic_cast<GeneratorExprAST*>(Args[i]))
+      return -1;
+  }
+  return Link;
+}
+
+/// EmitMapChain - Emit one map chain call site for Outer and the maps 
+/// whose results it maps over, directly or through another map of the 
+/// chain, and return the result of Outer.  The inner maps are its stages,
+/// innermost first, whose results never leave the device.
+static Value *EmitMapChain(MapExprAST *Outer) {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+  std::vector<MapExprAST*> Stages;
+  std::vector<int> Links;
+  for (MapExprAST *M = Outer; M; ) {
+    int Link = M->getChainLink();
+    Stages.insert(Stages.begin(), M);
+    Links.insert(Links.begin(), Link);
+    M = Link < 0 ? 0 : static_cast<MapExprAST*>(M->getArgs()[Link]);
+  }
+
+  // Number the distinct inputs and record which one each argument of each
+  // stage reads, -1 for the result of the previous stage.
+  std::vector<ExprAST*> Inputs;
+  std::map<std::string, unsigned> InputOf;
+  std::vector<int> ArgMap;
+  std::vector<std::string> Names;
+  for (unsigned s = 0, e = Stages.size(); s != e; ++s) {
+    Function *CalleeF = GetMapCallee(Stages[s]->getCallee());
+    if (CalleeF == 0)
+      return 0;
+    Names.push_back(Stages[s]->getCallee());
+    const std::vector<ExprAST*> &Args = Stages[s]->getArgs();
+    if (CalleeF->arg_size() != Args.size()) {
+      ErrorV("Incorrect # arguments passed");
+      return 0;
+    }
+    for (unsigned i = 0, ie = Args.size(); i != ie; ++i) {
+      if ((int)i == Links[s]) {
+        ArgMap.push_back(-1);
+        continue;
+      }
+      VariableExprAST *V = dynamic_cast<VariableExprAST*>(Args[i]);
+      if (V && InputOf.count(V->getName())) {
+        ArgMap.push_back(InputOf[V->getName()]);
+        continue;
+      }
+      if (V)
+        InputOf[V->getName()] = Inputs.size();
+      ArgMap.push_back(Inputs.size());
+      Inputs.push_back(Args[i]);
+    }
+  }
+
+  std::vector<Value*> Values, Temporaries;
+  std::vector<bool> Generated;
+  if (!EmitMapInputs(Inputs, Values, Generated, Temporaries))
+    return 0;
+
+  AllocaInst *RetVal = CreateEntryBlockAlloca(TheFunction, "result", true);
+  unsigned Slot = TempSlots.acquire(TheFunction);
+  EmitMapDispatch("vector_map_chain", 
+                  PrepareMapChainPlan(Names, ArgMap, Generated),
+                  Generated, Values, RetVal, 
+                  std::vector<Value*>(1, TempSlots.getSlot(Slot)));
+
+  for (unsigned i = 0, e = Temporaries.size(); i != e; ++i)
+    EmitVectorRelease(Temporaries[i]);
+
+  Value *DVec = Builder.CreateLoad(RetVal, "result");
+  TempSlots.assign(DVec, Slot);
+  return DVec;
+}
+
+/// MatchScaled - Return true if V is a * x for a constant a and argument x,
+/// setting A and X to them.
+static bool MatchScaled(Value *V, double &A, int &X) {
+  BinaryOperator *B = dyn_cast<BinaryOperator>(V);
+  if (B == 0 || B->getOpcode() != Instruction::FMul)
+    return false;
+  for (unsigned k = 0; k < 2; k++) {
+    ConstantFP *C = dyn_cast<ConstantFP>(B->getOperand(k));
+    Argument *Arg = dyn_cast<Argument>(B->getOperand(1 - k));
+    if (C && Arg) {
+      A = C->getValueAPF().convertToDouble();
+      X = Arg->getArgNo();
+      return true;
+    }
+  }
+  return false;
+}
+
+/// MatchAxpy - Return true if F only returns a * x + y or a * x for its 
+/// arguments x and y and a constant a, setting A and the argument numbers
+/// X and Y, which is -1 for a * x.
+static bool MatchAxpy(Function *F, double &A, int &X, int &Y) {
+  if (F->size() != 1 || !F->doesNotAccessMemory())
+    return false;
+  ReturnInst *R = dyn_cast<ReturnInst>(F->getEntryBlock().getTerminator());
+  if (R == 0 || R->getReturnValue() == 0 || 
+      !R->getReturnValue()->getType()->isDoubleTy())
+    return false;
+
+  Value *V = R->getReturnValue();
+  Y = -1;
+  BinaryOperator *B = dyn_cast<BinaryOperator>(V);
+  if (B && B->getOpcode() == Instruction::FAdd) {
+    for (unsigned k = 0; k < 2 && Y < 0; k++) {
+      Argument *Arg = dyn_cast<Argument>(B->getOperand(1 - k));
+      if (Arg && MatchScaled(B->getOperand(k), A, X))
+        Y = Arg->getArgNo();
+    }
+    return Y >= 0 && X != Y && F->arg_size() == 2;
+  }
+  return MatchScaled(V, A, X) && F->arg_size() == 1;
+}
+
+/// EmitBlasMap - If M maps a function computing a * x + y or a * x over 
+/// vector variables, emit it as axpy or scal of the vector library instead,
+/// which beats copying the vectors to the device and back, set V to the 
+/// result and return true.
+static bool EmitBlasMap(MapExprAST *M, Value *&V) {
+  Function *CalleeF = TheModule->getFunction(M->getCallee());
+  const std::vector<ExprAST*> &Args = M->getArgs();
+  double A;
+  int X, Y;
+  if (CalleeF == 0 || CalleeF->arg_size() != Args.size() || 
+      !MatchAxpy(CalleeF, A, X, Y))
+    return false;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (!dynamic_cast<VariableExprAST*>(Args[i]))
+      return false;
+
+  NumberExprAST AV(A);
+  std::vector<ExprAST*> BArgs;
+  BArgs.push_back(&AV);
+  BArgs.push_back(Args[X]);
+  if (Y >= 0)
+    BArgs.push_back(Args[Y]);
+  BuiltinExprAST B(FindBuiltin(Y >= 0 ? "axpy" : "scal"), BArgs);
+  V = B.Codegen();
+  return true;
+}
+
+/// getType - A vector, or a tuple of vectors for a function returning a 
+/// tuple, see NumMapResults.
+Type *MapExprAST::getType() const {
+  Function *CalleeF = TheModule->getFunction(Callee);
+  if (CalleeF && CalleeF->getReturnType()->isArrayTy())
+    return ArrayType::get(DVecType, NumMapResults(CalleeF));
+  return DVecType;
+}
+
+Value *MapExprAST::Codegen() {
+  if (Hoisted)
+    return Hoisted;
+  if (Fused) {
+    Value *V = Fused;
+    Fused = 0;
+    return V;
+  }
+  Value *Blas;
+  if (EmitBlasMap(this, Blas))
+    return Blas;
+  if (TileMapChains && getChainLink() >= 0)
+    return EmitMapChain(this);
+
+  std::vector<MapExprAST*> Group(1, this);
+  std::vector<Value*> Results;
+  if (!EmitMapGroup(Group, Results))
+    return 0;
+  return Results[0];
+}
+
+Value *MapBatchExprAST::Codegen() {
+  Type *Int32Ty = IntegerType::getInt32Ty(getGlobalContext());
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+  Function *CalleeF = GetMapCallee(Callee);
+  if (CalleeF == 0)
+    return 0;
+  if (CalleeF->arg_size() != Args.size())
+    return ErrorV("Incorrect # arguments passed");
+  if (!CalleeF->getReturnType()->isDoubleTy())
+    return ErrorV("mapbatch needs a function returning a number");
+
+  // Each argument is a tuple of K vectors, one per batch.
+  std::vector<Value*> ArgsV;
+  unsigned K = 0;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    Value *V = Args[i]->Codegen();
+    if (V == 0) return 0;
+    ArrayType *AT = dyn_cast<ArrayType>(V->getType());
+    if (AT == 0 || AT->getElementType() != DVecType)
+      return ErrorV("mapbatch arguments must be tuples of vectors");
+    if (i > 0 && AT->getNumElements() != K)
+      return ErrorV("mapbatch arguments must have the same number of vectors");
+    K = AT->getNumElements();
+    ArgsV.push_back(V);
+  }
+
+  // The vectors go argument by argument, then batch by batch.
+  AllocaInst *Vecs = 
+    CreateEntryBlockArray(TheFunction, DVecType, ArgsV.size() * K);
+  for (unsigned i = 0, e = ArgsV.size(); i != e; ++i)
+    for (unsigned k = 0; k != K; ++k)
+      Builder.CreateStore(Builder.CreateExtractValue(ArgsV[i], 
+                                                     std::vector<unsigned>(1, k)),
+                          Builder.CreateConstGEP1_32(Vecs, i * K + k));
+
+  Value *NumBatches = ConstantInt::get(Int32Ty, K);
+  AllocaInst *RetVals = CreateEntryBlockArray(TheFunction, DVecType, K);
+  AllocaInst *SlotPtrs = CreateEntryBlockArray(TheFunction, DVecPtrType, K);
+  std::vector<unsigned> Slots;
+  for (unsigned k = 0; k != K; ++k) {
+    Slots.push_back(TempSlots.acquire(TheFunction));
+    Builder.CreateStore(TempSlots.getSlot(Slots.back()), 
+                        Builder.CreateConstGEP1_32(SlotPtrs, k));
+  }
+
+  std::vector<std::string> Names(1, Callee);
+  std::vector<int> ArgMap;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    ArgMap.push_back(i);
+  // The packed vectors are new on every call, so there is nothing to reuse
+  // by memoizing.
+  void *Plan = PrepareMapPlan(Names, ArgMap, std::vector<bool>(Args.size()),
+                              false);
+
+  Value *CallArgs[] = { GetPlanConstant(Plan), 
+                        ConstantInt::get(Int32Ty, ArgsV.size()), NumBatches,
+                        Vecs, RetVals, SlotPtrs };
+  Builder.CreateCall(TheModule->getFunction("vector_map_batch"), CallArgs);
+
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    if (Args[i]->isTemporary(ArgsV[i]))
+      EmitVectorRelease(ArgsV[i]);
+
+  Value *Tuple = UndefValue::get(ArrayType::get(DVecType, K));
+  for (unsigned k = 0; k != K; ++k) {
+    Value *DVec = Builder.CreateLoad(Builder.CreateConstGEP1_32(RetVals, k),
+                                     "result");
+    Tuple = Builder.CreateInsertValue(Tuple, DVec, std::vector<unsigned>(1, k),
+                                      "results");
+  }
+  for (unsigned k = 0; k != K; ++k)
+    TempSlots.assign(Tuple, Slots[k]);
+  return Tuple;
+}
+
+Value *StatsExprAST::Codegen() {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+  // Reduce the values of a map in its kernel, unless they are computed 
+  // already.  Its distinct inputs are numbered as in EmitMapGroup.
+  std::vector<ExprAST*> Inputs;
+  std::map<std::string, unsigned> InputOf;
+  std::vector<int> ArgMap;
+  std::string Callee;
+  MapExprAST *M = dynamic_cast<MapExprAST*>(Arg);
+  Function *CalleeF = 0;
+  if (M && !M->getHoisted() && !M->getArgs().empty())
+    CalleeF = TheModule->getFunction(M->getCallee());
+  if (CalleeF && CalleeF->getReturnType()->isDoubleTy() &&
+      CalleeF->arg_size() == M->getArgs().size() && 
+      !WritesSessionGlobals(CalleeF)) {
+    Callee = M->getCallee();
+    const std::vector<ExprAST*> &Args = M->getArgs();
+    for (unsigned i = 0, ie = Args.size(); i != ie; ++i) {
+      VariableExprAST *V = dynamic_cast<VariableExprAST*>(Args[i]);
+      if (V && InputOf.count(V->getName())) {
+        ArgMap.push_back(InputOf[V->getName()]);
+        continue;
+      }
+      if (V)
+        InputOf[V->getName()] = Inputs.size();
+      ArgMap.push_back(Inputs.size());
+      Inputs.push_back(Args[i]);
+    }
+  } else
+    Inputs.push_back(Arg);
+
+  std::vector<Value*> Values, Temporaries;
+  std::vector<bool> Generated;
+  if (!EmitMapInputs(Inputs, Values, Generated, Temporaries))
+    return 0;
+  if (Callee.empty() && !Generated[0] && Values[0]->getType() != DVecType)
+    return ErrorV("stats needs a vector");
+
+  AllocaInst *RetVals = CreateEntryBlockArray(TheFunction, DoubleType, NumStats);
+  EmitMapDispatch("vector_stats", PrepareStatsPlan(Callee, ArgMap, Generated),
+                  Generated, Values, RetVals, std::vector<Value*>());
+
+  for (unsigned i = 0, e = Temporaries.size(); i != e; ++i)
+    EmitVectorRelease(Temporaries[i]);
+
+  Value *Tuple = UndefValue::get(getType());
+  for (unsigned k = 0; k != NumStats; ++k) {
+    Value *Stat = Builder.CreateLoad(Builder.CreateConstGEP1_32(RetVals, k),
+                                     "stat");
+    Tuple = Builder.CreateInsertValue(Tuple, Stat, std::vector<unsigned>(1, k),
+                                      "stats");
+  }
+  return Tuple;
+}
+
+Value *BuiltinExprAST::Codegen() {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  unsigned NumArgs = Args.size(), NumResults = strlen(Info->Results);
+  bool VectorResults = Info->Results[0] == 'v';
+
+  // Pass the arguments in an array of vectors and one of numbers.
+  AllocaInst *Vecs = CreateEntryBlockArray(TheFunction, DVecType, 3 * NumArgs);
+  AllocaInst *Nums = CreateEntryBlockArray(TheFunction, DoubleType, NumArgs);
+  std::vector<Value*> ArgsV;
+  unsigned NumVecs = 0, NumNums = 0;
+  for (unsigned i = 0; i != NumArgs; ++i) {
+    if (Info->Params[i] == 'o') {
+      VariableExprAST *Op = dynamic_cast<VariableExprAST*>(Args[i]);
+      unsigned k = 0;
+      while (Op && k != NumAggOps && Op->getName() != AggOpNames[k])
+        ++k;
+      if (!Op || k == NumAggOps)
+        return ErrorV("Expected sum, count, mean, min or max");
+      Value *V = ConstantFP::get(getGlobalContext(), APFloat((double)k));
+      ArgsV.push_back(V);
+      Builder.CreateStore(V, Builder.CreateConstGEP1_32(Nums, NumNums++));
+      continue;
+    }
+    FuseSiblingMaps(Args, i);
+    Value *V = Args[i]->Codegen();
+    if (V == 0) return 0;
+    ArgsV.push_back(V);
+    if (Info->Params[i] == 'v') {
+      if (V->getType() != DVecType)
+        return ErrorV("Built-in expects a vector argument");
+      Builder.CreateStore(V, Builder.CreateConstGEP1_32(Vecs, NumVecs++));
+    } else if (Info->Params[i] == 'm') {
+      if (V->getType() != ArrayType::get(DVecType, 3))
+        return ErrorV("Built-in expects a CSR matrix, "
+                      "tuple(offsets, columns, values)");
+      for (unsigned k = 0; k != 3; ++k)
+        Builder.CreateStore(Builder.CreateExtractValue(V, 
+                                                       std::vector<unsigned>(1, k)),
+                            Builder.CreateConstGEP1_32(Vecs, NumVecs++));
+    } else {
+      if (V->getType() != DoubleType)
+        return ErrorV("Built-in expects a number argument");
+      Builder.CreateStore(V, Builder.CreateConstGEP1_32(Nums, NumNums++));
+    }
+  }
+
+  AllocaInst *VRes = CreateEntryBlockArray(TheFunction, DVecType, NumResults);
+  AllocaInst *DRes = CreateEntryBlockArray(TheFunction, DoubleType, NumResults);
+  AllocaInst *SlotPtrs = 
+    CreateEntryBlockArray(TheFunction, DVecPtrType, NumResults);
+  std::vector<unsigned> Slots;
+  if (VectorResults)
+    for (unsigned r = 0; r != NumResults; ++r) {
+      Slots.push_back(TempSlots.acquire(TheFunction));
+      Builder.CreateStore(TempSlots.getSlot(Slots.back()), 
+                          Builder.CreateConstGEP1_32(SlotPtrs, r));
+    }
+
+  Value *CallArgs[] = { Vecs, Nums, VRes, DRes, SlotPtrs };
+  Builder.CreateCall(TheModule->getFunction(Info->Runtime), CallArgs);
+
+  for (unsigned i = 0; i != NumArgs; ++i)
+    if (Args[i]->isTemporary(ArgsV[i]))
+      EmitVectorRelease(ArgsV[i]);
+
+  AllocaInst *Res = VectorResults ? VRes : DRes;
+  if (NumResults == 1) {
+    Value *R = Builder.CreateLoad(Res, "result");
+    if (VectorResults)
+      TempSlots.assign(R, Slots[0]);
+    return R;
+  }
+  Value *Tuple = UndefValue::get(getType());
+  for (unsigned r = 0; r != NumResults; ++r) {
+    Value *R = Builder.CreateLoad(Builder.CreateConstGEP1_32(Res, r), "result");
+    Tuple = Builder.CreateInsertValue(Tuple, R, std::vector<unsigned>(1, r),
+                                      "results");
+  }
+  for (unsigned r = 0; r != Slots.size(); ++r)
+    TempSlots.assign(Tuple, Slots[r]);
+  return Tuple;
+}
+
+/// MapCacheEntry - The results of a map, see MapCache.
+struct MapCacheEntry {
+  std::vector<DVector> Results;     // each holding a reference
+  std::vector<unsigned> Versions;   // of the results, when they were cached
+  size_t Bytes;
+};
+
+/// MapCache - Results of maps of functions that do not access memory, keyed
+/// by the functions, how they take their arguments and the identity and
+/// version of each input (or start and step if it is generated).  Running
+/// the same map over unchanged inputs returns the cached vectors.  At most
+/// -memo-budget megabytes are kept, evicting the least recently used.
+static std::map<std::string, MapCacheEntry> MapCache;
+static std::list<std::string> MapCacheLRU;  // least recently used first
+static size_t MapCacheBytes = 0;
+
+template <typename T>
+static void AppendKey(std::string &Key, const T &V) {
+  Key.append((const char *)&V, sizeof(V));
+}
+
+/// MapCacheKey - The key of running kernel, whose name tells the functions
+/// it maps and how they take their arguments, on the inputs args.
+static std::string MapCacheKey(const std::string &Kernel, int nargs, 
+                               MapArg *args) {
+  std::string Key = Kernel;
+  Key += '\0';
+  for (int i = 0; i < nargs; i++) {
+    AppendKey(Key, args[i].ptr);
+    AppendKey(Key, args[i].length);
+    AppendKey(Key, args[i].generated);
+    if (!args[i].generated) {
+      if (args[i].ptr)
+        AppendKey(Key, GetVectorHeader(args[i].ptr)->version);
+    } else {
+      AppendKey(Key, args[i].start);
+      AppendKey(Key, args[i].step);
+    }
+  }
+  return Key;
+}
+
+static void EvictMapCacheEntry(std::string Key) {
+  MapCacheEntry &E = MapCache[Key];
+  for (unsigned r = 0; r < E.Results.size(); r++)
+    ReleaseVectorStorage(E.Results[r].ptr);
+  MapCacheBytes -= E.Bytes;
+  MapCache.erase(Key);
+  MapCacheLRU.remove(Key);
+}
+
+/// LookupMapCache - Copy the cached results of the map identified by Key to
+/// res, in the storage of slots, if there are any and nothing wrote to them
+/// since.  Copies, not references, so an extern writing one holder's result
+/// does not change another's.
+static bool LookupMapCache(const std::string &Key, DVector *res, 
+                           DVector **slots) {
+  std::map<std::string, MapCacheEntry>::iterator I = MapCache.find(Key);
+  if (I == MapCache.end())
+    return false;
+
+  MapCacheEntry &E = I->second;
+  for (unsigned r = 0; r < E.Results.size(); r++) {
+    if (GetVectorHeader(E.Results[r].ptr)->version != E.Versions[r]) {
+      EvictMapCacheEntry(Key);
+      return false;
+    }
+  }
+
+  for (unsigned r = 0; r < E.Results.size(); r++) {
+    const DVector &C = E.Results[r];
+    res[r].length = C.length;
+    res[r].ptr = AcquireVectorStorage(slots[r], C.length);
+    if (res[r].ptr == NULL) {
+      fprintf(stderr, "Could not allocate host memory\n");
+      return true;
+    }
+    SyncHostBuffer(C.ptr);
+    memcpy(res[r].ptr, C.ptr, C.length * sizeof(double));
+  }
+  MapCacheLRU.remove(Key);
+  MapCacheLRU.push_back(Key);
+  return true;
+}
+
+static void InsertMapCache(const std::string &Key, DVector *res, 
+                           unsigned nres) {
+  MapCacheEntry E;
+  E.Bytes = 0;
+  for (unsigned r = 0; r < nres; r++) {
+    E.Results.push_back(res[r]);
+    E.Versions.push_back(GetVectorHeader(res[r].ptr)->version);
+    E.Bytes += res[r].length * sizeof(double);
+  }
+
+  size_t Budget = (size_t)MemoBudget << 20;
+  if (E.Bytes > Budget)
+    return;
+  while (MapCacheBytes + E.Bytes > Budget)
+    EvictMapCacheEntry(MapCacheLRU.front());
+
+  for (unsigned r = 0; r < nres; r++)
+    GetVectorHeader(res[r].ptr)->refcount++;
+  MapCache[Key] = E;
+  MapCacheLRU.push_back(Key);
+  MapCacheBytes += E.Bytes;
+}
+
+/// MapPlan - How to run the maps of a call site, prepared when it is 
+/// compiled (see EmitMapDispatch): the functions, how they take their 
+/// arguments, the kernel mapping them and whether its results can be 
+/// memoized.  Its trampoline passes the plan straight to vector_map_planned,
+/// so running the maps needs no cloning of the module, looking up of 
+/// functions by name or compiling.  A launch plan with device buffers is 
+/// kept for the length last mapped over.
+struct MapPlan {
+  std::vector<std::string> Names;
+  std::vector<int> ArgMap;
+  std::vector<unsigned> Offsets;        // of the arguments of each function
+  std::vector<unsigned> ResultOffsets;  // of the results of each function
+  std::vector<bool> Generated;
+  std::string Kernel;
+  char *Ptx;
+  std::vector<double*> Constants;       // the global constants it reads
+  unsigned NumResults;
+  bool Memoize;
+  LaunchPlan *Launch;
+  int N;                                // the length Launch is planned for
+  // Kernels specialized for a length, see -specialize-lengths.
+  struct SpecializedKernel {
+    std::string Kernel;
+    char *Ptx;
+    std::vector<double*> Constants;     // the global constants it reads
+  };
+  std::map<int, SpecializedKernel> Specialized;
+  // Plans mapping each function alone, for inputs of different lengths, 
+  // and the inputs of P each of them takes, see SplitMapPlan.
+  std::vector<MapPlan*> Parts;
+  std::vector<std::vector<int> > PartInputs;
+};
+
+/// GetGlobalConstants - Append the storage of the global constants called
+/// Names (see GlobalScalarsAST) to Constants.  Kernels are passed their 
+/// values on every launch, so they see the values the globals have then.
+static void GetGlobalConstants(const std::vector<std::string> &Names,
+                               std::vector<double*> &Constants) {
+  for (unsigned i = 0; i < Names.size(); i++) {
+    GlobalVariable *GV = TheModule->getNamedGlobal(Names[i]);
+    Constants.push_back((double *)TheExecutionEngine->getPointerToGlobal(GV));
+  }
+}
+
+/// CompileMapKernel - Generate the kernel of plan P, specialized for 
+/// length FixedN unless that is 0, and return its PTX.  Kernel receives its
+/// name and Constants the global constants it reads.
+static char *CompileMapKernel(MapPlan *P, unsigned FixedN, std::string &Kernel,
+                              std::vector<std::string> &Constants) {
+  Module *M = CloneModule(TheModule);
+  std::vector<Function*> Fs;
+  std::vector<std::vector<unsigned> > FArgMap(P->Names.size());
+  for (unsigned f = 0, pos = 0; f < P->Names.size(); f++) {
+    Fs.push_back(M->getFunction(P->Names[f]));
+    for (unsigned a = 0; a < Fs[f]->arg_size(); a++)
+      FArgMap[f].push_back(P->ArgMap[pos++]);
+  }
+
+  // Generating the kernel moves the insertion point of Builder, which may 
+  // be in the middle of the function with the call site.
+  IRBuilderBase::InsertPoint IP = Builder.saveIP();
+  CreateNVVMMapKernel(M, Fs, FArgMap, P->Generated, FixedN, 
+                      FixedN && ExactGrid(FixedN), Builder, Kernel, Constants); 
+  Builder.restoreIP(IP);
+  char *Ptx = BitCodeToPtx(M);
+  delete M;
+  return Ptx;
+}
+
+/// PrepareMapPlan - Plan mapping the functions Names, whose arguments are
+/// the inputs ArgMap lists, of which Generated tells which are generated.
+/// Plans whose inputs are new on every run are not Memoizable.
+static MapPlan *PrepareMapPlan(const std::vector<std::string> &Names,
+                               const std::vector<int> &ArgMap,
+                               const std::vector<bool> &Generated,
+                               bool Memoizable) {
+  MapPlan *P = new MapPlan;
+  P->Names = Names;
+  P->ArgMap = ArgMap;
+  P->Generated = Generated;
+  P->NumResults = 0;
+
+  // Functions without side effects give the same results on the same inputs.
+  P->Memoize = Memoizable && MemoBudget > 0;
+
+  unsigned pos = 0;
+  for (unsigned f = 0; f < Names.size(); f++) {
+    Function *F = TheModule->getFunction(Names[f]);
+    P->Offsets.push_back(pos);
+    P->ResultOffsets.push_back(P->NumResults);
+    P->NumResults += NumMapResults(F);
+    P->Memoize = P->Memoize && F->doesNotAccessMemory();
+    pos += F->arg_size();
+  }
+
+  std::vector<std::string> Constants;
+  P->Ptx = CompileMapKernel(P, 0, P->Kernel, Constants);
+  GetGlobalConstants(Constants, P->Constants);
+
+  P->Launch = 0;
+  P->N = -1;
+  return P;
+}
+
+/// PrepareMapPartPlan - Plan mapping function Name alone, whose arguments
+/// are the inputs in the nargs entries of ArgMap, out of inputs of which
+/// Generated tells which are generated.  The plan takes only the inputs
+/// Name reads, numbered in the order it first reads them; Inputs receives
+/// which they are.  An input -1 is taken as a vector.
+static MapPlan *PrepareMapPartPlan(const std::string &Name, const int *ArgMap,
+                                   unsigned nargs, 
+                                   const std::vector<bool> &Generated,
+                                   std::vector<int> &Inputs) {
+  std::vector<int> PartArgMap;
+  std::vector<bool> PartGenerated;
+  for (unsigned a = 0; a < nargs; a++) {
+    unsigned i = std::find(Inputs.begin(), Inputs.end(), ArgMap[a]) - 
+                 Inputs.begin();
+    if (i == Inputs.size()) {
+      Inputs.push_back(ArgMap[a]);
+      PartGenerated.push_back(ArgMap[a] >= 0 && Generated[ArgMap[a]]);
+    }
+    PartArgMap.push_back(i);
+  }
+  return PrepareMapPlan(std::vector<std::string>(1, Name), PartArgMap, 
+                        PartGenerated);
+}
+
+/// SplitMapPlan - Prepare the plans of P mapping its functions one by one, 
+/// once, see MapPlan.
+static void SplitMapPlan(MapPlan *P) {
+  if (!P->Parts.empty())
+    return;
+  unsigned nfuncs = P->Names.size();
+  P->PartInputs.resize(nfuncs);
+  for (unsigned f = 0; f < nfuncs; f++) {
+    unsigned end = f + 1 < nfuncs ? P->Offsets[f+1] : P->ArgMap.size();
+    P->Parts.push_back(PrepareMapPartPlan(P->Names[f], 
+                                          &P->ArgMap[P->Offsets[f]], 
+                                          end - P->Offsets[f], P->Generated,
+                                          P->PartInputs[f]));
+  }
+}
+
+static void DestroyMapPlan(MapPlan *P) {
+  for (unsigned f = 0; f < P->Parts.size(); f++)
+    DestroyMapPlan(P->Parts[f]);
+  if (P->Launch)
+    DestroyLaunchPlan(P->Launch);
+  delete [] P->Ptx;
+  std::map<int, MapPlan::SpecializedKernel>::iterator I;
+  for (I = P->Specialized.begin(); I != P->Specialized.end(); ++I)
+    delete [] I->second.Ptx;
+  delete P;
+}
+
+/// GetMapKernel - Set Kernel, Ptx and Constants to the kernel of plan P to
+/// launch over N elements and the global constants it reads: one 
+/// specialized for N, so the length is a constant and, when the grid is 
+/// exact, there are no bounds checks, if -specialize-lengths allows P 
+/// another one; otherwise the generic kernel.
+static void GetMapKernel(MapPlan *P, int N, const char *&Kernel, 
+                         const char *&Ptx, 
+                         const std::vector<double*> *&Constants) {
+  Kernel = P->Kernel.c_str();
+  Ptx = P->Ptx;
+  Constants = &P->Constants;
+
+  std::map<int, MapPlan::SpecializedKernel>::iterator I = 
+    P->Specialized.find(N);
+  if (I == P->Specialized.end()) {
+    if (P->Specialized.size() >= SpecializeLengths || N <= 0)
+      return;
+    MapPlan::SpecializedKernel &K = P->Specialized[N];
+    std::vector<std::string> Names;
+    K.Ptx = CompileMapKernel(P, N, K.Kernel, Names);
+    GetGlobalConstants(Names, K.Constants);
+    I = P->Specialized.find(N);
+  }
+  Kernel = I->second.Kernel.c_str();
+  Ptx = I->second.Ptx;
+  Constants = &I->second.Constants;
+}
+
+/// RunMap - Run the maps of plan P over the nargs vectors in args.  The 
+/// results of the functions, in order and one per element for tuple 
+/// functions, go to res, each stored in the buffer of its slot if that can
+/// be recycled.  Functions over different lengths cannot share a launch, so
+/// they are mapped one by one, each by its part plan over only its own 
+/// inputs.  Reusable plans keep their launch plan.
+static void RunMap(MapPlan *P, int nargs, MapArg *args, DVector *res, 
+                   DVector **slots, bool Reusable) {
+  unsigned nfuncs = P->Names.size();
+  int N = args[P->ArgMap[0]].length;
+  for (unsigned f = 1; f < nfuncs; f++) {
+    if (args[P->ArgMap[P->Offsets[f]]].length != N) {
+      SplitMapPlan(P);
+      for (f = 0; f < nfuncs; f++) {
+        std::vector<MapArg> partargs;
+        for (unsigned i = 0; i < P->PartInputs[f].size(); i++)
+          partargs.push_back(args[P->PartInputs[f][i]]);
+        RunMap(P->Parts[f], partargs.size(), &partargs[0], 
+               &res[P->ResultOffsets[f]], &slots[P->ResultOffsets[f]], 
+               Reusable);
+      }
+      return;
+    }
+  }
+
+  std::string Key;
+  if (P->Memoize) {
+    Key = MapCacheKey(P->Kernel, nargs, args);
+    if (LookupMapCache(Key, res, slots))
+      return;
+  }
+
+  void **argsbuf = (void **) malloc(sizeof(void *)*nargs);
+  double *affine = (double *) malloc(sizeof(double)*2*nargs);
+  std::vector<bool> generated(nargs);
+  for (int i = 0; i < nargs; i++) {
+    argsbuf[i] = args[i].ptr;
+    generated[i] = args[i].generated;
+    affine[2*i] = args[i].start;
+    affine[2*i+1] = args[i].step;
+  }
+
+  const char *Kernel = P->Kernel.c_str(), *Ptx = P->Ptx;
+  const std::vector<double*> *Constants = &P->Constants;
+  if (Reusable)
+    GetMapKernel(P, N, Kernel, Ptx, Constants);
+  std::vector<double> consts(Constants->size() + 1);
+  for (unsigned c = 0; c < Constants->size(); c++)
+    consts[c] = *(*Constants)[c];
+  unsigned nconsts = Constants->size();
+
+  unsigned nres = P->NumResults;
+  void **resbufs = (void **) malloc(sizeof(void *)*nres);
+  for (unsigned r = 0; r < nres; r++) {
+    res[r].length = N;
+    res[r].ptr = AcquireVectorStorage(slots[r], N);
+  
+    if (res[r].ptr == NULL) { 
+       fprintf(stderr,"Could not allocate host memory\n" );
+       return ;
+    } 
+    resbufs[r] = res[r].ptr;
+  }
+
+  if (Reusable) {
+    if (P->Launch == 0 || P->N != N) {
+      if (P->Launch)
+        DestroyLaunchPlan(P->Launch);
+      P->Launch = CreateLaunchPlan(Kernel, Ptx, nargs, generated, nres, N);
+      P->N = N;
+    }
+    LaunchPlanned(P->Launch, argsbuf, affine, resbufs, nconsts, &consts[0], 
+                  AsyncMaps, false);
+  } else
+    LaunchOnGpu(Kernel, nargs, N, argsbuf, generated, affine, 
+                nres, resbufs, nconsts, &consts[0], Ptx, AsyncMaps);
+  if (P->Memoize)
+    InsertMapCache(Key, res, nres);
+  free(argsbuf);
+  free(affine);
+  free(resbufs);
+}
+
+/// vector_map_planned -- run the maps of a call site, see MapPlan
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_map_planned(MapPlan *P, int nargs, MapArg *args, DVector *res, 
+                        DVector **slots) {
+  RunMap(P, nargs, args, res, slots, true);
+}
+
+/// vector_map_batch -- map the function of plan P over K batches of its 
+/// nargs arguments, where vecs[a*K + k] is argument a of batch k, returning
+/// the result of batch k in res[k], stored in the buffer of slots[k] if 
+/// that can be recycled.  Each argument is packed into one vector, the
+/// batches one after the other at the offsets the lengths give, so all 
+/// batches take one launch and one copy each way.  P is prepared for vector
+/// arguments, without memoization.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_map_batch(MapPlan *P, int nargs, int K, DVector *vecs, 
+                      DVector *res, DVector **slots) {
+  // A batch is as long as its shortest argument, like BLAS-1 operands.
+  std::vector<int> offsets(K + 1, 0);
+  bool SameLength = true;
+  for (int k = 0; k < K; k++) {
+    int length = vecs[k].length;
+    for (int a = 1; a < nargs; a++) {
+      SameLength = SameLength && vecs[a*K + k].length == length;
+      length = std::min(length, vecs[a*K + k].length);
+    }
+    offsets[k+1] = offsets[k] + length;
+  }
+  if (!SameLength)
+    fprintf(stderr, "Error: mapbatch needs the vectors of each batch to have "
+                    "the same length\n");
+  int total = offsets[K];
+
+  std::vector<MapArg> packed(nargs);
+  for (int a = 0; a < nargs; a++) {
+    packed[a].ptr = AllocVectorStorage(total);
+    packed[a].length = total;
+    packed[a].generated = 0;
+    packed[a].start = packed[a].step = 0;
+    if (packed[a].ptr == NULL) {
+      fprintf(stderr, "Could not allocate host memory\n");
+      return;
+    }
+    for (int k = 0; k < K; k++) {
+      DVector &v = vecs[a*K + k];
+      SyncHostBuffer(v.ptr);
+      memcpy(packed[a].ptr + offsets[k], v.ptr, 
+             (offsets[k+1] - offsets[k]) * sizeof(double));
+    }
+  }
+
+  DVector packedres;
+  DVector *noslot = NULL;
+  RunMap(P, nargs, &packed[0], &packedres, &noslot, true);
+  SyncHostBuffer(packedres.ptr);
+
+  for (int k = 0; k < K; k++) {
+    res[k].length = offsets[k+1] - offsets[k];
+    res[k].ptr = AcquireVectorStorage(slots[k], res[k].length);
+    if (res[k].ptr == NULL) {
+      fprintf(stderr, "Could not allocate host memory\n");
+      return;
+    }
+    memcpy(res[k].ptr, packedres.ptr + offsets[k], 
+           res[k].length * sizeof(double));
+  }
+
+  for (int a = 0; a < nargs; a++)
+    ReleaseVectorStorage(packed[a].ptr);
+  ReleaseVectorStorage(packedres.ptr);
+}
+
+/// MapChainPlan - The functions of the stages of a map chain call site, how 
+/// they take their arguments and the kernel of each, prepared when it is
+/// compiled, see vector_map_chain.
+struct MapChainPlan {
+  std::vector<std::string> Names;
+  std::vector<int> ArgMap;
+  std::vector<unsigned> NumArgs;
+  std::vector<std::string> Kernels;
+  std::vector<char*> Ptx;
+  std::vector<unsigned> NumConstants;   // global constants of each stage
+  std::vector<double*> Constants;
+  std::vector<bool> Generated;
+  // Plans mapping each stage alone, for inputs of different lengths, and 
+  // the inputs each of them takes, -1 for the result of the previous stage,
+  // see PrepareMapPartPlan.
+  std::vector<MapPlan*> Stages;
+  std::vector<std::vector<int> > StageInputs;
+};
+
+static MapChainPlan *PrepareMapChainPlan(const std::vector<std::string> &Names,
+                                         const std::vector<int> &ArgMap,
+                                         const std::vector<bool> &Generated) {
+  MapChainPlan *P = new MapChainPlan;
+  P->Names = Names;
+  P->ArgMap = ArgMap;
+  P->Generated = Generated;
+  IRBuilderBase::InsertPoint IP = Builder.saveIP();
+  for (unsigned s = 0, pos = 0; s < Names.size(); s++) {
+    Module *M = CloneModule(TheModule);
+    std::vector<Function*> F(1, M->getFunction(Names[s]));
+    std::vector<std::vector<unsigned> > FArgMap(1);
+    std::vector<bool> StageGenerated;
+    for (unsigned a = 0; a < F[0]->arg_size(); a++, pos++) {
+      FArgMap[0].push_back(a);
+      StageGenerated.push_back(ArgMap[pos] >= 0 && Generated[ArgMap[pos]]);
+    }
+    P->NumArgs.push_back(F[0]->arg_size());
+    P->Kernels.push_back(std::string());
+    std::vector<std::string> Constants;
+    CreateNVVMMapKernel(M, F, FArgMap, StageGenerated, 0, false, Builder, 
+                        P->Kernels.back(), Constants); 
+    P->NumConstants.push_back(Constants.size());
+    GetGlobalConstants(Constants, P->Constants);
+    P->Ptx.push_back(BitCodeToPtx(M));
+    delete M;
+  }
+  Builder.restoreIP(IP);
+  return P;
+}
+
+/// vector_map_chain -- map the functions of the nstages stages of a chain
+/// of maps (see MapChainPlan) over the nargs vectors in args: each function
+/// over the result of the previous one (-1 in the argument map of P) and
+/// the inputs the argument map lists for its other arguments, all of the
+/// same length.  The result of the last goes to res, stored in the buffer 
+/// of *slots if that can be recycled.  The chain runs tile by tile, see 
+/// LaunchChainOnGpu.  Stages over different lengths are mapped one by
+/// one, each over only its own inputs.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_map_chain(MapChainPlan *P, int nargs, MapArg *args, DVector *res, 
+                      DVector **slots) {
+  unsigned nstages = P->Names.size();
+  int *argmap = &P->ArgMap[0];
+  DVector *slot = slots[0];
+
+  // Check the lengths.
+  int N = -1;
+  bool SameLength = true;
+  for (unsigned s = 0, pos = 0; s < nstages; s++) {
+    int first = argmap[pos];
+    int length = first < 0 ? N : args[first].length;
+    SameLength = SameLength && (N < 0 || length == N);
+    N = length;
+    for (unsigned a = 0; a < P->NumArgs[s]; a++, pos++)
+      if (argmap[pos] >= 0 && args[argmap[pos]].length != N)
+        SameLength = false;
+  }
+
+  if (!SameLength) {
+    if (P->Stages.empty()) {
+      P->StageInputs.resize(nstages);
+      for (unsigned s = 0, pos = 0; s < nstages; pos += P->NumArgs[s++])
+        P->Stages.push_back(PrepareMapPartPlan(P->Names[s], &argmap[pos],
+                                               P->NumArgs[s], P->Generated,
+                                               P->StageInputs[s]));
+    }
+
+    DVector prev = { NULL, 0 };
+    for (unsigned s = 0; s < nstages; s++) {
+      std::vector<MapArg> stageargs;
+      for (unsigned i = 0; i < P->StageInputs[s].size(); i++) {
+        int input = P->StageInputs[s][i];
+        if (input >= 0) {
+          stageargs.push_back(args[input]);
+          continue;
+        }
+        MapArg a = { prev.ptr, prev.length, 0, 0, 0 };
+        stageargs.push_back(a);
+      }
+
+      DVector out = { NULL, 0 };
+      DVector *outslot = s == nstages - 1 ? slot : NULL;
+      RunMap(P->Stages[s], stageargs.size(), &stageargs[0],
+             s == nstages - 1 ? res : &out, &outslot, true);
+      ReleaseVectorStorage(prev.ptr);
+      prev = out;
+    }
+    return;
+  }
+
+  void **argsbuf = (void **) malloc(sizeof(void *)*nargs);
+  double *affine = (double *) malloc(sizeof(double)*2*nargs);
+  std::vector<bool> generated(nargs);
+  for (int i = 0; i < nargs; i++) {
+    argsbuf[i] = args[i].ptr;
+    generated[i] = args[i].generated;
+    affine[2*i] = args[i].start;
+    affine[2*i+1] = args[i].step;
+  }
+
+  res->length = N;
+  res->ptr = AcquireVectorStorage(slot, N);
+  if (res->ptr == NULL) { 
+     fprintf(stderr,"Could not allocate host memory\n" );
+     return ;
+  } 
+
+  std::vector<const char*> kernels, ptx;
+  for (unsigned s = 0; s < nstages; s++) {
+    kernels.push_back(P->Kernels[s].c_str());
+    ptx.push_back(P->Ptx[s]);
+  }
+  std::vector<double> consts(P->Constants.size() + 1);
+  for (unsigned c = 0; c < P->Constants.size(); c++)
+    consts[c] = *P->Constants[c];
+  LaunchChainOnGpu(nstages, &kernels[0], &ptx[0], &P->NumArgs[0], argmap, 
+                   &P->NumConstants[0], &consts[0], nargs, N, argsbuf, 
+                   generated, affine, res->ptr, AsyncMaps);
+  free(argsbuf);
+  free(affine);
+}
+
+/// StatsPlan - The kernel of a stats call site, which reduces its vector or 
+/// the values of the function it maps, prepared when it is compiled, see 
+/// vector_stats.
+struct StatsPlan {
+  std::string Kernel;
+  char *Ptx;
+  std::vector<double*> Constants;       // the global constants it reads
+  int First;                            // the input giving the length
+  unsigned Chunk;                       // see -reproducible
+
+  // The function it maps, if any, and how, for inputs of different lengths,
+  // which are mapped first and then reduced, by Map and Values once made.
+  std::string Name;
+  std::vector<int> ArgMap;
+  std::vector<bool> Generated;
+  MapPlan *Map;
+  StatsPlan *Values;
+};
+
+static StatsPlan *PrepareStatsPlan(const std::string &Name,
+                                   const std::vector<int> &ArgMap,
+                                   const std::vector<bool> &Generated) {
+  StatsPlan *P = new StatsPlan;
+  Module *M = CloneModule(TheModule);
+  Function *F = Name.empty() ? 0 : M->getFunction(Name);
+  std::vector<unsigned> FArgMap(ArgMap.begin(), ArgMap.end());
+  std::vector<std::string> Constants;
+  IRBuilderBase::InsertPoint IP = Builder.saveIP();
+  P->Chunk = Reproducible ? ReproducibleChunk : 0;
+  CreateNVVMStatsKernel(M, F, FArgMap, Generated, P->Chunk, Builder, 
+                        P->Kernel, Constants);
+  Builder.restoreIP(IP);
+  GetGlobalConstants(Constants, P->Constants);
+  P->Ptx = BitCodeToPtx(M);
+  delete M;
+  P->First = ArgMap.empty() ? 0 : ArgMap[0];
+  P->Name = Name;
+  P->ArgMap = ArgMap;
+  P->Generated = Generated;
+  P->Map = 0;
+  P->Values = 0;
+  return P;
+}
+
+/// PartialStats - The statistics of part of the values of a stats call site.
+struct PartialStats {
+  double Count, Mean, M2, Min, Max, Sum;
+};
+
+/// MergeStats - The statistics of the values of A and B together, by the 
+/// pairwise update of Chan, Golub and LeVeque.
+static PartialStats MergeStats(const PartialStats &A, const PartialStats &B) {
+  if (B.Count == 0)
+    return A;
+  if (A.Count == 0)
+    return B;
+  PartialStats R;
+  double Delta = B.Mean - A.Mean;
+  R.Count = A.Count + B.Count;
+  R.Mean = A.Mean + Delta * B.Count / R.Count;
+  R.M2 = A.M2 + B.M2 + Delta * Delta * A.Count * B.Count / R.Count;
+  R.Min = std::min(A.Min, B.Min);
+  R.Max = std::max(A.Max, B.Max);
+  R.Sum = A.Sum + B.Sum;
+  return R;
+}
+
+/// MergeStatsTree - Merge the partial statistics [Lo, Hi) of the T threads
+/// of a statistics kernel (see CreateNVVMStatsKernel) by a balanced binary
+/// tree, halving the range at each level.  Its shape only depends on T, 
+/// and in reproducible mode, where thread i covers elements [i * 
+/// ReproducibleChunk, (i + 1) * ReproducibleChunk), T only depends on the 
+/// length, so every operation and its operands are fixed by the length: 
+/// the results are bitwise identical whatever the device and its number of
+/// multiprocessors.  The tree also bounds the rounding error of the sum by
+/// O(log N) instead of O(N) ulps.
+static PartialStats MergeStatsTree(const std::vector<double> &Partials,
+                                   unsigned T, unsigned Lo, unsigned Hi) {
+  if (Hi - Lo == 1) {
+    PartialStats S = { Partials[Lo], Partials[T + Lo], Partials[2*T + Lo],
+                       Partials[3*T + Lo], Partials[4*T + Lo], 
+                       Partials[5*T + Lo] };
+    return S;
+  }
+  unsigned Mid = Lo + (Hi - Lo) / 2;
+  return MergeStats(MergeStatsTree(Partials, T, Lo, Mid),
+                    MergeStatsTree(Partials, T, Mid, Hi));
+}
+
+/// vector_stats -- compute the statistics of a stats call site (see 
+/// StatsExprAST and StatsPlan) over the nargs inputs in args into res.  The
+/// kernel leaves the count, mean, M2, minimum, maximum and sum of the values
+/// each thread saw, which are merged by MergeStatsTree, so the variance 
+/// takes no second pass and does not suffer the cancellation of the sum of
+/// squares.  The variance is that of a sample, M2 / (count - 1).  Inputs of
+/// different lengths cannot be reduced in one kernel, so the function is 
+/// mapped first, as it would be without stats, and its values reduced.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_stats(StatsPlan *P, int nargs, MapArg *args, double *res, 
+                  DVector **slots) {
+  int N = args[P->First].length;
+  bool SameLength = true;
+  for (int i = 0; i < nargs; i++)
+    SameLength = SameLength && args[i].length == N;
+  if (!SameLength) {
+    if (P->Map == 0) {
+      P->Map = PrepareMapPlan(std::vector<std::string>(1, P->Name), P->ArgMap,
+                              P->Generated, false);
+      P->Values = PrepareStatsPlan("", std::vector<int>(), 
+                                   std::vector<bool>(1, false));
+    }
+    DVector values = { NULL, 0 };
+    DVector *slot = NULL;
+    RunMap(P->Map, nargs, args, &values, &slot, true);
+    MapArg a = { values.ptr, values.length, 0, 0, 0 };
+    vector_stats(P->Values, 1, &a, res, slots);
+    ReleaseVectorStorage(values.ptr);
+    return;
+  }
+
+  PartialStats S = { 0, 0, 0, HUGE_VAL, -HUGE_VAL, 0 };
+
+  if (N > 0) {
+    void **argsbuf = (void **) malloc(sizeof(void *)*nargs);
+    double *affine = (double *) malloc(sizeof(double)*2*nargs);
+    std::vector<bool> generated(nargs);
+    for (int i = 0; i < nargs; i++) {
+      argsbuf[i] = args[i].ptr;
+      generated[i] = args[i].generated;
+      affine[2*i] = args[i].start;
+      affine[2*i+1] = args[i].step;
+    }
+    std::vector<double> consts(P->Constants.size() + 1);
+    for (unsigned c = 0; c < P->Constants.size(); c++)
+      consts[c] = *P->Constants[c];
+
+    // Six partial statistics per thread, see CreateNVVMStatsKernel.
+    std::vector<double> partials;
+    unsigned T = LaunchReductionOnGpu(P->Kernel.c_str(), P->Ptx, nargs, N, 
+                                      argsbuf, generated, affine, 
+                                      P->Constants.size(),
+                                      &consts[0], 6, P->Chunk, partials);
+    S = MergeStatsTree(partials, T, 0, T);
+    free(argsbuf);
+    free(affine);
+  }
+
+  res[StatsExprAST::Sum] = S.Sum;
+  res[StatsExprAST::Mean] = S.Mean;
+  res[StatsExprAST::Variance] = S.Count > 1 ? S.M2 / (S.Count - 1) : 0;
+  res[StatsExprAST::Min] = S.Min;
+  res[StatsExprAST::Max] = S.Max;
+  res[StatsExprAST::Count] = S.Count;
+}
+
+/// Vector library operations over at least this many elements split their
+/// work among the host threads OpenMP provides (OMP_NUM_THREADS); fewer 
+/// are done before the threads would be woken.
+static const int HostParallelLength = 1 << 16;
+
+/// HostThreads - The number of host threads to split work on n elements 
+/// among, one without OpenMP.  Thread t of T takes the elements from 
+/// HostBlockBegin(n, T, t) up to HostBlockBegin(n, T, t + 1), so the loops
+/// over t below run the same blocks serially when OpenMP gives fewer 
+/// threads, or none.
+static int HostThreads(int n) {
+#ifdef _OPENMP
+  if (n >= HostParallelLength)
+    return omp_get_max_threads();
+#endif
+  return 1;
+}
+
+static inline int HostBlockBegin(int n, int T, int t) {
+  return (int)((int64_t)n * t / T);
+}
+
+/// RadixKey - The bits of x as an unsigned integer that orders like x: a 
+/// negative number has all bits flipped, any other just the sign bit.  
+/// NaNs go to the ends.
+static inline uint64_t RadixKey(double x) {
+  uint64_t b;
+  memcpy(&b, &x, sizeof(b));
+  return (b >> 63) ? ~b : b | (1ULL << 63);
+}
+
+static inline double RadixValue(uint64_t k) {
+  uint64_t b = (k >> 63) ? k & ~(1ULL << 63) : ~k;
+  double x;
+  memcpy(&x, &b, sizeof(x));
+  return x;
+}
+
+/// RadixSort - Sort the n keys (see RadixKey) stably by least significant 
+/// digit radix sort, permuting the n elements of perm along with them unless
+/// it is null.  The digits have 11 bits, so a pass has 2048 buckets, whose
+/// counters fit in the L1 cache.  Each host thread counts the digits of its
+/// block of keys, and the counts, summed bucket by bucket in thread order, 
+/// tell each thread where its keys of each bucket go, so it scatters them
+/// alongside the others and the sort stays stable.  The histograms of all 
+/// passes are counted in one read up front, and a pass whose digit is the 
+/// same for all keys, as the exponent digits of values of similar magnitude
+/// tend to be, is skipped.  A pass moves keys between blocks, so with 
+/// several threads the later ones count their block again.  Each pass is 
+/// thus a read and a write of the keys, and another read with several 
+/// threads, so the sort is bound by memory bandwidth.
+static void RadixSort(uint64_t *keys, int *perm, int n) {
+  const unsigned Bits = 11, Buckets = 1 << Bits;
+  const unsigned Passes = (64 + Bits - 1) / Bits;
+  const int T = HostThreads(n);
+
+  // The histogram of pass p of thread t is at count[(t*Passes + p)*Buckets].
+  std::vector<int> count(T * Passes * Buckets, 0);
+#pragma omp parallel for num_threads(T)
+  for (int t = 0; t < T; t++) {
+    int *c = &count[t * Passes * Buckets];
+    for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); i++)
+      for (unsigned p = 0; p < Passes; p++)
+        c[p*Buckets + ((keys[i] >> (p*Bits)) & (Buckets - 1))]++;
+  }
+
+  std::vector<uint64_t> tmpkeys(n);
+  std::vector<int> tmpperm(perm ? n : 0);
+  uint64_t *src = keys, *dst = &tmpkeys[0];
+  int *psrc = perm, *pdst = perm ? &tmpperm[0] : 0;
+  bool Moved = false;
+  for (unsigned p = 0; p < Passes; p++) {
+    unsigned shift = p*Bits;
+    unsigned first = (src[0] >> shift) & (Buckets - 1);
+    int same = 0;
+    for (int t = 0; t < T; t++)
+      same += count[(t*Passes + p)*Buckets + first];
+    if (same == n)
+      continue;
+
+    if (Moved && T > 1) {
+#pragma omp parallel for num_threads(T)
+      for (int t = 0; t < T; t++) {
+        int *c = &count[(t*Passes + p)*Buckets];
+        std::fill(c, c + Buckets, 0);
+        for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1);
+             i++)
+          c[(src[i] >> shift) & (Buckets - 1)]++;
+      }
+    }
+    Moved = true;
+
+    int sum = 0;
+    for (unsigned b = 0; b < Buckets; b++)
+      for (int t = 0; t < T; t++) {
+        int &c = count[(t*Passes + p)*Buckets + b];
+        int k = c;
+        c = sum;
+        sum += k;
+      }
+
+#pragma omp parallel for num_threads(T)
+    for (int t = 0; t < T; t++) {
+      int *c = &count[(t*Passes + p)*Buckets];
+      for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); 
+           i++) {
+        int pos = c[(src[i] >> shift) & (Buckets - 1)]++;
+        dst[pos] = src[i];
+        if (perm)
+          pdst[pos] = psrc[i];
+      }
+    }
+    std::swap(src, dst);
+    std::swap(psrc, pdst);
+  }
+  if (src != keys) {
+    memcpy(keys, src, n * sizeof(uint64_t));
+    if (perm)
+      memcpy(perm, psrc, n * sizeof(int));
+  }
+}
+
+/// Sorts of at least this many keys go to the device, where a pass runs at
+/// several times the memory bandwidth of the host, which soon outweighs 
+/// copying the keys there and back; see CreateNVVMRadixSortKernels.
+static const int SortDeviceLength = 1 << 20;
+static const unsigned SortTile = 4096;
+
+/// SortKeys - Sort the n keys and permute perm like RadixSort, on the 
+/// device if there are at least SortDeviceLength keys.  Its digits have 8
+/// bits, and only those in which some keys differ take a pass.
+static void SortKeys(uint64_t *keys, int *perm, int n) {
+  static std::vector<std::string> Kernels;
+  static char *Ptx = 0;
+
+  if (n < SortDeviceLength) {
+    RadixSort(keys, perm, n);
+    return;
+  }
+
+  const int T = HostThreads(n);
+  std::vector<uint64_t> diff(T, 0);
+#pragma omp parallel for num_threads(T)
+  for (int t = 0; t < T; t++) {
+    uint64_t d = 0;
+    for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); i++)
+      d |= keys[i] ^ keys[0];
+    diff[t] = d;
+  }
+  uint64_t any = 0;
+  for (int t = 0; t < T; t++)
+    any |= diff[t];
+  std::vector<unsigned> shifts;
+  for (unsigned shift = 0; shift < 64; shift += 8)
+    if ((any >> shift) & 255)
+      shifts.push_back(shift);
+  if (shifts.empty())
+    return;
+
+  if (Ptx == 0) {
+    Module *M = CloneModule(TheModule);
+    IRBuilderBase::InsertPoint IP = Builder.saveIP();
+    CreateNVVMRadixSortKernels(M, SortTile, Builder, Kernels);
+    Builder.restoreIP(IP);
+    Ptx = BitCodeToPtx(M);
+    delete M;
+  }
+  const char *Names[] = { Kernels[0].c_str(), Kernels[1].c_str(), 
+                          Kernels[2].c_str() };
+  LaunchSortOnGpu(Names, Ptx, SortTile, shifts.size(), &shifts[0], n, keys,
+                  perm);
+}
+
+/// vector_sort -- sort(v): the elements of v in ascending order, see 
+/// SortKeys
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_sort(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  DVector &v = vecs[0];
+  SyncHostBuffer(v.ptr);
+  int n = v.length;
+  vres[0].length = n;
+  vres[0].ptr = AcquireVectorStorage(slots[0], n);
+  if (vres[0].ptr == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  if (n == 0)
+    return;
+
+  std::vector<uint64_t> keys(n);
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int i = 0; i < n; i++)
+    keys[i] = RadixKey(v.ptr[i]);
+  SortKeys(&keys[0], NULL, n);
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int i = 0; i < n; i++)
+    vres[0].ptr[i] = RadixValue(keys[i]);
+}
+
+/// vector_sort_by_key -- sortByKey(keys, values): the tuple of the keys in
+/// ascending order and the values in the same order as their keys.  Values
+/// with equal keys keep their order.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_sort_by_key(DVector *vecs, double *nums, DVector *vres, 
+                        double *dres, DVector **slots) {
+  DVector &k = vecs[0], &v = vecs[1];
+  SyncHostBuffer(k.ptr);
+  SyncHostBuffer(v.ptr);
+  int n = k.length;
+  if (v.length != n) {
+    fprintf(stderr, "Error: sortByKey needs as many values as keys\n");
+    n = std::min(n, v.length);
+  }
+  for (unsigned r = 0; r < 2; r++) {
+    vres[r].length = n;
+    vres[r].ptr = AcquireVectorStorage(slots[r], n);
+    if (vres[r].ptr == NULL) {
+      fprintf(stderr, "Could not allocate host memory\n");
+      return;
+    }
+  }
+  if (n == 0)
+    return;
+
+  std::vector<uint64_t> keys(n);
+  std::vector<int> perm(n);
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int i = 0; i < n; i++) {
+    keys[i] = RadixKey(k.ptr[i]);
+    perm[i] = i;
+  }
+  SortKeys(&keys[0], &perm[0], n);
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int i = 0; i < n; i++) {
+    vres[0].ptr[i] = RadixValue(keys[i]);
+    vres[1].ptr[i] = v.ptr[perm[i]];
+  }
+}
+
+/// RankedKey - The key (see RadixKey) and index of an element, ordered by 
+/// key, then index.
+typedef std::pair<uint64_t, int> RankedKey;
+
+/// SelectRanks - Collect in Cand the elements of the n values in x that may 
+/// have ranks lo to hi in ascending order: the first pass counts the top 16
+/// bits of the keys (sign, exponent and 4 bits of mantissa), which tells 
+/// the digits of ranks lo and hi, and the second collects the elements with
+/// digits in between.  Return the rank of the smallest element in Cand, 
+/// within which the selection is then completed.  Rank lo is usually in a
+/// bucket of a small fraction of the elements, so little is left to do.
+/// Each host thread counts its block of x into its own histogram, which 
+/// are then summed, and collects its candidates, which are appended in 
+/// thread order.
+static int SelectRanks(const double *x, int n, int lo, int hi,
+                       std::vector<RankedKey> &Cand) {
+  const unsigned Shift = 48, Buckets = 1 << 16;
+  const int T = HostThreads(n);
+  std::vector<int> counts(T * Buckets, 0);
+#pragma omp parallel for num_threads(T)
+  for (int t = 0; t < T; t++) {
+    int *c = &counts[t * Buckets];
+    for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); i++)
+      c[RadixKey(x[i]) >> Shift]++;
+  }
+  std::vector<int> count(counts.begin(), counts.begin() + Buckets);
+  for (int t = 1; t < T; t++)
+    for (unsigned b = 0; b < Buckets; b++)
+      count[b] += counts[t * Buckets + b];
+
+  unsigned blo = 0, bhi = 0;
+  int below = 0, base = 0;
+  for (unsigned b = 0; b < Buckets; b++) {
+    if (below <= lo && lo < below + count[b]) {
+      blo = b;
+      base = below;
+    }
+    if (below <= hi && hi < below + count[b]) {
+      bhi = b;
+      break;
+    }
+    below += count[b];
+  }
+
+  std::vector<std::vector<RankedKey> > Found(T);
+#pragma omp parallel for num_threads(T)
+  for (int t = 0; t < T; t++)
+    for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); 
+         i++) {
+      uint64_t k = RadixKey(x[i]);
+      unsigned b = k >> Shift;
+      if (blo <= b && b <= bhi)
+        Found[t].push_back(RankedKey(k, i));
+    }
+  for (int t = 0; t < T; t++)
+    Cand.insert(Cand.end(), Found[t].begin(), Found[t].end());
+  return base;
+}
+
+/// vector_topk -- topk(v, k): the tuple of the k largest elements of v in
+/// descending order and their positions in v, without sorting v, see 
+/// SelectRanks.  Of equal elements, the first come first.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_topk(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  DVector &v = vecs[0];
+  SyncHostBuffer(v.ptr);
+  int n = v.length;
+  int k = (int)std::max(0.0, std::min(nums[0], (double)n));
+  for (unsigned r = 0; r < 2; r++) {
+    vres[r].length = k;
+    vres[r].ptr = AcquireVectorStorage(slots[r], k);
+    if (vres[r].ptr == NULL) {
+      fprintf(stderr, "Could not allocate host memory\n");
+      return;
+    }
+  }
+  if (k == 0)
+    return;
+
+  std::vector<RankedKey> cand;
+  int p = n - k - SelectRanks(v.ptr, n, n - k, n - 1, cand);
+
+  // Rank equal elements by descending position, so if they straddle the 
+  // cut, the first of them get the top ranks.
+  for (unsigned i = 0; i < cand.size(); i++)
+    cand[i].second = ~cand[i].second;
+  std::nth_element(cand.begin(), cand.begin() + p, cand.end());
+
+  // Descending by value, ascending by position among equal values.
+  std::vector<RankedKey> top;
+  for (unsigned i = p; i < cand.size(); i++)
+    top.push_back(RankedKey(~cand[i].first, ~cand[i].second));
+  std::sort(top.begin(), top.end());
+  for (int i = 0; i < k; i++) {
+    vres[0].ptr[i] = RadixValue(~top[i].first);
+    vres[1].ptr[i] = top[i].second;
+  }
+}
+
+/// vector_quantile -- quantile(v, q): the q-quantile of v, interpolated 
+/// linearly between the elements of ranks floor(q * (N-1)) and the next, 
+/// without sorting v, see SelectRanks.  NaN for an empty v.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_quantile(DVector *vecs, double *nums, DVector *vres, double *dres,
+                     DVector **slots) {
+  DVector &v = vecs[0];
+  SyncHostBuffer(v.ptr);
+  int n = v.length;
+  if (n == 0) {
+    dres[0] = std::numeric_limits<double>::quiet_NaN();
+    return;
+  }
+  double r = std::max(0.0, std::min(nums[0], 1.0)) * (n - 1);
+  int lo = (int)floor(r), hi = std::min(lo + 1, n - 1);
+
+  std::vector<RankedKey> cand;
+  int p = lo - SelectRanks(v.ptr, n, lo, hi, cand);
+  std::nth_element(cand.begin(), cand.begin() + p, cand.end());
+  double xlo = RadixValue(cand[p].first);
+  if (hi == lo) {
+    dres[0] = xlo;
+    return;
+  }
+  double xhi = RadixValue(std::min_element(cand.begin() + p + 1, 
+                                           cand.end())->first);
+  dres[0] = xlo + (r - lo) * (xhi - xlo);
+}
+
+/// vector_histogram -- histogram(v, bins, lo, hi): the number of elements 
+/// of v in each of bins equal bins spanning [lo, hi], hi going to the last 
+/// bin.  Elements outside, and NaNs, are not counted.  A range that is 
+/// empty, infinite or NaN is an error, and counts nothing.  Each host thread 
+/// counts its block of v into private histograms, merged at the end, so the
+/// threads never contend for a bin.  Runs of equal bins would make each 
+/// increment wait for the previous one, so a thread counts consecutive 
+/// elements in separate histograms.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_histogram(DVector *vecs, double *nums, DVector *vres, 
+                      double *dres, DVector **slots) {
+  const int Private = 4;
+  DVector &v = vecs[0];
+  SyncHostBuffer(v.ptr);
+  int bins = (int)std::max(nums[0], 0.0);
+  double lo = nums[1], hi = nums[2];
+  vres[0].length = bins;
+  vres[0].ptr = AcquireVectorStorage(slots[0], bins);
+  if (vres[0].ptr == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  if (bins == 0)
+    return;
+  if (!(lo < hi && hi - lo < HUGE_VAL)) {
+    fprintf(stderr, "Error: histogram needs a finite range with lo < hi\n");
+    std::fill(vres[0].ptr, vres[0].ptr + bins, 0.0);
+    return;
+  }
+
+  // The histograms of thread t start at count[t * Private * bins].
+  const int n = v.length, T = HostThreads(n);
+  std::vector<int> count(T * Private * bins, 0);
+  double width = hi - lo;
+#pragma omp parallel for num_threads(T)
+  for (int t = 0; t < T; t++) {
+    int *c = &count[t * Private * bins];
+    for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); 
+         i++) {
+      double x = v.ptr[i];
+      if (x != x || x < lo || x > hi)
+        continue;
+      int b = std::min((int)((x - lo) / width * bins), bins - 1);
+      c[(i % Private) * bins + b]++;
+    }
+  }
+  for (int b = 0; b < bins; b++) {
+    int c = 0;
+    for (int p = 0; p < T * Private; p++)
+      c += count[p * bins + b];
+    vres[0].ptr[b] = c;
+  }
+}
+
+/// GroupTable - The groups groupAgg found in a block of keys: the group of
+/// each key, by bit pattern, and its key, aggregate and count.
+struct GroupTable {
+  llvm::DenseMap<uint64_t, unsigned> GroupOf;
+  std::vector<double> Keys, Acc, Count;
+
+  /// Add - Aggregate x, counting for count elements, into the group of key 
+  /// by op.
+  void Add(AggOp op, double key, double x, double count) {
+    uint64_t bits;
+    memcpy(&bits, &key, sizeof(bits));
+    std::pair<llvm::DenseMap<uint64_t, unsigned>::iterator, bool> I = 
+      GroupOf.insert(std::make_pair(bits, (unsigned)Keys.size()));
+    unsigned g = I.first->second;
+    if (I.second) {
+      Keys.push_back(key);
+      Acc.push_back(x);
+      Count.push_back(count);
+      return;
+    }
+    Count[g] += count;
+    switch (op) {
+    case AggMin: Acc[g] = std::min(Acc[g], x); break;
+    case AggMax: Acc[g] = std::max(Acc[g], x); break;
+    default:     Acc[g] += x; break;
+    }
+  }
+};
+
+/// vector_group_agg -- groupAgg(keys, values, op): the tuple of the 
+/// distinct keys in ascending order and the aggregate op (see AggOp) of the
+/// values of each key.  The groups are found through hash tables, so 
+/// sparse keys cost no more than dense ones.  Each host thread aggregates 
+/// its block of the values in order into a table of its own, and the tables
+/// are merged in thread order; in reproducible mode sums and means are 
+/// aggregated by one thread, so their rounding does not depend on the 
+/// number of threads.  NaN keys are ignored, and -0 is the same key as 0.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_group_agg(DVector *vecs, double *nums, DVector *vres, 
+                      double *dres, DVector **slots) {
+  DVector &k = vecs[0], &v = vecs[1];
+  SyncHostBuffer(k.ptr);
+  SyncHostBuffer(v.ptr);
+  AggOp op = (AggOp)(int)nums[0];
+  int n = k.length;
+  if (v.length != n) {
+    fprintf(stderr, "Error: groupAgg needs as many values as keys\n");
+    n = std::min(n, v.length);
+  }
+
+  bool Sums = op == AggSum || op == AggMean;
+  const int T = Reproducible && Sums ? 1 : HostThreads(n);
+  std::vector<GroupTable> Tables(T);
+#pragma omp parallel for num_threads(T)
+  for (int t = 0; t < T; t++)
+    for (int i = HostBlockBegin(n, T, t); i < HostBlockBegin(n, T, t + 1); 
+         i++) {
+      double key = k.ptr[i];
+      if (key != key)
+        continue;
+      if (key == 0)
+        key = 0;
+      Tables[t].Add(op, key, v.ptr[i], 1);
+    }
+  GroupTable &G = Tables[0];
+  for (int t = 1; t < T; t++)
+    for (unsigned g = 0; g < Tables[t].Keys.size(); g++)
+      G.Add(op, Tables[t].Keys[g], Tables[t].Acc[g], Tables[t].Count[g]);
+
+  // Order the groups by key.
+  std::vector<RankedKey> order;
+  for (unsigned g = 0; g < G.Keys.size(); g++)
+    order.push_back(RankedKey(RadixKey(G.Keys[g]), g));
+  std::sort(order.begin(), order.end());
+
+  for (unsigned r = 0; r < 2; r++) {
+    vres[r].length = order.size();
+    vres[r].ptr = AcquireVectorStorage(slots[r], order.size());
+    if (vres[r].ptr == NULL) {
+      fprintf(stderr, "Could not allocate host memory\n");
+      return;
+    }
+  }
+  for (unsigned i = 0; i < order.size(); i++) {
+    unsigned g = order[i].second;
+    vres[0].ptr[i] = G.Keys[g];
+    vres[1].ptr[i] = op == AggCount ? G.Count[g] : 
+                     op == AggMean ? G.Acc[g] / G.Count[g] : G.Acc[g];
+  }
+}
+
+/// BLAS-1 -- The level 1 BLAS operations of the vector library.  They do a
+/// multiply-add or two per element read, so they are bound by memory 
+/// bandwidth.  The vectors live in host memory, and copying them to the 
+/// device over the bus is several times slower than the host threads 
+/// reading them, so they run on the host, in blocks of Blas1Block elements
+/// split among the host threads.  The loops are unrolled by four with 
+/// independent accumulators, which breaks the dependency chain of the 
+/// additions and leaves the compiler free to vectorize them.  Vectors of 
+/// different lengths are taken up to the shorter one.
+
+/// Blas1Block - The elements a thread handles at a time.  The reductions 
+/// add the sums of the blocks in order, so their results depend on the 
+/// length of the vectors, not on the number of threads.
+static const int Blas1Block = 1 << 14;
+
+static int Blas1Length(const char *Name, DVector &x, DVector &y) {
+  if (x.length != y.length)
+    fprintf(stderr, "Error: %s needs vectors of the same length\n", Name);
+  return std::min(x.length, y.length);
+}
+
+static double Blas1Dot(const double *x, const double *y, int n) {
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += x[i] * y[i];
+    s1 += x[i+1] * y[i+1];
+    s2 += x[i+2] * y[i+2];
+    s3 += x[i+3] * y[i+3];
+  }
+  for (; i < n; i++)
+    s0 += x[i] * y[i];
+  return (s0 + s1) + (s2 + s3);
+}
+
+static double Blas1Asum(const double *x, const double *, int n) {
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += fabs(x[i]);
+    s1 += fabs(x[i+1]);
+    s2 += fabs(x[i+2]);
+    s3 += fabs(x[i+3]);
+  }
+  for (; i < n; i++)
+    s0 += fabs(x[i]);
+  return (s0 + s1) + (s2 + s3);
+}
+
+static void Blas1Axpy(double a, const double *x, const double *y, double *r,
+                      int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    r[i] = a * x[i] + y[i];
+    r[i+1] = a * x[i+1] + y[i+1];
+    r[i+2] = a * x[i+2] + y[i+2];
+    r[i+3] = a * x[i+3] + y[i+3];
+  }
+  for (; i < n; i++)
+    r[i] = a * x[i] + y[i];
+}
+
+static void Blas1Scal(double a, const double *x, double *r, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    r[i] = a * x[i];
+    r[i+1] = a * x[i+1];
+    r[i+2] = a * x[i+2];
+    r[i+3] = a * x[i+3];
+  }
+  for (; i < n; i++)
+    r[i] = a * x[i];
+}
+
+/// Blas1Sum - The sum of Block over the blocks of the n elements of x and
+/// y (which Block may ignore), see Blas1Block.
+static double Blas1Sum(double (*Block)(const double *, const double *, int),
+                       const double *x, const double *y, int n) {
+  int nblocks = (n + Blas1Block - 1) / Blas1Block;
+  if (nblocks <= 1)
+    return Block(x, y, n);
+  std::vector<double> sums(nblocks);
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int b = 0; b < nblocks; b++) {
+    int lo = b * Blas1Block;
+    sums[b] = Block(x + lo, y + lo, std::min(Blas1Block, n - lo));
+  }
+  double s = 0;
+  for (int b = 0; b < nblocks; b++)
+    s += sums[b];
+  return s;
+}
+
+/// vector_dot -- dot(x, y): the sum of x[i] * y[i]
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_dot(DVector *vecs, double *nums, DVector *vres, double *dres,
+                DVector **slots) {
+  SyncHostBuffer(vecs[0].ptr);
+  SyncHostBuffer(vecs[1].ptr);
+  int n = Blas1Length("dot", vecs[0], vecs[1]);
+  dres[0] = Blas1Sum(Blas1Dot, vecs[0].ptr, vecs[1].ptr, n);
+}
+
+/// vector_nrm2 -- nrm2(x): the Euclidean norm of x.  If the sum of squares
+/// overflows or underflows, x is scaled by its largest magnitude first.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_nrm2(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  DVector &x = vecs[0];
+  SyncHostBuffer(x.ptr);
+  int n = x.length;
+  double ss = Blas1Sum(Blas1Dot, x.ptr, x.ptr, n);
+  if (ss > std::numeric_limits<double>::min() && 
+      ss < std::numeric_limits<double>::infinity()) {
+    dres[0] = sqrt(ss);
+    return;
+  }
+
+  int nblocks = (n + Blas1Block - 1) / Blas1Block;
+  std::vector<double> part(nblocks);
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int b = 0; b < nblocks; b++) {
+    double m = 0;
+    for (int i = b * Blas1Block; i < std::min(n, (b + 1) * Blas1Block); i++)
+      m = std::max(m, fabs(x.ptr[i]));
+    part[b] = m;
+  }
+  double scale = 0;
+  for (int b = 0; b < nblocks; b++)
+    scale = std::max(scale, part[b]);
+  if (scale == 0 || scale == std::numeric_limits<double>::infinity()) {
+    dres[0] = scale;
+    return;
+  }
+
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int b = 0; b < nblocks; b++) {
+    double s = 0;
+    for (int i = b * Blas1Block; i < std::min(n, (b + 1) * Blas1Block); i++)
+      s += (x.ptr[i] / scale) * (x.ptr[i] / scale);
+    part[b] = s;
+  }
+  double sum = 0;
+  for (int b = 0; b < nblocks; b++)
+    sum += part[b];
+  dres[0] = scale * sqrt(sum);
+}
+
+/// vector_asum -- asum(x): the sum of the magnitudes of the elements of x
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_asum(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  SyncHostBuffer(vecs[0].ptr);
+  dres[0] = Blas1Sum(Blas1Asum, vecs[0].ptr, vecs[0].ptr, vecs[0].length);
+}
+
+/// vector_axpy -- axpy(a, x, y): the vector a * x + y
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_axpy(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  double a = nums[0];
+  const double *x = vecs[0].ptr, *y = vecs[1].ptr;
+  SyncHostBuffer(vecs[0].ptr);
+  SyncHostBuffer(vecs[1].ptr);
+  int n = Blas1Length("axpy", vecs[0], vecs[1]);
+  vres[0].length = n;
+  double *r = vres[0].ptr = AcquireVectorStorage(slots[0], n);
+  if (r == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  int nblocks = (n + Blas1Block - 1) / Blas1Block;
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int b = 0; b < nblocks; b++) {
+    int lo = b * Blas1Block;
+    Blas1Axpy(a, x + lo, y + lo, r + lo, std::min(Blas1Block, n - lo));
   }
-  
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
-Value *MapExprAST::Codegen() {
-  // Look up the name in the global module table.
-  Function *CalleeF = TheModule->getFunction(Callee);
-  
-  if (CalleeF == 0)
-    return ErrorV("Unknown function referenced");
+/// vector_scal -- scal(a, x): the vector a * x
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_scal(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  double a = nums[0];
+  const double *x = vecs[0].ptr;
+  SyncHostBuffer(vecs[0].ptr);
+  int n = vecs[0].length;
+  vres[0].length = n;
+  double *r = vres[0].ptr = AcquireVectorStorage(slots[0], n);
+  if (r == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  int nblocks = (n + Blas1Block - 1) / Blas1Block;
+#pragma omp parallel for num_threads(HostThreads(n))
+  for (int b = 0; b < nblocks; b++) {
+    int lo = b * Blas1Block;
+    Blas1Scal(a, x + lo, r + lo, std::min(Blas1Block, n - lo));
+  }
+}
 
-  Value *CalleeName = Builder.CreateGlobalStringPtr(CalleeF->getName());
-  std::vector<Value*> ArgsV;
-  ArgsV.push_back(CalleeName);
+/// Gemm - C = A * B for the row-major m x k matrix A and k x n matrix B, 
+/// blocked for the caches: a GemmKC x GemmNC panel of B is packed to stay
+/// in L2 while GemmMC x GemmKC blocks of A, packed to stay in L1, are 
+/// multiplied by it.  Packing lays the panels out in strips of four rows
+/// of A and four columns of B, zero-padded at the edges, which the 
+/// micro-kernel reads sequentially while it keeps a 4 x 4 tile of C in 
+/// sixteen independent accumulators, registers the compiler can vectorize.
+/// The host threads split the blocks of A, and so the rows of C, each 
+/// packing its own; a multiply-add counts as an element for HostThreads.
+static const int GemmMC = 64, GemmKC = 256, GemmNC = 512;
+
+static void GemmMicroKernel(int kc, const double *a, const double *b, 
+                            double *c, int ldc, int mr, int nr) {
+  double c00 = 0, c01 = 0, c02 = 0, c03 = 0, c10 = 0, c11 = 0, c12 = 0, c13 = 0;
+  double c20 = 0, c21 = 0, c22 = 0, c23 = 0, c30 = 0, c31 = 0, c32 = 0, c33 = 0;
+  for (int p = 0; p < kc; p++, a += 4, b += 4) {
+    c00 += a[0] * b[0]; c01 += a[0] * b[1]; c02 += a[0] * b[2]; c03 += a[0] * b[3];
+    c10 += a[1] * b[0]; c11 += a[1] * b[1]; c12 += a[1] * b[2]; c13 += a[1] * b[3];
+    c20 += a[2] * b[0]; c21 += a[2] * b[1]; c22 += a[2] * b[2]; c23 += a[2] * b[3];
+    c30 += a[3] * b[0]; c31 += a[3] * b[1]; c32 += a[3] * b[2]; c33 += a[3] * b[3];
+  }
+  double t[4][4] = { { c00, c01, c02, c03 }, { c10, c11, c12, c13 },
+                     { c20, c21, c22, c23 }, { c30, c31, c32, c33 } };
+  for (int i = 0; i < mr; i++)
+    for (int j = 0; j < nr; j++)
+      c[i*ldc + j] += t[i][j];
+}
 
-  // allocate a vector for the return value and pass
-  // it as an argument to the vectormap routine. 
-  AllocaInst *RetVal = Builder.CreateAlloca(DVecType);
-  ArgsV.push_back(RetVal);
+static void Gemm(const double *A, const double *B, double *C, 
+                 int m, int k, int n) {
+  std::fill(C, C + (size_t)m * n, 0.0);
+  const int T = HostThreads((int)std::min((double)m * k * n, 
+                               (double)std::numeric_limits<int>::max()));
+  const int mblocks = (m + GemmMC - 1) / GemmMC;
+  std::vector<double> Ap((size_t)T * GemmMC * GemmKC), 
+    Bp(GemmKC * (GemmNC + 3));
+  for (int jc = 0; jc < n; jc += GemmNC) {
+    int nc = std::min(GemmNC, n - jc);
+    for (int pc = 0; pc < k; pc += GemmKC) {
+      int kc = std::min(GemmKC, k - pc);
+
+      // Pack B[pc:pc+kc, jc:jc+nc] in strips of four columns.
+#pragma omp parallel for num_threads(T)
+      for (int j = 0; j < nc; j += 4)
+        for (int p = 0; p < kc; p++)
+          for (int jj = 0; jj < 4; jj++)
+            Bp[j*kc + p*4 + jj] = 
+              j + jj < nc ? B[(size_t)(pc + p) * n + jc + j + jj] : 0;
+
+#pragma omp parallel for num_threads(T)
+      for (int t = 0; t < T; t++) {
+        double *Apt = &Ap[(size_t)t * GemmMC * GemmKC];
+        for (int bi = HostBlockBegin(mblocks, T, t); 
+             bi < HostBlockBegin(mblocks, T, t + 1); bi++) {
+          int ic = bi * GemmMC, mc = std::min(GemmMC, m - ic);
+
+          // Pack A[ic:ic+mc, pc:pc+kc] in strips of four rows.
+          for (int i = 0; i < mc; i += 4)
+            for (int p = 0; p < kc; p++)
+              for (int ii = 0; ii < 4; ii++)
+                Apt[i*kc + p*4 + ii] = 
+                  i + ii < mc ? A[(size_t)(ic + i + ii) * k + pc + p] : 0;
+
+          for (int j = 0; j < nc; j += 4)
+            for (int i = 0; i < mc; i += 4)
+              GemmMicroKernel(kc, &Apt[i*kc], &Bp[j*kc], 
+                              &C[(size_t)(ic + i) * n + jc + j], n,
+                              std::min(4, mc - i), std::min(4, nc - j));
+        }
+      }
+    }
+  }
+}
 
-  // Allocate an array to hold the argument vectors.
-  Value *argsize = ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), CalleeF->arg_size());
-  AllocaInst *argsvect = Builder.CreateAlloca(DVecType, argsize);
-  Value *idx0 = ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), 0);
-  Value *idx1 = ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), 1);
+/// Products of at least this many multiply-adds go to the device, where the
+/// work outgrows copying the matrices; see CreateNVVMMatMulKernel.
+static const double MatMulDeviceWork = 1 << 24;
+static const unsigned MatMulTile = 16;
 
-  std::vector<unsigned> a0; a0.push_back(0);
-  std::vector<unsigned> a1; a1.push_back(1);
+/// vector_matmul -- matmul(a, b, m, k, n): the product of the m x k matrix
+/// a and the k x n matrix b, which are vectors holding their elements row 
+/// by row, as such an m x n vector.  Small products are computed by Gemm
+/// on the host threads, large ones on the device.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_matmul(DVector *vecs, double *nums, DVector *vres, double *dres,
+                   DVector **slots) {
+  static std::string Kernel;
+  static char *Ptx = 0;
+
+  DVector &a = vecs[0], &b = vecs[1];
+  int m = (int)std::max(nums[0], 0.0), k = (int)std::max(nums[1], 0.0);
+  int n = (int)std::max(nums[2], 0.0);
+  vres[0].length = m * n;
+  vres[0].ptr = AcquireVectorStorage(slots[0], m * n);
+  if (vres[0].ptr == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  if (a.length != m * k || b.length != k * n) {
+    fprintf(stderr, "Error: matmul needs an m x k and a k x n matrix\n");
+    std::fill(vres[0].ptr, vres[0].ptr + m * n, 0.0);
+    return;
+  }
 
-  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    Value *argi = Args[i]->Codegen();
-    
-    // extract arg pointer
-    Value *ptr  =  Builder.CreateExtractValue(argi, a0, "extr_ptr");   
+  if ((double)m * k * n < MatMulDeviceWork) {
+    SyncHostBuffer(a.ptr);
+    SyncHostBuffer(b.ptr);
+    Gemm(a.ptr, b.ptr, vres[0].ptr, m, k, n);
+    return;
+  }
 
-    // extract arg vector length
-    Value *length =  Builder.CreateExtractValue(argi, a1, "extr_len");
-    
-    // store ptr to argsvect
-    std::vector<Value *> indexp;
-    indexp.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), i));
-    indexp.push_back(idx0);
-    Value *gep = Builder.CreateGEP(argsvect, indexp, "gep");
-    Builder.CreateStore(ptr, gep);
-
-    // store length to argsvect
-    std::vector<Value *> indexp1;
-    indexp1.push_back(ConstantInt::get(IntegerType::getInt32Ty(getGlobalContext()), i));
-    indexp1.push_back(idx1);
-    Value *gep2 = Builder.CreateGEP(argsvect, indexp1, "gep");
-    Builder.CreateStore(length, gep2);
-  }
-  ArgsV.push_back(argsvect);
-
-  Function *MapF = TheModule->getFunction("vector_map");
-  Builder.CreateCall(MapF, ArgsV);
-
-  // return value is available in RetVal.
-  Value *retval = Builder.CreateLoad(RetVal,"result");
-  
-  Value *ptr  =  Builder.CreateExtractValue(retval, a0, "extr_ptr");
-  Value *len =  Builder.CreateExtractValue(retval, a1, "extr_len");
-
-  Value *DVec = UndefValue::get(DVecType);
-  DVec =  Builder.CreateInsertValue(DVec, ptr, a0, "ins_ptr") ;
-  DVec =  Builder.CreateInsertValue(DVec, len, a1, "ins_len") ;
-  return DVec;
+  if (Ptx == 0) {
+    Module *M = CloneModule(TheModule);
+    IRBuilderBase::InsertPoint IP = Builder.saveIP();
+    CreateNVVMMatMulKernel(M, MatMulTile, Builder, Kernel);
+    Builder.restoreIP(IP);
+    Ptx = BitCodeToPtx(M);
+    delete M;
+  }
+  LaunchMatMulOnGpu(Kernel.c_str(), Ptx, MatMulTile, m, k, n, a.ptr, b.ptr, 
+                    vres[0].ptr);
 }
 
-void 
-vector_map(char *name, DVector *res, DVector *args) { 
-  
-  Module *M = CloneModule(TheModule);
-  
-  // Look up the name in the global module table.
-  Function *CalleeF = M->getFunction(name);
-  if (CalleeF == NULL) {
-     ErrorP("Undefined function name");
-     return;
+/// SpmvChunk - The items of the merge path (see vector_spmv) a thread 
+/// handles at a time.
+static const int SpmvChunk = 1 << 14;
+
+/// SpmvPathSearch - The row at which diagonal diag crosses the merge path
+/// of the rows rows, which end before entries ends[0] to ends[rows - 1], 
+/// and the entries first to first + entries - 1: the path takes a step 
+/// down a row when the next entry is not in it, and a step along an entry
+/// when it is.  The entry at the crossing is first + diag - row.
+static int SpmvPathSearch(const double *ends, int rows, int first, 
+                          int entries, int diag) {
+  int lo = std::max(diag - entries, 0), hi = std::min(diag, rows);
+  while (lo < hi) {
+    int pivot = (lo + hi) / 2;
+    if ((int)ends[pivot] <= first + diag - pivot - 1)
+      lo = pivot + 1;
+    else
+      hi = pivot;
   }
+  return lo;
+}
 
-  unsigned arity = CalleeF->arg_size();
+/// vector_spmv -- spmv(A, x): the product of the sparse matrix A, in CSR 
+/// format (see BuiltinInfo), and the vector x.  Row r of A has the values
+/// values[offsets[r]] to values[offsets[r+1] - 1], in the columns the same
+/// elements of columns give, so A has one row less than offsets has 
+/// elements.  Entries outside columns, values or x are skipped, with an 
+/// error.  Like the level 1 operations, it does a multiply-add per entry 
+/// read, so it runs on the host, where the matrix is: copying it to the 
+/// device would take longer than the product (see BLAS-1).
+///
+/// The rows and entries are split among the host threads along their 
+/// merge path (Merrill and Garland), which is a step per row and per entry,
+/// into chunks of SpmvChunk steps found by SpmvPathSearch.  A chunk thus 
+/// costs the same however the entries are spread over the rows, and a long
+/// row is shared by several chunks: each adds the part it reaches into a 
+/// carry, and the carries are added to the row in chunk order at the end.
+/// The sums depend on the matrix only, not on the number of threads.  
+/// Offsets that go outside the entries or decrease take a serial loop over
+/// the rows instead.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_spmv(DVector *vecs, double *nums, DVector *vres, double *dres,
+                 DVector **slots) {
+  DVector &offsets = vecs[0], &columns = vecs[1], &values = vecs[2];
+  DVector &x = vecs[3];
+  for (unsigned i = 0; i < 4; i++)
+    SyncHostBuffer(vecs[i].ptr);
+  int rows = std::max(offsets.length - 1, 0);
+  vres[0].length = rows;
+  double *y = vres[0].ptr = AcquireVectorStorage(slots[0], rows);
+  if (y == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  if (rows == 0)
+    return;
+
+  int nnz = std::min(columns.length, values.length);
+  const double *ends = offsets.ptr + 1;
+  int first = (int)offsets.ptr[0];
+  int unsorted = first < 0 || (int)ends[rows - 1] > nnz;
+#pragma omp parallel for num_threads(HostThreads(rows)) reduction(|:unsorted)
+  for (int r = 0; r < rows; r++)
+    unsorted |= (int)ends[r] < (int)offsets.ptr[r];
+
+  int bad = 0;
+  if (!unsorted) {
+    int entries = (int)ends[rows - 1] - first, steps = rows + entries;
+    int nchunks = (steps + SpmvChunk - 1) / SpmvChunk;
+    std::vector<int> carryRow(nchunks);
+    std::vector<double> carry(nchunks);
+#pragma omp parallel for num_threads(HostThreads(steps)) reduction(|:bad)
+    for (int c = 0; c < nchunks; c++) {
+      int d = c * SpmvChunk, dend = std::min(steps, d + SpmvChunk);
+      int r = SpmvPathSearch(ends, rows, first, entries, d);
+      int rend = SpmvPathSearch(ends, rows, first, entries, dend);
+      int j = first + d - r, jend = first + dend - rend;
+      double s = 0;
+      for (; r <= rend; r++) {
+        int end = r < rend ? (int)ends[r] : jend;
+        for (; j < end; j++) {
+          int col = (int)columns.ptr[j];
+          if (col < 0 || col >= x.length) {
+            bad = 1;
+            continue;
+          }
+          s += values.ptr[j] * x.ptr[col];
+        }
+        if (r < rend) {
+          y[r] = s;
+          s = 0;
+        }
+      }
+      carryRow[c] = rend;
+      carry[c] = s;
+    }
+    for (int c = 0; c < nchunks; c++)
+      if (carryRow[c] < rows)
+        y[carryRow[c]] += carry[c];
+  } else {
+    for (int r = 0; r < rows; r++) {
+      int begin = (int)offsets.ptr[r], end = (int)ends[r];
+      if (begin < 0 || end > nnz) {
+        bad = 1;
+        begin = std::max(begin, 0);
+        end = std::min(end, nnz);
+      }
+      double s = 0;
+      for (int j = begin; j < end; j++) {
+        int c = (int)columns.ptr[j];
+        if (c < 0 || c >= x.length) {
+          bad = 1;
+          continue;
+        }
+        s += values.ptr[j] * x.ptr[c];
+      }
+      y[r] = s;
+    }
+  }
+  if (bad)
+    fprintf(stderr, "Error: spmv skipped entries outside the matrix or x\n");
+}
 
-  void **argsbuf = (void **) malloc(sizeof(void *)*arity);
-  unsigned pos;
-  
-  for (pos = 0; pos < arity; pos++) 
-    argsbuf[pos] = args[pos].ptr;
-  
-  res->length = args[0].length;
-  res->ptr = (double *) malloc(res->length * sizeof(double));  
-  
-  if (res->ptr == NULL) { 
-     fprintf(stderr,"Could not allocate host memory\n" );
-     return ;
-  } 
-  std::string kernel; 
-  CreateNVVMMapKernel(M, CalleeF, Builder, kernel); 
-  char *ptxBuff = BitCodeToPtx(M);
- 
-  LaunchOnGpu(kernel.c_str(), arity, res->length, argsbuf, res->ptr, ptxBuff);
-} 
+/// Builtins - The vector library, see BuiltinInfo.
+static const BuiltinInfo Builtins[] = {
+  { "sort",      "v",     "v",  "vector_sort",        vector_sort },
+  { "sortByKey", "vv",    "vv", "vector_sort_by_key", vector_sort_by_key },
+  { "topk",      "vd",    "vv", "vector_topk",        vector_topk },
+  { "quantile",  "vd",    "d",  "vector_quantile",    vector_quantile },
+  { "histogram", "vddd",  "v",  "vector_histogram",   vector_histogram },
+  { "groupAgg",  "vvo",   "vv", "vector_group_agg",   vector_group_agg },
+  { "dot",       "vv",    "d",  "vector_dot",         vector_dot },
+  { "nrm2",      "v",     "d",  "vector_nrm2",        vector_nrm2 },
+  { "asum",      "v",     "d",  "vector_asum",        vector_asum },
+  { "axpy",      "dvv",   "v",  "vector_axpy",        vector_axpy },
+  { "scal",      "dv",    "v",  "vector_scal",        vector_scal },
+  { "matmul",    "vvddd", "v",  "vector_matmul",      vector_matmul },
+  { "spmv",      "mv",    "v",  "vector_spmv",        vector_spmv },
+};
 
+static const BuiltinInfo *FindBuiltin(const std::string &Name) {
+  for (unsigned i = 0; i < sizeof(Builtins) / sizeof(Builtins[0]); i++)
+    if (Name == Builtins[i].Name)
+      return &Builtins[i];
+  return 0;
+}
+
+/// GetCallee - If E is a call (including to a user-defined operator), set
+/// CalleeF to the function it calls, or null if that does not exist yet, and
+/// return true.
+static bool GetCallee(ExprAST *E, Function *&CalleeF) {
+  if (CallExprAST *C = dynamic_cast<CallExprAST*>(E)) {
+    CalleeF = TheModule->getFunction(C->getCallee());
+    return true;
+  }
+  if (UnaryExprAST *U = dynamic_cast<UnaryExprAST*>(E)) {
+    CalleeF = TheModule->getFunction(std::string("unary") + U->getOpcode());
+    return true;
+  }
+  BinaryExprAST *B = dynamic_cast<BinaryExprAST*>(E);
+  if (B && B->isUserDefined()) {
+    CalleeF = TheModule->getFunction(std::string("binary") + B->getOp());
+    return true;
+  }
+  return false;
+}
+
+/// IsPureExpr - Return true if E only computes a value from its operands: it
+/// touches no vectors, contains no loops and only calls functions that do 
+/// not access memory.  Those are marked so only if their body is pure, so 
+/// they contain no loops either, and callers may speculate or CSE calls to
+/// them without risking a loop that never ends.  Assigning its own 
+/// variables is fine.
+static bool IsPureExpr(ExprAST *E) {
+  if (dynamic_cast<MapExprAST*>(E) || dynamic_cast<MapBatchExprAST*>(E) ||
+      dynamic_cast<GeneratorExprAST*>(E) || dynamic_cast<GlobalVectorAST*>(E) ||
+      dynamic_cast<GlobalScalarsAST*>(E) || dynamic_cast<StatsExprAST*>(E) ||
+      dynamic_cast<BuiltinExprAST*>(E) || dynamic_cast<ForExprAST*>(E))
+    return false;
+
+  // Session globals are memory that may change between calls.
+  VariableExprAST *V = dynamic_cast<VariableExprAST*>(E);
+  if (V && TheModule->getNamedGlobal(V->getName()))
+    return false;
+
+  if (VarExprAST *VE = dynamic_cast<VarExprAST*>(E))
+    for (unsigned i = 0, e = VE->getNumVars(); i != e; ++i)
+      if (VE->isVectorVar(i))
+        return false;
+
+  Function *CalleeF;
+  if (GetCallee(E, CalleeF) && (!CalleeF || !CalleeF->doesNotAccessMemory()))
+    return false;
+
+  std::vector<ExprAST*> Kids;
+  E->getChildren(Kids);
+  for (unsigned i = 0, e = Kids.size(); i != e; ++i)
+    if (!IsPureExpr(Kids[i]))
+      return false;
+  return true;
+}
+
+/// IsSpeculatable - Return true if E may be evaluated even when its value is
+/// not needed: it assigns nothing, calls only functions that do not access
+/// memory, which contain no loops (see IsPureExpr), and contains no loops 
+/// or vector operations itself.  Vectors it yields must be borrowed from a
+/// variable: an owned one, like a tuple of vectors, would leak in the arm
+/// not selected.  Cost accumulates a rough count of the instructions 
+/// evaluating it takes.
+static bool IsSpeculatable(ExprAST *E, unsigned &Cost) {
+  if (dynamic_cast<NumberExprAST*>(E) || dynamic_cast<VariableExprAST*>(E))
+    return true;
+  if (HoldsVectors(E->getType()))
+    return false;
+
+  Function *CalleeF;
+  if (GetCallee(E, CalleeF)) {
+    if (!CalleeF || !CalleeF->doesNotAccessMemory())
+      return false;
+
+    // Externs are library routines of unknown but moderate size; user
+    // functions are small and already optimized, so count their body.
+    unsigned CallCost = 4;
+    for (Function::iterator BB = CalleeF->begin(), BE = CalleeF->end(); 
+         BB != BE; ++BB)
+      CallCost += BB->size();
+    Cost += CallCost;
+  }
+  else if (BinaryExprAST *B = dynamic_cast<BinaryExprAST*>(E)) {
+    if (B->getOp() == '=')
+      return false;
+    Cost += 1;
+  }
+  else if (dynamic_cast<IfExprAST*>(E)) {
+    Cost += 1;
+  }
+  else if (dynamic_cast<TupleExprAST*>(E) || dynamic_cast<ElementExprAST*>(E)) {
+    // Just moves values around.
+  }
+  else {
+    // map, for and var
+    return false;
+  }
+
+  std::vector<ExprAST*> Kids;
+  E->getChildren(Kids);
+  for (unsigned i = 0, e = Kids.size(); i != e; ++i)
+    if (!IsSpeculatable(Kids[i], Cost))
+      return false;
+  return true;
+}
+
+/// shouldSelect - Return true if this if should be emitted branch-free, as a
+/// select of both arms.  That avoids divergence in map kernels and keeps the
+/// control flow simple enough to vectorize, at the price of always
+/// evaluating both arms, so the arms must be free of side effects and, unless
+/// forced with -if-convert=always, cheap.
+bool IfExprAST::shouldSelect() const {
+  if (IfConversion == IfConvertNever)
+    return false;
+
+  unsigned Cost = 0;
+  if (!IsSpeculatable(Then, Cost) || !IsSpeculatable(Else, Cost))
+    return false;
+  return IfConversion == IfConvertAlways || Cost <= IfConversionThreshold;
+}
 
 Value *IfExprAST::Codegen() {
   Value *CondV = Cond->Codegen();
@@ -955,6 +4668,21 @@ Value *IfExprAST::Codegen() {
   CondV = Builder.CreateFCmpONE(CondV, 
                               ConstantFP::get(getGlobalContext(), APFloat(0.0)),
                                 "ifcond");
+
+  if (shouldSelect()) {
+    Value *ThenV = Then->Codegen();
+    if (ThenV == 0) return 0;
+    Value *ElseV = Else->Codegen();
+    if (ElseV == 0) return 0;
+
+    // Speculatable arms can only borrow vectors from variables (see
+    // IsSpeculatable), take a reference for the consumer like the PHI below
+    // would have.
+    Value *V = Builder.CreateSelect(CondV, ThenV, ElseV, "iftmp");
+    if (HoldsVectors(V->getType()))
+      EmitVectorRetain(V);
+    return V;
+  }
   
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
   
@@ -969,7 +4697,9 @@ Value *IfExprAST::Codegen() {
   // Emit then value.
   Builder.SetInsertPoint(ThenBB);
   
-  Value *ThenV = Then->Codegen();
+  // If the arms yield vectors, both must hand the same kind of reference to
+  // the PHI, so make them both owned.
+  Value *ThenV = CodegenOwned(Then);
   if (ThenV == 0) return 0;
   
   Builder.CreateBr(MergeBB);
@@ -980,7 +4710,7 @@ Value *IfExprAST::Codegen() {
   TheFunction->getBasicBlockList().push_back(ElseBB);
   Builder.SetInsertPoint(ElseBB);
   
-  Value *ElseV = Else->Codegen();
+  Value *ElseV = CodegenOwned(Else);
   if (ElseV == 0) return 0;
   
   Builder.CreateBr(MergeBB);
@@ -990,14 +4720,172 @@ Value *IfExprAST::Codegen() {
   // Emit merge block.
   TheFunction->getBasicBlockList().push_back(MergeBB);
   Builder.SetInsertPoint(MergeBB);
-  PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(getGlobalContext()), 2,
-                                  "iftmp");
+  PHINode *PN = Builder.CreatePHI(ThenV->getType(), 2, "iftmp");
   
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
   return PN;
 }
 
+/// CollectVariables - Add the names of all variables E refers to to Names.
+static void CollectVariables(ExprAST *E, std::set<std::string> &Names) {
+  if (VariableExprAST *V = dynamic_cast<VariableExprAST*>(E))
+    Names.insert(V->getName());
+
+  std::vector<ExprAST*> Kids;
+  E->getChildren(Kids);
+  for (unsigned i = 0, e = Kids.size(); i != e; ++i)
+    CollectVariables(Kids[i], Names);
+}
+
+/// AllMemory - Stands in a set of clobbered variables for every session 
+/// global and the contents of every vector, see CollectClobbered.  No 
+/// variable has an empty name.
+static const char *const AllMemory = "";
+
+/// CollectClobbered - Add to Names every variable whose value, or whose vector
+/// contents, evaluating E may change: variables E assigns or binds, anything
+/// an assignment or initializer may make an alias of, and variables passed to
+/// functions, which may write to a vector argument like randVector does.
+/// Calls to functions that access memory, other than externs known to only 
+/// read vectors, may write any global or vector they can reach, so they add
+/// AllMemory.  map only reads its arguments.
+static void CollectClobbered(ExprAST *E, std::set<std::string> &Names) {
+  bool PassesArgs = dynamic_cast<CallExprAST*>(E) || 
+                    dynamic_cast<UnaryExprAST*>(E);
+
+  Function *CalleeF;
+  if (GetCallee(E, CalleeF) && 
+      (!CalleeF || (!CalleeF->doesNotAccessMemory() && 
+                    (!CalleeF->empty() || MayWriteVectorArgs(CalleeF)))))
+    Names.insert(AllMemory);
+
+  if (BinaryExprAST *B = dynamic_cast<BinaryExprAST*>(E)) {
+    PassesArgs = B->isUserDefined();
+    if (B->getOp() == '=') {
+      CollectVariables(B->getLHS(), Names);
+      CollectVariables(B->getRHS(), Names);
+    }
+  } 
+  else if (ForExprAST *F = dynamic_cast<ForExprAST*>(E)) {
+    Names.insert(F->getVarName());
+  } 
+  else if (VarExprAST *V = dynamic_cast<VarExprAST*>(E)) {
+    for (unsigned i = 0, e = V->getNumVars(); i != e; ++i)
+      Names.insert(V->getVarName(i));
+  }
+
+  std::vector<ExprAST*> Kids;
+  E->getChildren(Kids);
+  for (unsigned i = 0, e = Kids.size(); i != e; ++i) {
+    VariableExprAST *Arg = dynamic_cast<VariableExprAST*>(Kids[i]);
+    if (PassesArgs && Arg)
+      Names.insert(Arg->getName());
+    CollectClobbered(Kids[i], Names);
+  }
+}
+
+/// IsLoopInvariantVector - Return true if E yields the same vector contents
+/// on every iteration of a loop that clobbers the variables in Clobbered.
+static bool IsLoopInvariantVector(ExprAST *E, 
+                                  const std::set<std::string> &Clobbered) {
+  if (VariableExprAST *V = dynamic_cast<VariableExprAST*>(E))
+    return !Clobbered.count(V->getName()) && !Clobbered.count(AllMemory) &&
+           NamedValues[V->getName()] != 0;
+
+  // A map also depends on the session globals its function reads.
+  if (MapExprAST *M = dynamic_cast<MapExprAST*>(E)) {
+    Function *CalleeF = TheModule->getFunction(M->getCallee());
+    if (CalleeF == 0)
+      return false;
+    std::set<std::string> Read, Written;
+    std::set<Function*> Visited;
+    CollectGlobalAccesses(CalleeF, Read, Written, Visited);
+    for (std::set<std::string>::iterator I = Read.begin(), IE = Read.end(); 
+         I != IE; ++I)
+      if (Clobbered.count(*I) || Clobbered.count(AllMemory))
+        return false;
+
+    const std::vector<ExprAST*> &Args = M->getArgs();
+    for (unsigned i = 0, e = Args.size(); i != e; ++i)
+      if (!IsLoopInvariantVector(Args[i], Clobbered))
+        return false;
+    return true;
+  }
+
+  // A generated vector only depends on its scalar arguments.
+  if (GeneratorExprAST *G = dynamic_cast<GeneratorExprAST*>(E)) {
+    const std::vector<ExprAST*> &Args = G->getArgs();
+    std::set<std::string> Read;
+    for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+      if (!IsPureExpr(Args[i]))
+        return false;
+      CollectVariables(Args[i], Read);
+    }
+    for (std::set<std::string>::iterator I = Read.begin(), IE = Read.end(); 
+         I != IE; ++I)
+      if (Clobbered.count(*I) || NamedValues[*I] == 0)
+        return false;
+    return true;
+  }
+
+  return false;
+}
+
+/// HoistLoopInvariants - With the insertion point in a loop preheader, emit
+/// the maps in the loop body E whose inputs do not change across iterations,
+/// and allocate the heap vectors it declares with an invariant length.  The
+/// body then reuses the results; HoistedMaps and HoistedVars record what has
+/// to be released after the loop.  Only what runs on every iteration is 
+/// hoisted: not the arms of an if, nor the body of a nested loop, which may
+/// run no times and hoists its own invariants.
+static void HoistLoopInvariants(ExprAST *E, 
+                                const std::set<std::string> &Clobbered,
+                                std::vector<MapExprAST*> &HoistedMaps,
+                                std::vector<std::pair<VarExprAST*, unsigned> > &HoistedVars) {
+  if (MapExprAST *M = dynamic_cast<MapExprAST*>(E)) {
+    // Already hoisted out of an enclosing loop.
+    if (M->getHoisted())
+      return;
+
+    if (IsLoopInvariantVector(M, Clobbered)) {
+      if (Value *V = M->Codegen()) {
+        M->setHoisted(V);
+        HoistedMaps.push_back(M);
+      }
+      return;
+    }
+  }
+
+  if (VarExprAST *VE = dynamic_cast<VarExprAST*>(E)) {
+    for (unsigned i = 0, e = VE->getNumVars(); i != e; ++i)
+      if (VE->hoistStorage(i, Clobbered))
+        HoistedVars.push_back(std::make_pair(VE, i));
+  }
+
+  std::vector<ExprAST*> Kids;
+  if (IfExprAST *If = dynamic_cast<IfExprAST*>(E))
+    Kids.push_back(If->getCond());
+  else if (ForExprAST *F = dynamic_cast<ForExprAST*>(E)) {
+    Kids.push_back(F->getStart());
+    Kids.push_back(F->getEnd());
+  } else
+    E->getChildren(Kids);
+  for (unsigned i = 0, e = Kids.size(); i != e; ++i)
+    HoistLoopInvariants(Kids[i], Clobbered, HoistedMaps, HoistedVars);
+}
+
+/// EmitLoopCondition - Emit the end condition End of a loop as a bool.
+static Value *EmitLoopCondition(ExprAST *End) {
+  Value *EndCond = End->Codegen();
+  if (EndCond == 0) return 0;
+  
+  // Convert condition to a bool by comparing equal to 0.0.
+  return Builder.CreateFCmpONE(EndCond, 
+                               ConstantFP::get(getGlobalContext(), APFloat(0.0)),
+                               "loopcond");
+}
+
 // MJH Note: the semantics of for loops are changed here relative to the 
 // original Kaleidoscope example because in the original, for loops ran
 // for one extra iteration compared to loops in other languages like C. See
@@ -1008,10 +4896,11 @@ Value *ForExprAST::Codegen() {
   //   ...
   //   start = startexpr
   //   store start -> var
-  //   br loopstart
-  // loopstart: 
   //   endcond = endexpr
-  //   br endcond, loopbody, loopexit
+  //   br endcond, preheader, loopexit
+  // preheader:
+  //   hoisted invariants
+  //   br loopbody
   // loopbody:
   //   ...
   //   bodyexpr
@@ -1020,8 +4909,16 @@ Value *ForExprAST::Codegen() {
   //   curvar = load var
   //   nextvar = curvar + step
   //   store nextvar -> var
-  //   br loopstart
+  //   endcond = endexpr
+  //   br endcond, loopbody, loopend
+  // loopend:
+  //   release hoisted invariants
+  //   br loopexit
   // loopexit:
+  //
+  // The end condition is tested before every iteration as before, but the 
+  // first test is emitted ahead of the loop, so the preheader only runs if
+  // the body does.
   
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
@@ -1034,37 +4931,35 @@ Value *ForExprAST::Codegen() {
   
   // Store the value into the alloca.
   Builder.CreateStore(StartVal, Alloca);
-  
-  // Make the new basic block for the loop header, inserting after current
-  // block.
-  BasicBlock *LoopStartBB = BasicBlock::Create(getGlobalContext(), "loopstart", TheFunction);
-  
-  // Insert an explicit fall through from the current block to the LoopBB.
-  Builder.CreateBr(LoopStartBB);
 
-  // Start insertion in LoopBB.
-  Builder.SetInsertPoint(LoopStartBB);
-  
   // Within the loop, the variable is defined equal to the PHI node.  If it
   // shadows an existing variable, we have to restore it, so save it now.
   AllocaInst *OldVal = NamedValues[VarName];
   NamedValues[VarName] = Alloca;
 
-  // Compute the end condition.
-  Value *EndCond = End->Codegen();
-  if (EndCond == 0) return EndCond;
-  
-  // Convert condition to a bool by comparing equal to 0.0.
-  EndCond = Builder.CreateFCmpONE(EndCond, 
-                                  ConstantFP::get(getGlobalContext(), APFloat(0.0)),
-                                  "loopcond");
-  
-  // Create the "loop body" and "loop exit" blocks.
+  BasicBlock *PreheaderBB = BasicBlock::Create(getGlobalContext(), "preheader", TheFunction);
   BasicBlock *LoopBodyBB = BasicBlock::Create(getGlobalContext(), "loopbody", TheFunction);
+  BasicBlock *LoopEndBB = BasicBlock::Create(getGlobalContext(), "loopend", TheFunction);
   BasicBlock *LoopExitBB = BasicBlock::Create(getGlobalContext(), "loopexit", TheFunction);
 
-  // Insert the conditional branch into the end of LoopEndBB.
-  Builder.CreateCondBr(EndCond, LoopBodyBB, LoopExitBB);
+  // Test whether to run the loop at all.
+  Value *EndCond = EmitLoopCondition(End);
+  if (EndCond == 0) return 0;
+  Builder.CreateCondBr(EndCond, PreheaderBB, LoopExitBB);
+
+  // Compute the vector work of the body that is the same on every iteration
+  // up front, in the preheader.
+  Builder.SetInsertPoint(PreheaderBB);
+  std::set<std::string> Clobbered;
+  Clobbered.insert(VarName);
+  CollectClobbered(End, Clobbered);
+  if (Step) CollectClobbered(Step, Clobbered);
+  CollectClobbered(Body, Clobbered);
+
+  std::vector<MapExprAST*> HoistedMaps;
+  std::vector<std::pair<VarExprAST*, unsigned> > HoistedVars;
+  HoistLoopInvariants(Body, Clobbered, HoistedMaps, HoistedVars);
+  Builder.CreateBr(LoopBodyBB);
 
   // Set insertion point to the loop body block
   Builder.SetInsertPoint(LoopBodyBB);
@@ -1072,8 +4967,11 @@ Value *ForExprAST::Codegen() {
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
   // allow an error.
-  if (Body->Codegen() == 0)
+  Value *BodyVal = Body->Codegen();
+  if (BodyVal == 0)
     return 0;
+  if (Body->isTemporary(BodyVal))
+    EmitVectorRelease(BodyVal);
   
   // Emit the step value.
   Value *StepVal;
@@ -1091,9 +4989,26 @@ Value *ForExprAST::Codegen() {
   Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
   Builder.CreateStore(NextVar, Alloca);
   
-  // Create a branch back to the start of the loop
-  Builder.CreateBr(LoopStartBB);
+  // Test whether to run another iteration.
+  EndCond = EmitLoopCondition(End);
+  if (EndCond == 0) return 0;
+  Builder.CreateCondBr(EndCond, LoopBodyBB, LoopEndBB);
   
+  // Release what was hoisted out of the body.
+  Builder.SetInsertPoint(LoopEndBB);
+  for (unsigned i = 0, e = HoistedMaps.size(); i != e; ++i) {
+    EmitVectorRelease(HoistedMaps[i]->getHoisted());
+    HoistedMaps[i]->setHoisted(0);
+  }
+  for (unsigned i = 0, e = HoistedVars.size(); i != e; ++i) {
+    VarExprAST *VE = HoistedVars[i].first;
+    unsigned Idx = HoistedVars[i].second;
+    Builder.CreateCall(TheModule->getFunction("vector_free"), 
+                       VE->getHoistedStorage(Idx));
+    VE->clearHoistedStorage(Idx);
+  }
+  Builder.CreateBr(LoopExitBB);
+
   // Any new code will be inserted in "loopexit" block.
   Builder.SetInsertPoint(LoopExitBB);
   
@@ -1107,8 +5022,100 @@ Value *ForExprAST::Codegen() {
   return Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));
 }
 
+/// MaxInlineVectorLength - Longest constant-length 'var vector' that is given
+/// storage in the stack frame rather than on the heap.
+static const unsigned MaxInlineVectorLength = 64;
+
+/// VectorMayEscape - Return true if the vector variable Name could still be
+/// referenced once E has been evaluated: E yields it as its value, assigns
+/// to it, or passes it to a function with a body (which may return it or
+/// store it).  map and externs only read their vector arguments in the call.
+static bool VectorMayEscape(ExprAST *E, const std::string &Name) {
+  if (VariableExprAST *V = dynamic_cast<VariableExprAST*>(E))
+    return V->getName() == Name;
+
+  bool BorrowsArgs = dynamic_cast<MapExprAST*>(E) != 0;
+  if (CallExprAST *C = dynamic_cast<CallExprAST*>(E)) {
+    Function *CalleeF = TheModule->getFunction(C->getCallee());
+    BorrowsArgs = CalleeF && CalleeF->empty();
+  }
+
+  std::vector<ExprAST*> Kids;
+  E->getChildren(Kids);
+  for (unsigned i = 0, e = Kids.size(); i != e; ++i) {
+    if (BorrowsArgs && dynamic_cast<VariableExprAST*>(Kids[i]))
+      continue;
+    if (VectorMayEscape(Kids[i], Name))
+      return true;
+  }
+  return false;
+}
+
+/// mayEscape - Return true if the vector bound by the i'th variable could be
+/// referenced after this expression has been evaluated.
+bool VarExprAST::mayEscape(unsigned i) const {
+  const std::string &Name = Variables[i].first->getName();
+
+  // The variable is in scope in the body and in later initializers.
+  for (unsigned j = i + 1, e = Variables.size(); j != e; ++j) {
+    VariableExprAST *Later = Variables[j].first;
+    if (Later->isVector() && VectorMayEscape(Later->getLength(), Name))
+      return true;
+    if (Variables[j].second && VectorMayEscape(Variables[j].second, Name))
+      return true;
+  }
+  return VectorMayEscape(Body, Name);
+}
+
+/// isInlineVector - Return true if the i'th variable is a vector with a small
+/// constant length that cannot outlive this expression, so that its storage
+/// can be an alloca instead of a vector_malloc'd buffer.
+bool VarExprAST::isInlineVector(unsigned i) const {
+  VariableExprAST *Variable = Variables[i].first;
+  if (!Variable->isVector())
+    return false;
+
+  NumberExprAST *Length = dynamic_cast<NumberExprAST*>(Variable->getLength());
+  if (!Length || Length->getVal() < 1 || Length->getVal() > MaxInlineVectorLength)
+    return false;
+
+  return !mayEscape(i);
+}
+
+/// hoistStorage - Called with the insertion point in the preheader of an
+/// enclosing loop.  If the i'th variable is a heap vector whose length is the
+/// same on every iteration and that cannot escape, allocate it here so that
+/// all iterations share one buffer, and return its storage.
+AllocaInst *VarExprAST::hoistStorage(unsigned i, 
+                                     const std::set<std::string> &Clobbered) {
+  VariableExprAST *Variable = Variables[i].first;
+  if (!Variable->isVector() || HoistedStorage[i] || isInlineVector(i) || 
+      mayEscape(i))
+    return 0;
+
+  ExprAST *Length = Variable->getLength();
+  if (!dynamic_cast<NumberExprAST*>(Length)) {
+    VariableExprAST *LengthVar = dynamic_cast<VariableExprAST*>(Length);
+    if (!LengthVar || Clobbered.count(LengthVar->getName()) ||
+        NamedValues[LengthVar->getName()] == 0)
+      return 0;
+  }
+
+  Value *LengthValFP = Length->Codegen();
+  if (LengthValFP == 0) return 0;
+
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Variable->getName(), true);
+  Function *DVecMalloc = TheModule->getFunction("vector_malloc");
+  Builder.CreateCall2(DVecMalloc, Alloca, LengthValFP);
+
+  HoistedStorage[i] = Alloca;
+  return Alloca;
+}
+
 Value *VarExprAST::Codegen() {
   std::vector<AllocaInst *> OldBindings;
+  std::vector<bool> Inline;
   
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
@@ -1123,7 +5130,7 @@ Value *VarExprAST::Codegen() {
     //    var a = a in ...   # refers to outer 'a'.
     Value *InitVal;
     if (Init) {
-      InitVal = Init->Codegen();
+      InitVal = CodegenOwned(Init);
       if (InitVal == 0) return 0;
     } else { // If not specified, use 0.0.
       InitVal = ConstantFP::get(getGlobalContext(), APFloat(0.0));
@@ -1132,7 +5139,35 @@ Value *VarExprAST::Codegen() {
     AllocaInst *Alloca = 0;
     VariableExprAST *Variable = Variables[i].first;
 
-    if (Variable->isVector()) {
+    Inline.push_back(isInlineVector(i));
+    if (Inline.back()) {
+      // Carve the header and elements out of the entry block's stack frame.
+      unsigned Length = 
+        (unsigned)((NumberExprAST*)Variable->getLength())->getVal();
+      ArrayType *StorageTy = ArrayType::get(DoubleType, VectorHeaderDoubles + Length);
+      IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                       TheFunction->getEntryBlock().begin());
+      AllocaInst *Storage = TmpB.CreateAlloca(StorageTy, 0, 
+                                              Variable->getName() + ".storage");
+      Alloca = CreateEntryBlockAlloca(TheFunction, Variable->getName(), true);
+
+      Value *Elts = Builder.CreateConstGEP2_32(Storage, 0, VectorHeaderDoubles, "elts");
+      Value *LengthVal = ConstantInt::get(Type::getInt32Ty(getGlobalContext()), Length);
+      Function *DVecInit = TheModule->getFunction("vector_init_inline");
+      Builder.CreateCall2(DVecInit, Elts, LengthVal);
+
+      std::vector<unsigned> a0; a0.push_back(0);
+      std::vector<unsigned> a1; a1.push_back(1);
+      Value *DVec = UndefValue::get(DVecType);
+      DVec = Builder.CreateInsertValue(DVec, Elts, a0, "ins_ptr");
+      DVec = Builder.CreateInsertValue(DVec, LengthVal, a1, "ins_len");
+      Builder.CreateStore(DVec, Alloca);
+    }
+    else if (HoistedStorage[i]) {
+      // Allocated once before the enclosing loop, see hoistStorage.
+      Alloca = HoistedStorage[i];
+    }
+    else if (Variable->isVector()) {
       Value *LengthValFP = Variable->getLength()->Codegen(); 
       Alloca = CreateEntryBlockAlloca(TheFunction, Variable->getName(), true);
       std::vector<Value*> ArgsV;
@@ -1143,7 +5178,10 @@ Value *VarExprAST::Codegen() {
       Builder.CreateCall(DVecMalloc, ArgsV);
     }
     else {
-      Alloca = CreateEntryBlockAlloca(TheFunction, Variable->getName(), false);
+      // Takes the type of its initializer, which may be a tuple or, for a
+      // map, (a tuple of) vectors.
+      Alloca = CreateEntryBlockAlloca(TheFunction, Variable->getName(), 
+                                      InitVal->getType());
       Builder.CreateStore(InitVal, Alloca);
     }   
 
@@ -1155,20 +5193,27 @@ Value *VarExprAST::Codegen() {
     NamedValues[Variable->getName()] = Alloca;
   }
   
-  // Codegen the body, now that all vars are in scope.
-  Value *BodyVal = Body->Codegen();
+  // Codegen the body, now that all vars are in scope.  If it yields one of
+  // the vectors freed below, the result needs its own reference.
+  Value *BodyVal = CodegenOwned(Body);
   if (BodyVal == 0) return 0;
  
   // Free vectors and Pop all our variables from scope.
   for (unsigned i = 0, e = Variables.size(); i != e; ++i) {
+    AllocaInst *Alloca = NamedValues[Variables[i].first->getName()];
+
     // Create call to free vectors
-    if (Variables[i].first->isVector()) {
+    if (Variables[i].first->isVector() && !Inline[i] && !HoistedStorage[i]) {
       std::vector<Value*> ArgsV;
-      ArgsV.push_back(NamedValues[Variables[i].first->getName()]);
+      ArgsV.push_back(Alloca);
 
       Function *DVecFree = TheModule->getFunction("vector_free");
       Builder.CreateCall(DVecFree, ArgsV);
     }
+    else if (!Variables[i].first->isVector() && 
+             HoldsVectors(Alloca->getAllocatedType())) {
+      EmitVectorRelease(Builder.CreateLoad(Alloca));
+    }
 
     NamedValues[Variables[i].first->getName()] = OldBindings[i];
   }
@@ -1222,13 +5267,53 @@ void PrototypeAST::CreateArgumentAllocas(Function *F) {
     // Store the initial value into the alloca.
     Builder.CreateStore(AI, Alloca);
 
+    // Vector arguments are borrowed from the caller; take a reference so the
+    // body can treat them like any other vector variable.
+    if (FormalTypes[Idx] == DVecType)
+      EmitVectorRetain(AI);
+
     // Add arguments to variable symbol table.
     NamedValues[Args[Idx]] = Alloca;
   }
 }
 
+/// ReleaseVectorArguments - Drop the references CreateArgumentAllocas took to
+/// the vector arguments.
+void PrototypeAST::ReleaseVectorArguments() {
+  for (unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx) {
+    if (FormalTypes[Idx] != DVecType)
+      continue;
+    EmitVectorRelease(Builder.CreateLoad(NamedValues[Args[Idx]], 
+                                         Args[Idx].c_str()));
+  }
+}
+
+/// EmitPrintResult - Emit a call printing V, the value of a top-level
+/// expression that is a vector or a tuple, see vector_print.
+static void EmitPrintResult(Value *V) {
+  Type *Int32Ty = IntegerType::getInt32Ty(getGlobalContext());
+  ArrayType *AT = dyn_cast<ArrayType>(V->getType());
+  unsigned N = AT ? AT->getNumElements() : 1;
+  Type *EltTy = AT ? AT->getElementType() : V->getType();
+
+  Value *Elts = Builder.CreateAlloca(EltTy, ConstantInt::get(Int32Ty, N));
+  for (unsigned i = 0; i != N; ++i) {
+    Value *Elt = AT ? Builder.CreateExtractValue(V, std::vector<unsigned>(1, i))
+                    : V;
+    Builder.CreateStore(Elt, Builder.CreateConstGEP1_32(Elts, i));
+  }
+
+  PointerType *DoublePtrTy = PointerType::get(DoubleType, 0);
+  std::vector<Value*> Args;
+  Args.push_back(EltTy == DVecType ? Elts : ConstantPointerNull::get(DVecPtrType));
+  Args.push_back(EltTy == DVecType ? ConstantPointerNull::get(DoublePtrTy) : Elts);
+  Args.push_back(ConstantInt::get(Int32Ty, N));
+  Builder.CreateCall(TheModule->getFunction("vector_print"), Args);
+}
+
 Function *FunctionAST::Codegen() {
   NamedValues.clear();
+  TempSlots.reset();
   
   Function *TheFunction = Proto->Codegen();
   if (TheFunction == 0)
@@ -1245,7 +5330,19 @@ Function *FunctionAST::Codegen() {
   // Add all arguments to the symbol table and create their allocas.
   Proto->CreateArgumentAllocas(TheFunction);
 
-  if (Value *RetVal = Body->Codegen()) {
+  // A returned vector is handed over to the caller with a reference.
+  if (Value *RetVal = CodegenOwned(Body)) {
+    ResultType = RetVal->getType();
+    if (TopLevel && ResultType != DoubleType) {
+      EmitPrintResult(RetVal);
+      if (HoldsVectors(ResultType))
+        EmitVectorRelease(RetVal);
+      RetVal = ConstantFP::get(getGlobalContext(), APFloat(0.0));
+    }
+
+    Proto->ReleaseVectorArguments();
+    TempSlots.emitFree();
+
     // Finish off the function.
     Builder.CreateRet(RetVal);
 
@@ -1254,6 +5351,11 @@ Function *FunctionAST::Codegen() {
 
     // Optimize the function.
     TheFPM->run(*TheFunction);
+
+    // Let callers CSE and speculate calls to it, see IfExprAST::shouldSelect.
+    // Functions with loops are left alone, as they might not terminate.
+    if (Proto->isScalar() && IsPureExpr(Body))
+      TheFunction->setDoesNotAccessMemory();
     
     return TheFunction;
   }
@@ -1270,8 +5372,6 @@ Function *FunctionAST::Codegen() {
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
-static ExecutionEngine *TheExecutionEngine;
-
 static void HandleDefinition() {
   if (FunctionAST *F = ParseDefinition()) {
     if (Function *LF = F->Codegen()) {
@@ -1284,9 +5384,35 @@ static void HandleDefinition() {
   }
 }
 
+static void HandleGlobal() {
+  if (FunctionAST *F = ParseGlobal()) {
+    if (Function *LF = F->Codegen()) {
+      // Run the allocation now, so the vector exists for what follows.
+      void *FPtr = TheExecutionEngine->getPointerToFunction(LF);
+      double (*FP)() = (double (*)())(intptr_t)FPtr;
+      FP();
+      SyncAllLaunches();
+      fprintf(stderr, "Read global definition\n");
+    }
+  } else {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
+/// PureLibraryFunctions - Externs from the C math library, which do not have
+/// side effects.
+static const char *PureLibraryFunctions[] = {
+  "sqrt", "exp", "log", "pow", "sin", "cos", "tan", "fabs", "floor", "ceil", 0
+};
+
 static void HandleExtern() {
   if (PrototypeAST *P = ParseExtern()) {
     if (Function *F = P->Codegen()) {
+      for (const char **Name = PureLibraryFunctions; *Name; ++Name)
+        if (F->getName() == *Name && F->empty())
+          F->setDoesNotAccessMemory();
+
       fprintf(stderr, "Read extern: ");
       F->dump();
     }
@@ -1306,7 +5432,12 @@ static void HandleTopLevelExpression() {
       // Cast it to the right type (takes no arguments, returns a double) so we
       // can call it as a native function.
       double (*FP)() = (double (*)())(intptr_t)FPtr;
-      fprintf(stderr, "Evaluated to %f\n", FP());
+      double Result = FP();
+
+      // Finish the maps still running before the next statement.
+      SyncAllLaunches();
+      if (F->getResultType() == DoubleType)
+        fprintf(stderr, "Evaluated to %f\n", Result);
     }
   } else {
     // Skip token for error recovery.
@@ -1314,7 +5445,7 @@ static void HandleTopLevelExpression() {
   }
 }
 
-/// top ::= definition | external | expression | ';'
+/// top ::= definition | external | global | expression | ';'
 static void MainLoop() {
   while (1) {
     if (Infile == stdin) fprintf(stderr, "ready> ");
@@ -1323,6 +5454,7 @@ static void MainLoop() {
     case ';':        getNextToken(); break;  // ignore top-level semicolons.
     case tok_def:    HandleDefinition(); break;
     case tok_extern: HandleExtern(); break;
+    case tok_global: HandleGlobal(); break;
     default:         HandleTopLevelExpression(); break;
     }
   }
@@ -1365,6 +5497,32 @@ double printVector(DVector x) {
   return 0;
 }
 
+/// vector_print -- print the value of a top-level expression that is not a
+/// number: the n vectors in vecs, a vector or a tuple of them, or else the
+/// tuple of the n numbers in nums.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_print(DVector *vecs, double *nums, int n) {
+  if (vecs == NULL) {
+    fprintf(stderr, "Evaluated to tuple(");
+    for (int i = 0; i < n; i++)
+      fprintf(stderr, i ? ", %f" : "%f", nums[i]);
+    fprintf(stderr, ")\n");
+    return;
+  }
+
+  for (int v = 0; v < n; v++) {
+    if (vecs[v].ptr)
+      SyncHostBuffer(vecs[v].ptr);
+    fprintf(stderr, "Evaluated to vector of %d", vecs[v].length);
+    for (int i = 0; i < vecs[v].length; i++)
+      fprintf(stderr, i % 10 ? " %0.2f" : "\n  %0.2f", vecs[v].ptr[i]);
+    fprintf(stderr, "\n");
+  }
+}
+
 /// vector_malloc -- allocate memory for a DVector
 extern "C" 
 #ifdef WIN32
@@ -1372,19 +5530,124 @@ __declspec(dllexport)
 #endif
 void vector_malloc(DVector *vp, double dlength) 
 {
-  int bytes = (int) (sizeof(double)*dlength);
-  vp->ptr = (double *)malloc(bytes);
   vp->length = dlength;
+  vp->ptr = AllocVectorStorage(vp->length);
+}
+
+/// vector_init_inline -- set up the header of a vector whose storage is in
+/// the stack frame of generated code.  It is never freed, so reference
+/// counting is switched off for it.
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_init_inline(double *ptr, int length) 
+{
+  GetVectorHeader(ptr)->refcount = -1;
+  GetVectorHeader(ptr)->capacity = length;
+  GetVectorHeader(ptr)->version = NewVectorVersion();
+}
+
+/// vector_sync -- wait until no map uses the elements of a DVector, see
+/// AsyncMaps
+extern "C"
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_sync(double *ptr)
+{
+  if (ptr)
+    SyncHostBuffer(ptr);
+}
+
+/// vector_queue_call -- queue run(env), a call of one of QueuedExterns, 
+/// whose size bytes of arguments are at env and which writes the vectors 
+/// whose elements are outputs, see QueueHostCall.  A call writing a vector
+/// on the stack, which dies with its frame, runs at once.
+extern "C"
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_queue_call(char *run, char *env, int size, double **outputs,
+                       int noutputs)
+{
+  void (*Run)(char *) = (void (*)(char *))run;
+  std::vector<void *> bufs;
+  for (int i = 0; i < noutputs; i++) {
+    if (outputs[i] == NULL)
+      continue;
+    if (GetVectorHeader(outputs[i])->refcount < 0) {
+      Run(env);
+      return;
+    }
+    bufs.push_back(outputs[i]);
+  }
+  char *copy = (char *)malloc(size);
+  memcpy(copy, env, size);
+  QueueHostCall(Run, copy, bufs.empty() ? NULL : &bufs[0], bufs.size());
+}
+
+/// vector_touch -- record that the contents of a DVector have been written
+extern "C"
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_touch(double *ptr)
+{
+  if (ptr)
+    GetVectorHeader(ptr)->version = NewVectorVersion();
+}
+
+/// vector_generate -- materialize the vector of length elements
+/// start + i * step into res, stored in the buffer of slot if that can be
+/// recycled
+extern "C" 
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_generate(DVector *res, DVector *slot, double start, double step, 
+                     int length) 
+{
+  res->length = length;
+  res->ptr = AcquireVectorStorage(slot, length);
+  if (res->ptr == NULL) {
+    fprintf(stderr, "Could not allocate host memory\n");
+    return;
+  }
+  for (int i = 0; i < length; i++)
+    res->ptr[i] = start + i * step;
+}
+
+/// vector_retain -- add a reference to the storage of a DVector
+extern "C"
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_retain(double *ptr)
+{
+  if (ptr && GetVectorHeader(ptr)->refcount > 0)
+    GetVectorHeader(ptr)->refcount++;
 }
 
-/// free_vector -- free memory for a DVector
+/// vector_release -- drop a reference to the storage of a DVector, freeing
+/// it once the last one is gone
+extern "C"
+#ifdef WIN32
+__declspec(dllexport)
+#endif
+void vector_release(double *ptr)
+{
+  ReleaseVectorStorage(ptr);
+}
+
+/// free_vector -- drop the reference a 'var vector' binding holds
 extern "C"
 #ifdef WIN32
 __declspec(dllexport)
 #endif
 void vector_free(DVector *vp)
 {
-  free(vp->ptr);
+  vector_release(vp->ptr);
 }
 
 extern "C"
@@ -1392,8 +5655,15 @@ extern "C"
 __declspec(dllexport)
 #endif
 void randVector(DVector x, double range) {
-  for (int i = 0; i < x.length; i++)
-    x.ptr[i] = range * (double)rand() / (double)RAND_MAX;
+  // Queued calls run together (see QueuedExterns), so each draws from a 
+  // generator of its own, seeded from rand().
+  uint64_t state;
+#pragma omp critical(randVector)
+  state = rand();
+  for (int i = 0; i < x.length; i++) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    x.ptr[i] = range * (double)(state >> 11) / 9007199254740992.0;
+  }
 }
 
 
@@ -1420,6 +5690,23 @@ void InitTypes() {
   }
 
   DVecPtrType = PointerType::get(DVecType, 0); 
+
+  // Create map argument type
+  MapArgType = TheModule->getTypeByName("maparg");
+  if (!MapArgType) {
+    MapArgType = StructType::create(getGlobalContext(), "maparg");
+  }
+
+  std::vector<Type *> argfields;
+  argfields.push_back(PointerType::get(DoubleType, 0));
+  argfields.push_back(Type::getInt32Ty(getGlobalContext()));
+  argfields.push_back(Type::getInt32Ty(getGlobalContext()));
+  argfields.push_back(DoubleType);
+  argfields.push_back(DoubleType);
+
+  if (MapArgType->isOpaque()) {
+    MapArgType->setBody(argfields, /*isPacked=*/false);
+  }
 }
 
 void Init() {
@@ -1438,22 +5725,114 @@ void Init() {
   Function *vector_freeFunc = Function::Create(vector_freeType, Function::ExternalLinkage, "vector_free", TheModule); 
   TheExecutionEngine->addGlobalMapping(vector_freeFunc, (void *)vector_free);
 
-  // declare vector_map  
+  // declare vector_init_inline
+  std::vector<Type *> init_paramTypes;
+  init_paramTypes.push_back(PointerType::get(DoubleType, 0));
+  init_paramTypes.push_back(Type::getInt32Ty(getGlobalContext()));
+  FunctionType *vector_initType = FunctionType::get(Type::getVoidTy(getGlobalContext()), init_paramTypes, false);
+  Function *vector_initFunc = Function::Create(vector_initType, Function::ExternalLinkage, "vector_init_inline", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_initFunc, (void *)vector_init_inline);
+
+  // declare vector_generate
+  std::vector<Type *> generate_paramTypes;
+  generate_paramTypes.push_back(DVecPtrType);
+  generate_paramTypes.push_back(DVecPtrType);
+  generate_paramTypes.push_back(DoubleType);
+  generate_paramTypes.push_back(DoubleType);
+  generate_paramTypes.push_back(Type::getInt32Ty(getGlobalContext()));
+  FunctionType *vector_generateType = FunctionType::get(Type::getVoidTy(getGlobalContext()), generate_paramTypes, false);
+  Function *vector_generateFunc = Function::Create(vector_generateType, Function::ExternalLinkage, "vector_generate", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_generateFunc, (void *)vector_generate);
+
+  // declare vector_retain and vector_release
+  std::vector<Type *> ref_paramTypes;
+  ref_paramTypes.push_back(PointerType::get(DoubleType, 0));
+  FunctionType *vector_refType = FunctionType::get(Type::getVoidTy(getGlobalContext()), ref_paramTypes, false);
+  Function *vector_retainFunc = Function::Create(vector_refType, Function::ExternalLinkage, "vector_retain", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_retainFunc, (void *)vector_retain);
+  Function *vector_releaseFunc = Function::Create(vector_refType, Function::ExternalLinkage, "vector_release", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_releaseFunc, (void *)vector_release);
+  Function *vector_touchFunc = Function::Create(vector_refType, Function::ExternalLinkage, "vector_touch", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_touchFunc, (void *)vector_touch);
+  Function *vector_syncFunc = Function::Create(vector_refType, Function::ExternalLinkage, "vector_sync", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_syncFunc, (void *)vector_sync);
+
+  // declare vector_queue_call
+  Type *CharPtrTy = PointerType::getUnqual(Type::getInt8Ty(getGlobalContext()));
+  std::vector<Type *> queue_params;
+  queue_params.push_back(CharPtrTy);
+  queue_params.push_back(CharPtrTy);
+  queue_params.push_back(Type::getInt32Ty(getGlobalContext()));
+  queue_params.push_back(PointerType::get(PointerType::get(DoubleType, 0), 0));
+  queue_params.push_back(Type::getInt32Ty(getGlobalContext()));
+  FunctionType *vector_queue_callType = FunctionType::get(Type::getVoidTy(getGlobalContext()), queue_params, false);
+  Function *vector_queue_callFunc = Function::Create(vector_queue_callType, Function::ExternalLinkage, "vector_queue_call", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_queue_callFunc, (void *)vector_queue_call);
+
+  // declare vector_print
+  std::vector<Type *> print_params;
+  print_params.push_back(DVecPtrType);
+  print_params.push_back(PointerType::get(DoubleType, 0));
+  print_params.push_back(Type::getInt32Ty(getGlobalContext()));
+  FunctionType *vector_printType = FunctionType::get(Type::getVoidTy(getGlobalContext()), print_params, false);
+  Function *vector_printFunc = Function::Create(vector_printType, Function::ExternalLinkage, "vector_print", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_printFunc, (void *)vector_print);
+
+  // declare vector_map_planned and vector_map_chain, which the trampolines
+  // of map call sites call, see EmitMapDispatch
+  Type *Int32Ty = Type::getInt32Ty(getGlobalContext());
   std::vector<Type *> map_params;
   map_params.push_back(PointerType::getUnqual(Type::getInt8Ty(getGlobalContext()))); 
+  map_params.push_back(Int32Ty);
+  map_params.push_back(PointerType::getUnqual(MapArgType)); 
   map_params.push_back(DVecPtrType); 
-  map_params.push_back(DVecPtrType); 
+  map_params.push_back(PointerType::getUnqual(DVecPtrType)); 
   FunctionType *vector_mapType = FunctionType::get(Type::getVoidTy(getGlobalContext()), map_params, false); 
-  Function *vector_mapFunc = Function::Create(vector_mapType, Function::ExternalLinkage, "vector_map", TheModule);
-  TheExecutionEngine->addGlobalMapping(vector_mapFunc, (void *)vector_map);
+  Function *vector_mapFunc = Function::Create(vector_mapType, Function::ExternalLinkage, "vector_map_planned", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_mapFunc, (void *)vector_map_planned);
+  Function *vector_map_chainFunc = Function::Create(vector_mapType, Function::ExternalLinkage, "vector_map_chain", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_map_chainFunc, (void *)vector_map_chain);
+
+  // declare vector_map_batch
+  std::vector<Type *> batch_params;
+  batch_params.push_back(PointerType::getUnqual(Type::getInt8Ty(getGlobalContext()))); 
+  batch_params.push_back(Int32Ty);
+  batch_params.push_back(Int32Ty);
+  batch_params.push_back(DVecPtrType); 
+  batch_params.push_back(DVecPtrType); 
+  batch_params.push_back(PointerType::getUnqual(DVecPtrType)); 
+  FunctionType *vector_map_batchType = FunctionType::get(Type::getVoidTy(getGlobalContext()), batch_params, false); 
+  Function *vector_map_batchFunc = Function::Create(vector_map_batchType, Function::ExternalLinkage, "vector_map_batch", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_map_batchFunc, (void *)vector_map_batch);
+
+  // declare vector_stats, which the trampolines of stats call sites call
+  std::vector<Type *> stats_params(map_params);
+  stats_params[3] = PointerType::get(DoubleType, 0);
+  FunctionType *vector_statsType = FunctionType::get(Type::getVoidTy(getGlobalContext()), stats_params, false); 
+  Function *vector_statsFunc = Function::Create(vector_statsType, Function::ExternalLinkage, "vector_stats", TheModule);
+  TheExecutionEngine->addGlobalMapping(vector_statsFunc, (void *)vector_stats);
+
+  // declare the runtime functions of the vector library, see BuiltinInfo
+  std::vector<Type *> builtin_params;
+  builtin_params.push_back(DVecPtrType);
+  builtin_params.push_back(PointerType::get(DoubleType, 0));
+  builtin_params.push_back(DVecPtrType);
+  builtin_params.push_back(PointerType::get(DoubleType, 0));
+  builtin_params.push_back(PointerType::getUnqual(DVecPtrType)); 
+  FunctionType *builtinType = FunctionType::get(Type::getVoidTy(getGlobalContext()), builtin_params, false); 
+  for (unsigned i = 0; i < sizeof(Builtins) / sizeof(Builtins[0]); i++) {
+    Function *builtinFunc = Function::Create(builtinType, Function::ExternalLinkage, Builtins[i].Runtime, TheModule);
+    TheExecutionEngine->addGlobalMapping(builtinFunc, (void *)Builtins[i].Fn);
+  }
 }
 
 int main(int argc, char** argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope on CUDA\n");
 
-  if (argc > 1) {
-    Infile = fopen(argv[1], "r");
+  if (InputFilename != "-") {
+    Infile = fopen(InputFilename.c_str(), "r");
     if (!Infile) {
-      fprintf(stderr, "Error opening input file %s\n", argv[1]);
+      fprintf(stderr, "Error opening input file %s\n", InputFilename.c_str());
       exit(-1);
     }
   }